@@ -0,0 +1,828 @@
+#include "cache.h"
+#include "http_response.h"
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+struct lru_cache cache;
+
+// Reader slot of the calling thread, registered on its first lookup
+static __thread struct cache_reader* this_reader;
+
+static struct cache_shard* shard_of(unsigned long long hash){
+    // The buckets use the low bits of the hash, the shard is picked from a
+    // remix of the high ones so both stay evenly spread
+    unsigned mixed = (unsigned)(hash >> 32) * 2654435761u;
+    return &cache.shards[((unsigned long long)mixed * cache.nshards) >> 32];
+}
+
+static long long elapsed_ns(struct timespec* from, struct timespec* to){
+    return (long long)(to->tv_sec - from->tv_sec) * 1000000000LL +
+           (to->tv_nsec - from->tv_nsec);
+}
+
+// Takes the shard lock, timing how long we had to wait for it
+static void shard_lock(struct cache_shard* s){
+    if (pthread_mutex_trylock(&s->lock) != 0) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&s->lock);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        s->contended++;
+        s->wait_ns += elapsed_ns(&start, &end);
+    }
+    s->acquisitions++;
+}
+
+static struct cache_table* table_create(unsigned nbuckets){
+    struct cache_table* t = (struct cache_table*)calloc(1, sizeof(struct cache_table));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->buckets = (cache_element**)calloc(nbuckets, sizeof(cache_element*));
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
+    t->mask = nbuckets - 1;
+    return t;
+}
+
+static void table_free(struct cache_table* t){
+    free(t->buckets);
+    free(t);
+}
+
+// Bytes of the chunk an element uses: its header, the table of its parts
+// and the url, NUL terminated. A small element's data follows, also NUL
+// terminated, a large one is in segments.
+static size_t header_bytes(int nparts, int url_len){
+    return sizeof(cache_element) + nparts * sizeof(struct iovec) + url_len + 1;
+}
+
+static size_t inline_bytes(int len, int url_len){
+    return header_bytes(1, url_len) + len + 1;
+}
+
+// Whether len bytes of data are kept in the element's own chunk. Anything
+// up to a segment is, so the header block is never split.
+static int fits_inline(int len, int url_len){
+    return inline_bytes(len, url_len) <= CACHE_SEGMENT_SIZE;
+}
+
+static void element_free(cache_element* e){
+    if (!e->segmented) {
+        slab_free(e, inline_bytes(e->len, e->url_len));
+        return;
+    }
+    for (int i = 0; i < e->nparts; i++) {
+        slab_free(e->parts[i].iov_base, CACHE_SEGMENT_SIZE);
+    }
+    slab_free(e, header_bytes(e->nparts, e->url_len));
+}
+
+// Allocates an element with room for nparts parts, its data still unset
+static cache_element* element_create(size_t bytes, int nparts,
+                                     const struct cache_key* key){
+    cache_element* element = (cache_element*)slab_alloc(bytes);
+    if (element == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memset(element, 0, sizeof(cache_element));
+    element->parts = (struct iovec*)(element + 1);
+    element->nparts = nparts;
+    element->url = (char*)(element->parts + nparts);
+    memcpy(element->url, key->url, key->len + 1);
+    element->url_len = key->len;
+    element->lru_time_track = time(NULL);
+    element->hash = key->hash;
+    element->refs = 1;
+    element->window = 1;
+    return element;
+}
+
+// Slot of the calling thread, registered with the cache the first time
+static struct cache_reader* reader_slot(){
+    struct cache_reader* r = this_reader;
+    if (r == NULL) {
+        r = (struct cache_reader*)calloc(1, sizeof(struct cache_reader));
+        if (r == NULL) {
+            perror("Memory allocation failed");
+            exit(1);
+        }
+        r->next = __atomic_load_n(&cache.readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&cache.readers, &r->next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        this_reader = r;
+    }
+    return r;
+}
+
+// Only the owner writes its counters, others may read them
+static void count(long long* counter, long long n){
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Read side of the epoch scheme. Between reader_enter() and reader_exit()
+// nothing this thread can reach through the table is freed.
+static void reader_enter(){
+    struct cache_reader* r = reader_slot();
+    __atomic_store_n(&r->epoch, __atomic_load_n(&cache.epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+    // Pairs with the fence in reclaim(): either the writer sees us, or we
+    // do not see what it unlinked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void reader_exit(){
+    __atomic_store_n(&this_reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Oldest epoch a reader is still in, LLONG_MAX if none is reading
+static long long oldest_reader(){
+    long long oldest = LLONG_MAX;
+    struct cache_reader* r = __atomic_load_n(&cache.readers, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        long long epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+// Frees whatever was retired before the oldest running lookup started.
+// Elements are only freed once their last reader released them too.
+// Called with the shard lock held.
+static void reclaim(struct cache_shard* s){
+    if (s->retired == NULL && s->retired_tables == NULL) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long long safe = oldest_reader();
+
+    cache_element** p = &s->retired;
+    while (*p != NULL) {
+        cache_element* e = *p;
+        if (e->retire_epoch < safe) {
+            *p = e->next;
+            cache_release(e);
+        } else {
+            p = &e->next;
+        }
+    }
+    struct cache_table** t = &s->retired_tables;
+    while (*t != NULL) {
+        struct cache_table* table = *t;
+        if (table->retire_epoch < safe) {
+            *t = table->retired_next;
+            table_free(table);
+        } else {
+            t = &table->retired_next;
+        }
+    }
+}
+
+static cache_element* lookup(struct cache_shard* s, const struct cache_key* key){
+    struct cache_table* t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+    cache_element* e = __atomic_load_n(&t->buckets[key->hash & t->mask], __ATOMIC_ACQUIRE);
+    while (e != NULL && (e->hash != key->hash || e->url_len != key->len ||
+                         memcmp(e->url, key->url, key->len))) {
+        e = __atomic_load_n(&e->hash_next, __ATOMIC_ACQUIRE);
+    }
+    return e;
+}
+
+// Doubles the hash table once it holds more elements than buckets, which
+// keeps the chains at about one element each. Readers still walking the
+// old table may miss an element while it is moved, never loop or touch
+// freed memory.
+static void grow_table(struct cache_shard* s){
+    struct cache_table* old = s->table;
+    struct cache_table* t = table_create((old->mask + 1) * 2);
+    if (t == NULL) {
+        // Longer chains, but still correct
+        return;
+    }
+    for (unsigned b = 0; b <= old->mask; b++) {
+        cache_element* e = old->buckets[b];
+        while (e != NULL) {
+            cache_element* following = e->hash_next;
+            __atomic_store_n(&e->hash_next, t->buckets[e->hash & t->mask],
+                             __ATOMIC_RELEASE);
+            t->buckets[e->hash & t->mask] = e;
+            e = following;
+        }
+    }
+    __atomic_store_n(&s->table, t, __ATOMIC_RELEASE);
+    old->retire_epoch = __atomic_fetch_add(&cache.epoch, 1, __ATOMIC_ACQ_REL);
+    old->retired_next = s->retired_tables;
+    s->retired_tables = old;
+}
+
+// Unlinks e from the table and from the window or the eviction policy,
+// evicted says whether it was chosen for eviction. It is freed later by
+// reclaim(), lookups that are running may still be on it. Called with the
+// shard lock held.
+static void retire_element(struct cache_shard* s, cache_element* e, int evicted){
+    cache_element** p = &s->table->buckets[e->hash & s->table->mask];
+    while (*p != e) {
+        p = &(*p)->hash_next;
+    }
+    __atomic_store_n(p, e->hash_next, __ATOMIC_RELEASE);
+    if (e->window) {
+        cache_list_unlink(&s->window, e);
+    } else {
+        eviction_remove(&s->main, e, evicted);
+    }
+    s->count--;
+    s->size -= e->size;
+    timer_wheel_remove(&s->expiry, e);
+    if (evicted && cache.demote != NULL) {
+        cache.demote(e);
+    }
+
+    e->retire_epoch = __atomic_fetch_add(&cache.epoch, 1, __ATOMIC_ACQ_REL);
+    e->next = s->retired;
+    s->retired = e;
+}
+
+// Bytes of a shard kept for its window. It always fits an element that is
+// not segmented, a larger one stays in it alone until the next one comes.
+static long long window_size(struct cache_shard* s){
+    long long size = s->max_size * CACHE_WINDOW_PERCENT / 100;
+    return size > CACHE_SEGMENT_SIZE ? size : CACHE_SEGMENT_SIZE;
+}
+
+// Moves the oldest element of the window to the main part. If main has no
+// room for it, it only gets in when the sketch counted more lookups of it
+// than of every element it evicts, otherwise it is dropped.
+static void admit_from_window(struct cache_shard* s){
+    cache_element* candidate = s->window.tail;
+    long long main_max = s->max_size - window_size(s);
+    int frequency = -1;
+    while (s->main.size + candidate->size > main_max) {
+        cache_element* victim = eviction_victim(&s->main, main_max);
+        if (victim == NULL) {
+            break;
+        }
+        if (cache.admission) {
+            if (frequency < 0) {
+                frequency = sketch_estimate(&s->sketch, candidate->hash);
+            }
+            if (sketch_estimate(&s->sketch, victim->hash) >= frequency) {
+                retire_element(s, candidate, 1);
+                s->rejected++;
+                return;
+            }
+        }
+        retire_element(s, victim, 1);
+    }
+    cache_list_unlink(&s->window, candidate);
+    candidate->window = 0;
+    eviction_insert(&s->main, candidate);
+    s->admitted++;
+}
+
+// Element the shard evicts next when it has to: the policy's victim, or
+// the oldest of the window while main is empty
+static cache_element* next_victim(struct cache_shard* s){
+    cache_element* victim = eviction_victim(&s->main, s->max_size - window_size(s));
+    return victim != NULL ? victim : s->window.tail;
+}
+
+void cache_init(long long max_size, int max_element_size, int nshards,
+                const struct eviction_policy* policy, int admission){
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if (slabs.nclasses == 0) {
+        slab_init();
+    }
+    cache.shards = (struct cache_shard*)calloc(nshards, sizeof(struct cache_shard));
+    if (cache.shards == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    cache.nshards = nshards;
+    cache.max_element_size = max_element_size;
+    cache.policy = policy;
+    cache.admission = admission;
+    cache.demote = NULL;
+    cache.default_ttl = 0;
+    cache.revalidate_window = 0;
+    cache.stale_window = 0;
+    cache.epoch = 1;
+    // Threads stay registered, their counters start over
+    for (struct cache_reader* r = cache.readers; r != NULL; r = r->next) {
+        r->hits = r->misses = r->hit_bytes = r->fill_bytes = 0;
+    }
+    for (int i = 0; i < nshards; i++) {
+        struct cache_shard* s = &cache.shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->table = table_create(CACHE_MIN_BUCKETS);
+        if (s->table == NULL) {
+            perror("Memory allocation failed");
+            exit(1);
+        }
+        s->max_size = max_size / nshards;
+        // About one counter and ghost per element the shard can hold
+        long long width = s->max_size / 2048;
+        width = width < 1024 ? 1024 : width > 65536 ? 65536 : width;
+        sketch_init(&s->sketch, width);
+        eviction_init(&s->main, policy, width);
+        timer_wheel_init(&s->expiry, time(NULL));
+    }
+}
+
+void cache_destroy(){
+    for (int i = 0; i < cache.nshards; i++) {
+        struct cache_shard* s = &cache.shards[i];
+        while (s->window.head != NULL) {
+            retire_element(s, s->window.head, 0);
+        }
+        cache_element* e;
+        while ((e = eviction_victim(&s->main, 0)) != NULL) {
+            retire_element(s, e, 0);
+        }
+        while (s->retired != NULL) {
+            cache_element* e = s->retired;
+            s->retired = e->next;
+            element_free(e);
+        }
+        while (s->retired_tables != NULL) {
+            struct cache_table* t = s->retired_tables;
+            s->retired_tables = t->retired_next;
+            table_free(t);
+        }
+        table_free(s->table);
+        sketch_destroy(&s->sketch);
+        eviction_destroy(&s->main);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(cache.shards);
+    cache.shards = NULL;
+    cache.nshards = 0;
+}
+
+// Takes a reference on the element cached under key, NULL if there is none
+// or it expired and stale is not set
+static cache_element* lookup_element(struct cache_shard* s, const struct cache_key* key,
+                                     int stale){
+    reader_enter();
+    cache_element* site = lookup(s, key);
+    if (site != NULL) {
+        // The cache's own reference keeps it alive until we leave, so it is
+        // safe to take ours
+        __atomic_add_fetch(&site->refs, 1, __ATOMIC_RELAXED);
+    }
+    reader_exit();
+
+    if (site != NULL && !stale && site->expires != 0 &&
+        __atomic_load_n(&site->expires, __ATOMIC_RELAXED) <= time(NULL)) {
+        // Stale, kept for revalidation or the sweeper has not got to it yet
+        cache_release(site);
+        site = NULL;
+    }
+    return site;
+}
+
+cache_element* find(const struct cache_key* key){
+    struct cache_shard* s = shard_of(key->hash);
+    sketch_increment(&s->sketch, key->hash);
+
+    cache_element* site = lookup_element(s, key, 0);
+    if (site != NULL) {
+        time_t now = time(NULL);
+        if (__atomic_load_n(&site->lru_time_track, __ATOMIC_RELAXED) != now) {
+            __atomic_store_n(&site->lru_time_track, now, __ATOMIC_RELAXED);
+        }
+        // Hot elements stop writing to their cache line once it saturates
+        int hits = __atomic_load_n(&site->hits, __ATOMIC_RELAXED);
+        if (hits < CACHE_MAX_HITS) {
+            __atomic_store_n(&site->hits, hits + 1, __ATOMIC_RELAXED);
+        }
+        count(&this_reader->hits, 1);
+        count(&this_reader->hit_bytes, site->len);
+    } else {
+        count(&this_reader->misses, 1);
+    }
+    return site;
+}
+
+cache_element* cache_peek(const struct cache_key* key, int stale){
+    return lookup_element(shard_of(key->hash), key, stale);
+}
+
+void cache_release(cache_element* element){
+    if (__atomic_sub_fetch(&element->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        element_free(element);
+    }
+}
+
+void remove_cache_element(){
+    // Policies do not compare across shards, take from the one using the
+    // largest share of its budget
+    struct cache_shard* fullest = NULL;
+    double fullest_fill = 0;
+    for (int i = 0; i < cache.nshards; i++) {
+        struct cache_shard* s = &cache.shards[i];
+        shard_lock(s);
+        double fill = (double)s->size / s->max_size;
+        if (s->count > 0 && (fullest == NULL || fill > fullest_fill)) {
+            fullest = s;
+            fullest_fill = fill;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (fullest != NULL) {
+        shard_lock(fullest);
+        cache_element* victim = next_victim(fullest);
+        if (victim != NULL) {
+            retire_element(fullest, victim, 1);
+        }
+        reclaim(fullest);
+        pthread_mutex_unlock(&fullest->lock);
+    }
+}
+
+// Makes a finished element reachable in the window of its shard. Returns 0
+// and frees it if it would not fit the shard by itself, or if the key is
+// cached already and replace is not set.
+static int insert_element(cache_element* element, const struct cache_key* key,
+                          int replace){
+    struct cache_shard* s = shard_of(element->hash);
+    int len = element->len;
+    if (element->size > s->max_size) {
+        element_free(element);
+        return 0;
+    }
+    shard_lock(s);
+    // A newer response replaces the one we had
+    cache_element* old = lookup(s, key);
+    if (old != NULL && !replace) {
+        pthread_mutex_unlock(&s->lock);
+        element_free(element);
+        return 0;
+    }
+    if (old != NULL) {
+        retire_element(s, old, 0);
+    }
+    if (s->count > s->table->mask) {
+        grow_table(s);
+    }
+    if (element->retire_at != 0) {
+        timer_wheel_add(&s->expiry, element);
+    }
+    // Fully built before readers can reach it
+    cache_element** bucket = &s->table->buckets[element->hash & s->table->mask];
+    element->hash_next = *bucket;
+    __atomic_store_n(bucket, element, __ATOMIC_RELEASE);
+    cache_list_push_front(&s->window, element);
+    s->count++;
+    s->size += element->size;
+    // What the new element pushes out of the window has to earn its place
+    // in main
+    long long window_max = window_size(s);
+    while (s->window.size > window_max && s->window.tail != element) {
+        admit_from_window(s);
+    }
+    // Only left over budget when the shard is smaller than a few elements
+    cache_element* victim;
+    while (s->size > s->max_size && (victim = next_victim(s)) != element) {
+        retire_element(s, victim, 1);
+    }
+    reclaim(s);
+    pthread_mutex_unlock(&s->lock);
+    count(&reader_slot()->fill_bytes, len);
+    return 1;
+}
+
+// When a response with this header block (data, len) fetched now expires,
+// 0 if never. fallback_ttl stands in if the headers say nothing.
+static time_t response_expires(const char* data, int len, long fallback_ttl){
+    time_t now = time(NULL);
+    int header_len = http_response_header_end(data, len);
+    long ttl = header_len > 0 ? http_response_ttl(data, header_len, now) : -1;
+    if (ttl < 0) {
+        ttl = fallback_ttl;
+        if (ttl == 0) {
+            return 0;
+        }
+    }
+    return now + ttl;
+}
+
+// When the sweeper retires a response that expires then. It is kept for
+// the stale window after that, and one the origin gave a validator for
+// for the revalidation window if that is longer.
+static time_t retire_time(const char* data, int len, time_t expires){
+    if (expires == 0) {
+        return 0;
+    }
+    char value[256];
+    long keep = cache.stale_window;
+    int header_len = http_response_header_end(data, len);
+    if (header_len > 0 && cache.revalidate_window > keep &&
+        (http_response_header(data, header_len, "ETag", value, sizeof(value)) >= 0 ||
+         http_response_header(data, header_len, "Last-Modified", value,
+                              sizeof(value)) >= 0)) {
+        keep = cache.revalidate_window;
+    }
+    return expires + keep;
+}
+
+int cache_refresh(cache_element* element, const char* header, int header_len){
+    // The 304 says how long the response is fresh now, or else what we
+    // stored does, counted from this validation
+    time_t now = time(NULL);
+    int stored_len = element->parts[0].iov_len;
+    long ttl = http_response_ttl(header, header_len, now);
+    time_t expires = ttl >= 0 ? now + ttl :
+                     response_expires(element->data, stored_len, cache.default_ttl);
+    struct cache_shard* s = shard_of(element->hash);
+    shard_lock(s);
+    // Retired meanwhile, it only serves the requests that hold it
+    int linked = element->retire_epoch == 0;
+    if (linked) {
+        timer_wheel_remove(&s->expiry, element);
+        __atomic_store_n(&element->expires, expires, __ATOMIC_RELAXED);
+        element->retire_at = retire_time(element->data, stored_len, expires);
+        if (element->retire_at != 0) {
+            timer_wheel_add(&s->expiry, element);
+        }
+        s->refreshed++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return linked;
+}
+
+static int fill_finish(struct cache_fill* fill, const struct cache_key* key,
+                       int replace, time_t expires);
+
+static int add_element(char* data, int size, const struct cache_key* key,
+                       int replace, time_t expires){
+    if (size > cache.max_element_size) {
+        // element is too big, it is only relayed
+        return 0;
+    }
+    time_t retire_at = retire_time(data, size, expires);
+    if (retire_at != 0 && retire_at <= time(NULL)) {
+        // Stale and cannot be revalidated, nobody will get to see it
+        return 0;
+    }
+    if (fits_inline(size, key->len)) {
+        // Copy outside of the lock
+        size_t bytes = inline_bytes(size, key->len);
+        cache_element* element = element_create(bytes, 1, key);
+        if (element == NULL) {
+            return 0;
+        }
+        element->data = element->url + key->len + 1;
+        // Responses are binary and not NUL terminated, strcpy would overrun
+        memcpy(element->data, data, size);
+        element->data[size] = '\0';
+        element->len = size;
+        element->parts[0].iov_base = element->data;
+        element->parts[0].iov_len = size;
+        // What the shard is charged is exactly the chunk it takes
+        element->size = slab_chunk_size(bytes);
+        element->expires = expires;
+        element->retire_at = retire_at;
+        return insert_element(element, key, replace);
+    }
+    struct cache_fill fill;
+    cache_fill_init(&fill);
+    if (cache_fill_append(&fill, data, size) < 0) {
+        return 0;
+    }
+    return fill_finish(&fill, key, replace, expires);
+}
+
+int add_cache_element(char* data, int size, const struct cache_key* key){
+    return add_element(data, size, key, 1,
+                       response_expires(data, size, cache.default_ttl));
+}
+
+int restore_cache_element(char* data, int size, const struct cache_key* key,
+                          time_t expires){
+    return add_element(data, size, key, 0, expires);
+}
+
+void cache_fill_init(struct cache_fill* fill){
+    fill->nsegments = 0;
+    fill->len = 0;
+}
+
+void cache_fill_abort(struct cache_fill* fill){
+    for (int i = 0; i < fill->nsegments; i++) {
+        slab_free(fill->segments[i], CACHE_SEGMENT_SIZE);
+    }
+    fill->nsegments = 0;
+    fill->len = 0;
+}
+
+int cache_fill_append(struct cache_fill* fill, const char* data, int len){
+    if (len > cache.max_element_size - fill->len) {
+        cache_fill_abort(fill);
+        return -1;
+    }
+    while (len > 0) {
+        int used = fill->len % CACHE_SEGMENT_SIZE;
+        if (used == 0 && fill->len / CACHE_SEGMENT_SIZE == fill->nsegments) {
+            char* segment = NULL;
+            if (fill->nsegments == CACHE_MAX_SEGMENTS ||
+                (segment = (char*)slab_alloc(CACHE_SEGMENT_SIZE)) == NULL) {
+                cache_fill_abort(fill);
+                return -1;
+            }
+            fill->segments[fill->nsegments++] = segment;
+        }
+        int n = CACHE_SEGMENT_SIZE - used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(fill->segments[fill->len / CACHE_SEGMENT_SIZE] + used, data, n);
+        fill->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fill_finish(struct cache_fill* fill, const struct cache_key* key,
+                       int replace, time_t expires){
+    if (fill->nsegments == 0) {
+        return 0;
+    }
+    if (fits_inline(fill->len, key->len)) {
+        // Small after all, a chunk of its own size is cheaper than a segment
+        int added = add_element(fill->segments[0], fill->len, key, replace, expires);
+        cache_fill_abort(fill);
+        return added;
+    }
+    time_t retire_at = retire_time(fill->segments[0], CACHE_SEGMENT_SIZE, expires);
+    if (retire_at != 0 && retire_at <= time(NULL)) {
+        cache_fill_abort(fill);
+        return 0;
+    }
+    size_t bytes = header_bytes(fill->nsegments, key->len);
+    cache_element* element = element_create(bytes, fill->nsegments, key);
+    if (element == NULL) {
+        cache_fill_abort(fill);
+        return 0;
+    }
+    for (int i = 0; i < fill->nsegments; i++) {
+        int left = fill->len - i * CACHE_SEGMENT_SIZE;
+        element->parts[i].iov_base = fill->segments[i];
+        element->parts[i].iov_len = left < CACHE_SEGMENT_SIZE ? left : CACHE_SEGMENT_SIZE;
+    }
+    element->segmented = 1;
+    element->data = fill->segments[0];
+    element->len = fill->len;
+    element->size = slab_chunk_size(bytes) +
+                    (long long)fill->nsegments * slab_chunk_size(CACHE_SEGMENT_SIZE);
+    element->expires = expires;
+    element->retire_at = retire_at;
+    // The segments belong to the element now
+    fill->nsegments = 0;
+    fill->len = 0;
+    return insert_element(element, key, replace);
+}
+
+int cache_fill_finish(struct cache_fill* fill, const struct cache_key* key){
+    if (fill->nsegments == 0) {
+        return 0;
+    }
+    int first = fill->len < CACHE_SEGMENT_SIZE ? fill->len : CACHE_SEGMENT_SIZE;
+    return fill_finish(fill, key, 1,
+                       response_expires(fill->segments[0], first, cache.default_ttl));
+}
+
+void cache_element_copy(cache_element* element, char* dst){
+    for (int i = 0; i < element->nparts; i++) {
+        memcpy(dst, element->parts[i].iov_base, element->parts[i].iov_len);
+        dst += element->parts[i].iov_len;
+    }
+}
+
+cache_element** cache_elements(int* count){
+    int n = 0, cap = 0;
+    cache_element** elements = NULL;
+    for (int i = 0; i < cache.nshards; i++) {
+        struct cache_shard* s = &cache.shards[i];
+        shard_lock(s);
+        for (unsigned b = 0; b <= s->table->mask; b++) {
+            for (cache_element* e = s->table->buckets[b]; e != NULL; e = e->hash_next) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    cache_element** grown = (cache_element**)realloc(elements,
+                                                    cap * sizeof(cache_element*));
+                    if (grown == NULL) {
+                        perror("Memory allocation failed");
+                        pthread_mutex_unlock(&s->lock);
+                        *count = n;
+                        return elements;
+                    }
+                    elements = grown;
+                }
+                __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+                elements[n++] = e;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    *count = n;
+    return elements;
+}
+
+void cache_expire(time_t now){
+    for (int i = 0; i < cache.nshards; i++) {
+        struct cache_shard* s = &cache.shards[i];
+        shard_lock(s);
+        cache_element* e = timer_wheel_advance(&s->expiry, now);
+        while (e != NULL) {
+            cache_element* following = e->timer_next;
+            retire_element(s, e, 0);
+            s->expired++;
+            e = following;
+        }
+        reclaim(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void* sweeper_fn(void* arg){
+    while (1) {
+        sleep(CACHE_EXPIRY_INTERVAL);
+        cache_expire(time(NULL));
+    }
+    return NULL;
+}
+
+void cache_start_sweeper(){
+    pthread_t sweeper;
+    if (pthread_create(&sweeper, NULL, sweeper_fn, NULL) != 0) {
+        // Expired elements still are never served, only kept until evicted
+        perror("pthread_create failed");
+        return;
+    }
+    pthread_detach(sweeper);
+}
+
+void cache_shard_stats(int shard, struct shard_stats* stats){
+    struct cache_shard* s = &cache.shards[shard];
+    pthread_mutex_lock(&s->lock);
+    stats->count = s->count;
+    stats->size = s->size;
+    stats->max_size = s->max_size;
+    stats->admitted = s->admitted;
+    stats->rejected = s->rejected;
+    stats->expired = s->expired;
+    stats->refreshed = s->refreshed;
+    stats->acquisitions = s->acquisitions;
+    stats->contended = s->contended;
+    stats->wait_ns = s->wait_ns;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void cache_stats(struct cache_stats* stats){
+    memset(stats, 0, sizeof(*stats));
+    struct cache_reader* r = __atomic_load_n(&cache.readers, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        stats->hits += __atomic_load_n(&r->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&r->misses, __ATOMIC_RELAXED);
+        stats->hit_bytes += __atomic_load_n(&r->hit_bytes, __ATOMIC_RELAXED);
+        stats->fill_bytes += __atomic_load_n(&r->fill_bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void cache_print_stats(){
+    struct cache_stats totals;
+    cache_stats(&totals);
+    // Missed bytes are only known for the responses that were added, so
+    // this is the byte hit ratio of the cacheable responses
+    printf("Cache (%s%s): %lld hits, %lld misses, hit ratio %.3f, "
+           "byte hit ratio %.3f\n", cache.policy->name,
+           cache.admission ? ", admission" : "", totals.hits, totals.misses,
+           totals.hits + totals.misses ? (double)totals.hits / (totals.hits + totals.misses) : 0.0,
+           totals.hit_bytes + totals.fill_bytes ?
+               (double)totals.hit_bytes / (totals.hit_bytes + totals.fill_bytes) : 0.0);
+    for (int i = 0; i < cache.nshards; i++) {
+        struct shard_stats stats;
+        cache_shard_stats(i, &stats);
+        printf("Cache shard %d: %u elements, %lld/%lld bytes, %lld admitted, "
+               "%lld rejected, %lld expired, %lld refreshed, %lld locks, "
+               "%lld contended, %lld us waited\n",
+               i, stats.count, stats.size, stats.max_size, stats.admitted,
+               stats.rejected, stats.expired, stats.refreshed, stats.acquisitions, stats.contended,
+               stats.wait_ns / 1000);
+    }
+    slab_print_stats();
+}
@@ -0,0 +1,253 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "cache_key.h"
+#include "eviction.h"
+#include "frequency_sketch.h"
+#include "timer_wheel.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define CACHE_MIN_BUCKETS 1024
+#define CACHE_WINDOW_PERCENT 1      // share of a shard taken by its window
+#define CACHE_MAX_HITS 15           // cache_element.hits stops counting here
+#define CACHE_SEGMENT_SIZE (64 << 10) // pieces the data of large elements is
+                                      // kept in
+#define CACHE_MAX_SEGMENTS 256
+#define CACHE_EXPIRY_INTERVAL 1     // seconds between sweeps of the wheels
+
+// A cached response. Elements are indexed by a hash table on their key and
+// kept on the lists of the eviction policy, so lookup, touch, insert and
+// eviction never have to walk the cache. The element, its url and the
+// table of its parts share one slab chunk. So does the data of a small
+// response. A large one is kept in segments of CACHE_SEGMENT_SIZE, chunks
+// of their own, and is sent with one sendmsg() over its parts.
+//
+// An element may expire, at a time taken from the response headers or the
+// cache's default TTL. Lookups never return it after that, and the timing
+// wheel of its shard has it retired within a second by the sweeper. If
+// the origin sent an ETag or Last-Modified with it, it is kept for the
+// revalidation window first: a conditional request can then confirm it is
+// still current, and cache_refresh() makes it fresh again without
+// fetching the body.
+//
+// Once published an element is immutable (apart from the hit markers) and
+// reference counted: the cache holds one reference, and every reader that
+// found it holds one until cache_release(). Lookups take no lock at all,
+// so an element unlinked by a writer is only freed once no reader can
+// still be looking at it.
+struct cache_element {
+    char* data;                 // first part, holds at least the header block
+    int len;                    // bytes of data in all parts
+    struct iovec* parts;        // where the data is, in order
+    int nparts;
+    int segmented;              // parts are segments, not in the element
+    char* url;                  // canonical url of the key
+    int url_len;
+    time_t lru_time_track;      // last hit, set by readers without a lock
+    time_t expires;             // when it goes stale, 0 if never
+    time_t retire_at;           // when the sweeper retires it, 0 if never
+    int hits;                   // since eviction last looked at it, also set
+                                // by readers
+    int window;                 // still in the admission window
+    int queue;                  // list of the eviction policy it is on
+    int frequency;              // GDSF: hits so far
+    unsigned heap_index;        // GDSF: position in the heap
+    double priority;            // GDSF
+    unsigned long long hash;    // hash of the key
+    int size;                   // bytes charged against the shard budget,
+                                // the size of its slab chunk
+    int refs;
+    long long retire_epoch;     // epoch in which it was unlinked
+    cache_element* hash_next;   // hash bucket chain, followed by readers
+    cache_element* prev;        // list the element is on,
+    cache_element* next;        // next also links the retired elements
+    cache_element* timer_prev;  // slot of the timing wheel it is on
+    cache_element* timer_next;
+    cache_element** timer_slot; // NULL while it is on none
+};
+
+// A response added while it streams in. Its data goes straight into
+// segments, so it is never held in one big buffer nor reallocated.
+struct cache_fill {
+    char* segments[CACHE_MAX_SEGMENTS];
+    int nsegments;
+    int len;
+};
+
+// Bucket array of a shard. Replaced as a whole when the shard grows, the
+// old one is retired like an element.
+struct cache_table {
+    cache_element** buckets;
+    unsigned mask;              // number of buckets - 1, a power of two - 1
+    long long retire_epoch;
+    struct cache_table* retired_next;
+};
+
+// One independent part of the cache. A key always maps to the same shard,
+// so threads changing different shards never wait for each other. Only
+// writers (insert and eviction) take the lock.
+//
+// Admission follows W-TinyLFU. New elements enter a small window list. What
+// falls out of the window only gets into the main part if the sketch says
+// it is looked up more often than the elements it would evict there, so a
+// scan over many urls that are never asked for again cannot flush the
+// popular ones. Which elements of the main part are evicted is up to the
+// eviction policy picked at startup.
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_table* table;
+    unsigned count;
+    struct cache_list window;
+    struct eviction_state main;
+    long long size;             // bytes in use, see cache_element.size
+    long long max_size;
+    struct frequency_sketch sketch;     // counts every lookup, hit or miss
+    struct timer_wheel expiry;  // the elements that expire
+
+    // Unlinked but maybe still seen by a reader
+    cache_element* retired;
+    struct cache_table* retired_tables;
+
+    // Updated with the lock held
+    long long admitted;         // left the window for the main part
+    long long rejected;         // left the window for good
+    long long expired;          // retired by the sweeper
+    long long refreshed;        // made fresh again by a revalidation
+    long long acquisitions;
+    long long contended;        // acquisitions that had to wait
+    long long wait_ns;          // total time spent waiting for the lock
+};
+
+// Every thread that reads the cache gets one. epoch is the global epoch
+// seen when its current lookup started, 0 while it is not in one. The
+// thread also counts its hits and misses here rather than in the shared
+// shards.
+struct cache_reader {
+    long long epoch;
+    long long hits;
+    long long misses;
+    long long hit_bytes;        // response bytes served from the cache
+    long long fill_bytes;       // response bytes added to the cache
+    struct cache_reader* next;
+};
+
+// LRU cache shared by every connection handler
+struct lru_cache {
+    struct cache_shard* shards;
+    int nshards;
+    int max_element_size;
+    const struct eviction_policy* policy;
+    int admission;                  // W-TinyLFU filter in front of main
+    long long epoch;                // advanced whenever something is retired
+    struct cache_reader* readers;   // never shrinks, threads are long-lived
+    // Told about every element the cache evicts, to keep it in a lower
+    // tier. Called with the shard lock held, so it must not block. It takes
+    // a reference if it holds on to the element. NULL if there is no tier.
+    void (*demote)(cache_element* element);
+    // Seconds a response the origin gave no freshness for stays cached,
+    // 0 keeps it until it is evicted
+    long default_ttl;
+    // Seconds a stale response with a validator is kept to be revalidated
+    long revalidate_window;
+    // Seconds any stale response is kept to be served while it is
+    // refreshed or when the origin fails
+    long stale_window;
+};
+
+extern struct lru_cache cache;
+
+struct shard_stats {
+    unsigned count;
+    long long size;
+    long long max_size;
+    long long admitted;
+    long long rejected;
+    long long expired;
+    long long refreshed;
+    long long acquisitions;
+    long long contended;
+    long long wait_ns;
+};
+
+struct cache_stats {
+    long long hits;
+    long long misses;
+    long long hit_bytes;
+    long long fill_bytes;
+};
+
+// Splits max_size evenly over nshards shards, each evicting with policy.
+// Without admission whatever leaves the window gets into the main part.
+void cache_init(long long max_size, int max_element_size, int nshards,
+                const struct eviction_policy* policy, int admission);
+
+// Frees every element, the cache can be initialized again afterwards.
+// No other thread may use the cache meanwhile.
+void cache_destroy();
+
+// Looks key up without taking a lock and marks it as recently used. Every
+// lookup is counted by the shard's sketch, misses included. The element
+// stays valid, even if it is evicted meanwhile, until it is given back with
+// cache_release().
+cache_element* find(const struct cache_key* key);
+void cache_release(cache_element* element);
+
+// Like find(), but neither counted nor marked as used. For another look
+// on behalf of a request that was counted already. With stale set, an
+// element that expired but is kept for revalidation is returned too.
+cache_element* cache_peek(const struct cache_key* key, int stale);
+
+// The origin answered a conditional request for element with a 304 and
+// this header block. Makes the element fresh again for as long as the 304,
+// or else the stored response, says. Returns 0 if it was no longer cached.
+int cache_refresh(cache_element* element, const char* header, int header_len);
+
+// Stores a copy of data under key in the window of its shard, expiring as
+// its headers say. Returns 0 if it is too big to be cached, or already
+// stale.
+int add_cache_element(char* data, int size, const struct cache_key* key);
+
+// Like add_cache_element(), but for a response cached before, which keeps
+// its expiry time. An element cached under key meanwhile is newer and is
+// kept.
+int restore_cache_element(char* data, int size, const struct cache_key* key,
+                          time_t expires);
+
+// Same in steps, for a response that arrives bit by bit. Appending fails
+// once the response gets bigger than the largest element, the fill is
+// then dropped. The header block has to be within the first segment.
+void cache_fill_init(struct cache_fill* fill);
+int cache_fill_append(struct cache_fill* fill, const char* data, int len);
+int cache_fill_finish(struct cache_fill* fill, const struct cache_key* key);
+void cache_fill_abort(struct cache_fill* fill);
+
+// Copies all of the element's data to dst, which holds element->len bytes
+void cache_element_copy(cache_element* element, char* dst);
+
+// Every element cached right now, each with a reference the caller gives
+// back with cache_release(). The array is malloc'd, *count is its length.
+cache_element** cache_elements(int* count);
+
+// Evicts the policy's next victim from the fullest shard
+void remove_cache_element();
+
+// Retires every element that expired by now
+void cache_expire(time_t now);
+
+// Starts a thread that calls cache_expire() every CACHE_EXPIRY_INTERVAL
+// seconds
+void cache_start_sweeper();
+
+void cache_shard_stats(int shard, struct shard_stats* stats);
+
+// Hits and misses of every thread so far
+void cache_stats(struct cache_stats* stats);
+
+// Prints the hit ratios and one line per shard with its fill, admissions
+// and lock contention
+void cache_print_stats();
+
+#endif // CACHE_H
@@ -0,0 +1,259 @@
+// Measures how the cache scales with its number of elements: average time
+// of a lookup that hits, one that misses, and an insert into a full cache
+// (which evicts the least recently used element). Every operation should
+// cost the same whether the cache holds a thousand or millions of elements.
+// The baseline is a hit on one hot key, which stays in the CPU caches: it
+// does the same work as any other hit, so whatever a random hit costs on
+// top of it is spent waiting for memory.
+// Then several threads use the cache at once, with one shard and with many.
+// Hits take no lock, so only the one in BENCH_WRITES operations that
+// replaces an element can wait, and sharding spreads those out. Every
+// operation builds its key from a path first, like the proxy does for
+// every request. Finally every eviction policy, with and without
+// admission, replays the same trace: Zipf popularity over objects of mixed
+// sizes, with a scan of urls never seen again mixed in.
+//
+// make bench && ./cache_bench [max_elements] [threads]
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BENCH_KEYS  (1 << 16)   // keys looked up, picked at random
+#define BENCH_OPS   1000000
+#define BENCH_BODY  64
+#define BENCH_SHARDS 16
+#define BENCH_WRITES 16
+#define TRACE_OBJECTS 100000
+#define TRACE_REQUESTS 2000000
+#define TRACE_SCAN 5            // one request in TRACE_SCAN is a scan
+#define TRACE_ZIPF 0.9
+#define TRACE_CACHE (8 << 20)
+#define TRACE_MAX_BODY 10000
+
+static char keys[BENCH_KEYS][48];     // paths, see make_key()
+
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void make_path(char* path, const char* kind, long i){
+    sprintf(path, "/%s/%ld", kind, i);
+}
+
+static void make_key(struct cache_key* key, const char* path){
+    cache_key_build(key, "GET", "bench.example", NULL, path);
+}
+
+// Average ns per find() over the prepared keys
+static double time_lookups(){
+    long long start = now_ns();
+    long found = 0;
+    struct cache_key key;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        make_key(&key, keys[i & (BENCH_KEYS - 1)]);
+        cache_element* e = find(&key);
+        if (e != NULL) {
+            found++;
+            cache_release(e);
+        }
+    }
+    long long elapsed = now_ns() - start;
+    if (found != 0 && found != BENCH_OPS) {
+        fprintf(stderr, "unexpected hit count %ld\n", found);
+    }
+    return (double)elapsed / BENCH_OPS;
+}
+
+static void* mixed_worker(void* arg){
+    long id = (long)arg;
+    char body[BENCH_BODY];
+    struct cache_key key;
+    memset(body, 'y', sizeof(body));
+    for (int i = 0; i < BENCH_OPS; i++) {
+        make_key(&key, keys[(i * 7 + id * 4099) & (BENCH_KEYS - 1)]);
+        if (i % BENCH_WRITES == 0) {
+            // Replaces an element other threads may be reading right now
+            add_cache_element(body, sizeof(body), &key);
+            continue;
+        }
+        cache_element* e = find(&key);
+        if (e != NULL) {
+            if (e->data[0] != 'x' && e->data[0] != 'y') {
+                fprintf(stderr, "element freed while in use\n");
+            }
+            cache_release(e);
+        }
+    }
+    return NULL;
+}
+
+// Runs nthreads threads doing BENCH_OPS operations each on a cache with
+// nshards shards and reports throughput and lock contention
+static void time_contention(int nshards, int nthreads){
+    char body[BENCH_BODY];
+    struct cache_key key;
+    memset(body, 'x', sizeof(body));
+    cache_init(1LL << 40, 1 << 20, nshards, &eviction_policies[0], 1);
+    for (int i = 0; i < BENCH_KEYS; i++) {
+        make_path(keys[i], "object", i);
+        make_key(&key, keys[i]);
+        add_cache_element(body, sizeof(body), &key);
+    }
+
+    pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    long long start = now_ns();
+    for (long t = 0; t < nthreads; t++) {
+        pthread_create(&threads[t], NULL, mixed_worker, (void*)t);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    long long elapsed = now_ns() - start;
+    free(threads);
+
+    long long acquisitions = 0, contended = 0, wait_ns = 0;
+    for (int i = 0; i < nshards; i++) {
+        struct shard_stats stats;
+        cache_shard_stats(i, &stats);
+        acquisitions += stats.acquisitions;
+        contended += stats.contended;
+        wait_ns += stats.wait_ns;
+    }
+    printf("%8d %8d %14.0f %12.2f%% %14lld\n", nshards, nthreads,
+           (double)nthreads * BENCH_OPS / (elapsed / 1e9),
+           100.0 * contended / acquisitions, wait_ns / 1000);
+    cache_destroy();
+}
+
+// Body size of trace object i, from 100 bytes to TRACE_MAX_BODY
+static int trace_size(long i){
+    unsigned long long h = (unsigned long long)(i + 1) * 0x9E3779B97F4A7C15ULL;
+    return 100 + (int)((h >> 40) % (TRACE_MAX_BODY - 100));
+}
+
+static void replay_trace(const struct eviction_policy* policy, int admission,
+                         double* cdf){
+    static char body[TRACE_MAX_BODY];
+    char path[48];
+    struct cache_key key;
+    cache_init(TRACE_CACHE, 16 << 10, BENCH_SHARDS, policy, admission);
+    srand(3);
+    for (long r = 0; r < TRACE_REQUESTS; r++) {
+        long object;
+        if (r % TRACE_SCAN == 0) {
+            object = TRACE_OBJECTS + r;
+        } else {
+            // Inverse of the popularity distribution
+            double u = (double)rand() / RAND_MAX;
+            long lo = 0, hi = TRACE_OBJECTS - 1;
+            while (lo < hi) {
+                long mid = (lo + hi) / 2;
+                if (cdf[mid] < u) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            object = lo;
+        }
+        make_path(path, "trace", object);
+        make_key(&key, path);
+        cache_element* e = find(&key);
+        if (e != NULL) {
+            cache_release(e);
+        } else {
+            add_cache_element(body, trace_size(object), &key);
+        }
+    }
+    struct cache_stats stats;
+    cache_stats(&stats);
+    printf("%8s %10s %10.3f %15.3f\n", policy->name, admission ? "yes" : "no",
+           (double)stats.hits / (stats.hits + stats.misses),
+           (double)stats.hit_bytes / (stats.hit_bytes + stats.fill_bytes));
+    cache_destroy();
+}
+
+int main(int argc, char* argv[]){
+    long max_elements = argc > 1 ? atol(argv[1]) : 2000000;
+    int nthreads = argc > 2 ? atoi(argv[2]) : 8;
+    char body[BENCH_BODY];
+    char path[48];
+    struct cache_key key;
+    memset(body, 'x', sizeof(body));
+    srand(1);
+
+    printf("%12s %12s %12s %12s %12s\n", "elements", "hot ns", "hit ns", "miss ns",
+           "insert ns");
+    for (long n = 1000; n <= max_elements; n = n * 10 > max_elements &&
+                                              n < max_elements ? max_elements : n * 10) {
+        cache_init(1LL << 40, 1 << 20, BENCH_SHARDS, &eviction_policies[0], 1);
+        for (long i = 0; i < n; i++) {
+            make_path(path, "object", i);
+            make_key(&key, path);
+            add_cache_element(body, sizeof(body), &key);
+        }
+
+        for (int i = 0; i < BENCH_KEYS; i++) {
+            make_path(keys[i], "object", n / 2);
+        }
+        double hot = time_lookups();
+        for (int i = 0; i < BENCH_KEYS; i++) {
+            make_path(keys[i], "object", rand() % n);
+        }
+        double hit = time_lookups();
+        for (int i = 0; i < BENCH_KEYS; i++) {
+            make_path(keys[i], "missing", rand() % n);
+        }
+        double miss = time_lookups();
+
+        // From now on every insert has to evict one element first
+        for (int i = 0; i < cache.nshards; i++) {
+            cache.shards[i].max_size = cache.shards[i].size;
+        }
+        int inserts = BENCH_OPS / 10;
+        long long start = now_ns();
+        for (int i = 0; i < inserts; i++) {
+            make_path(path, "new", i);
+            make_key(&key, path);
+            add_cache_element(body, sizeof(body), &key);
+        }
+        double insert = (double)(now_ns() - start) / inserts;
+
+        printf("%12ld %12.1f %12.1f %12.1f %12.1f\n", n, hot, hit, miss, insert);
+        cache_destroy();
+        if (n == max_elements) {
+            break;
+        }
+    }
+
+    printf("\n%8s %8s %14s %13s %14s\n", "shards", "threads", "ops/s",
+           "contended", "us waited");
+    time_contention(1, nthreads);
+    time_contention(BENCH_SHARDS, nthreads);
+
+    double* cdf = (double*)malloc(TRACE_OBJECTS * sizeof(double));
+    double total = 0;
+    for (long i = 0; i < TRACE_OBJECTS; i++) {
+        total += 1.0 / pow(i + 1, TRACE_ZIPF);
+        cdf[i] = total;
+    }
+    for (long i = 0; i < TRACE_OBJECTS; i++) {
+        cdf[i] /= total;
+    }
+    printf("\n%8s %10s %10s %15s\n", "policy", "admission", "hit ratio",
+           "byte hit ratio");
+    for (const struct eviction_policy* p = eviction_policies; p->name != NULL; p++) {
+        replay_trace(p, 1, cdf);
+        replay_trace(p, 0, cdf);
+    }
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include "cache_key.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+static int hex_value(char c){
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int is_unreserved(unsigned char c){
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+// Copies len bytes of src to dst, decoding the escapes of unreserved
+// characters and upper-casing the hex digits of the other escapes. Never
+// writes more than len bytes. Returns the length written.
+static int normalize_escapes(char* dst, const char* src, int len){
+    static const char digits[] = "0123456789ABCDEF";
+    int out = 0;
+    for (int i = 0; i < len; i++) {
+        int hi, lo;
+        if (src[i] == '%' && i + 2 < len &&
+            (hi = hex_value(src[i + 1])) >= 0 && (lo = hex_value(src[i + 2])) >= 0) {
+            unsigned char c = hi * 16 + lo;
+            if (is_unreserved(c)) {
+                dst[out++] = c;
+            } else {
+                dst[out++] = '%';
+                dst[out++] = digits[hi];
+                dst[out++] = digits[lo];
+            }
+            i += 2;
+        } else {
+            dst[out++] = src[i];
+        }
+    }
+    return out;
+}
+
+// Resolves the "." and ".." segments of an absolute path in place, as in
+// RFC 3986 section 5.2.4. Returns the new length.
+static int remove_dot_segments(char* path, int len){
+    int out = 0;
+    int i = 0;
+    while (i < len) {
+        // path[i] is the '/' in front of the next segment. What is written
+        // never gets ahead of what is read.
+        int start = i + 1;
+        int end = start;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+        int seg = end - start;
+        i = end;
+        if (seg == 2 && path[start] == '.' && path[start + 1] == '.') {
+            // Drops the segment before it
+            while (out > 0 && path[--out] != '/') {
+            }
+        } else if (!(seg == 1 && path[start] == '.')) {
+            memmove(path + out + 1, path + start, seg);
+            path[out] = '/';
+            out += seg + 1;
+            continue;
+        }
+        if (end == len) {
+            // "/a/." and "/a/b/.." both name the directory "/a/"
+            path[out++] = '/';
+        }
+    }
+    if (out == 0) {
+        path[out++] = '/';
+    }
+    return out;
+}
+
+int cache_key_build(struct cache_key* key, const char* method, const char* host,
+                    const char* port, const char* path){
+    int port_num = 80;
+    if (port != NULL && *port != '\0') {
+        port_num = 0;
+        for (const char* p = port; *p != '\0'; p++) {
+            if (!isdigit((unsigned char)*p) || port_num > 65535) {
+                return -1;
+            }
+            port_num = port_num * 10 + (*p - '0');
+        }
+        if (port_num == 0 || port_num > 65535) {
+            return -1;
+        }
+    }
+
+    int host_len = strlen(host);
+    if (host_len > 0 && host[host_len - 1] == '.') {
+        // "example.com." is the same host
+        host_len--;
+    }
+    // A fragment is never part of what is fetched
+    int path_len = strcspn(path, "#");
+    int query = strcspn(path, "?#");
+    if (host_len == 0 || path[0] != '/') {
+        return -1;
+    }
+
+    int n = snprintf(key->url, CACHE_KEY_MAX, "%s http://", method);
+    // Normalizing never makes the path longer, ":65535" is the longest port
+    if (n < 0 || n + host_len + 6 + path_len >= CACHE_KEY_MAX) {
+        return -1;
+    }
+    for (int i = 0; i < host_len; i++) {
+        key->url[n++] = tolower((unsigned char)host[i]);
+    }
+    if (port_num != 80) {
+        n += sprintf(key->url + n, ":%d", port_num);
+    }
+    int len = normalize_escapes(key->url + n, path, query);
+    n += remove_dot_segments(key->url + n, len);
+    n += normalize_escapes(key->url + n, path + query, path_len - query);
+    key->url[n] = '\0';
+    key->len = n;
+
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)key->url[i]) * 1099511628211ULL;
+    }
+    key->hash = h;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef CACHE_KEY_H
+#define CACHE_KEY_H
+
+#define CACHE_KEY_MAX 4096      // longest canonical url, NUL included
+
+// What a response is cached under. Requests that only differ in their
+// headers, in the case of the host name, in spelling out the default port
+// or in how the path is escaped get the same key, e.g.
+//
+//   GET http://Example.COM:80/a/./b/%7euser?q=%2f  ->
+//   GET http://example.com/a/b/~user?q=%2F
+//
+// The hash is computed once when the key is built, lookups compare it
+// before looking at the url.
+struct cache_key {
+    unsigned long long hash;    // 64-bit FNV-1a of url
+    int len;                    // strlen(url)
+    char url[CACHE_KEY_MAX];    // "METHOD http://host[:port]/path[?query]"
+};
+
+// Builds the key of a request from its parsed parts. port may be NULL
+// (80). The path is expected to start with "/" and may carry a query.
+// Returns -1 if the request cannot be cached under a key: a bad port or a
+// url that does not fit.
+int cache_key_build(struct cache_key* key, const char* method, const char* host,
+                    const char* port, const char* path);
+
+#endif // CACHE_KEY_H
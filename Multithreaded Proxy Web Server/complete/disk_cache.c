@@ -0,0 +1,443 @@
+#include "disk_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+struct disk_cache disk_cache;
+
+static struct disk_entry** bucket_of(unsigned long long hash){
+    return &disk_cache.buckets[hash & disk_cache.mask];
+}
+
+static struct disk_entry* lookup(unsigned long long hash){
+    struct disk_entry* e = *bucket_of(hash);
+    while (e != NULL && e->hash != hash) {
+        e = e->next;
+    }
+    return e;
+}
+
+// Doubles the buckets once there are more records than buckets. Called
+// with the lock held.
+static void grow_index(){
+    struct disk_cache* d = &disk_cache;
+    unsigned nbuckets = (d->mask + 1) * 2;
+    struct disk_entry** buckets = (struct disk_entry**)calloc(nbuckets,
+                                                              sizeof(struct disk_entry*));
+    if (buckets == NULL) {
+        // Longer chains, but still correct
+        return;
+    }
+    for (unsigned b = 0; b <= d->mask; b++) {
+        struct disk_entry* e = d->buckets[b];
+        while (e != NULL) {
+            struct disk_entry* following = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = following;
+        }
+    }
+    free(d->buckets);
+    d->buckets = buckets;
+    d->mask = nbuckets - 1;
+}
+
+// Drops e from the index and its segment. Called with the lock held.
+static void remove_entry(struct disk_entry* e){
+    struct disk_cache* d = &disk_cache;
+    struct disk_entry** p = bucket_of(e->hash);
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    struct disk_segment* s = &d->segments[e->segment];
+    if (e->seg_prev != NULL) {
+        e->seg_prev->seg_next = e->seg_next;
+    } else {
+        s->entries = e->seg_next;
+    }
+    if (e->seg_next != NULL) {
+        e->seg_next->seg_prev = e->seg_prev;
+    }
+    s->live -= e->bytes;
+    d->count--;
+    free(e);
+}
+
+// Indexes a record that is completely written, replacing an older one of
+// the same key. Called with the lock held.
+static void insert_entry(unsigned long long hash, int segment, long long offset,
+                         int bytes, time_t expires){
+    struct disk_cache* d = &disk_cache;
+    struct disk_entry* old = lookup(hash);
+    if (old != NULL) {
+        remove_entry(old);
+    }
+    struct disk_entry* e = (struct disk_entry*)malloc(sizeof(struct disk_entry));
+    if (e == NULL) {
+        perror("Memory allocation failed");
+        return;
+    }
+    e->hash = hash;
+    e->segment = segment;
+    e->offset = offset;
+    e->bytes = bytes;
+    e->expires = expires;
+    struct disk_entry** bucket = bucket_of(hash);
+    e->next = *bucket;
+    *bucket = e;
+    struct disk_segment* s = &d->segments[segment];
+    e->seg_prev = NULL;
+    e->seg_next = s->entries;
+    if (s->entries != NULL) {
+        s->entries->seg_prev = e;
+    }
+    s->entries = e;
+    s->live += bytes;
+    if (++d->count > d->mask + 1) {
+        grow_index();
+    }
+}
+
+// Moves the writer to the next segment. Until the log has been filled once
+// that is a fresh one, after that the one with the fewest live bytes, so GC
+// drops as little as it can. Called with the lock held.
+static void open_next_segment(){
+    struct disk_cache* d = &disk_cache;
+    if (d->fresh < d->nsegments) {
+        d->open = d->fresh++;
+        d->open_used = 0;
+        return;
+    }
+    int victim = -1;
+    for (int i = 0; i < d->nsegments; i++) {
+        if (i != d->open &&
+            (victim < 0 || d->segments[i].live < d->segments[victim].live)) {
+            victim = i;
+        }
+    }
+    struct disk_segment* s = &d->segments[victim];
+    // Readers that looked a record of it up will see that it changed
+    s->gen++;
+    while (s->entries != NULL) {
+        remove_entry(s->entries);
+        d->lost++;
+    }
+    d->reclaimed++;
+    d->open = victim;
+    d->open_used = 0;
+}
+
+// Writes all of iov at offset, picking up after short writes
+static int pwrite_all(int fd, struct iovec* iov, int n, long long offset){
+    while (n > 0) {
+        ssize_t written = pwritev(fd, iov, n, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += written;
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Appends the element to the log, straight from its parts
+static void append(cache_element* element){
+    struct disk_cache* d = &disk_cache;
+    int bytes = sizeof(struct disk_record) + element->url_len + element->len;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->open_used + bytes > d->segment_size) {
+        open_next_segment();
+    }
+    int segment = d->open;
+    long long offset = segment * d->segment_size + d->open_used;
+    d->open_used += bytes;
+    pthread_mutex_unlock(&d->lock);
+
+    struct disk_record record;
+    record.magic = DISK_RECORD_MAGIC;
+    record.url_len = element->url_len;
+    record.len = element->len;
+    record.pad = 0;
+    record.hash = element->hash;
+    record.expires = element->expires;
+    struct iovec iov[CACHE_MAX_SEGMENTS + 2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = element->url;
+    iov[1].iov_len = element->url_len;
+    memcpy(&iov[2], element->parts, element->nparts * sizeof(struct iovec));
+    if (pwrite_all(d->fd, iov, element->nparts + 2, offset) < 0) {
+        perror("Error writing to disk cache");
+        return;
+    }
+
+    // Only the writer reclaims segments, ours is still the same
+    pthread_mutex_lock(&d->lock);
+    insert_entry(element->hash, segment, offset, bytes, element->expires);
+    d->written++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void* writer_fn(void* arg){
+    struct disk_cache* d = &disk_cache;
+    while (1) {
+        pthread_mutex_lock(&d->queue_lock);
+        while (d->queue_head == NULL && !d->stop) {
+            pthread_cond_wait(&d->queued_cond, &d->queue_lock);
+        }
+        if (d->stop) {
+            pthread_mutex_unlock(&d->queue_lock);
+            return NULL;
+        }
+        struct disk_demotion* demotion = d->queue_head;
+        d->queue_head = demotion->next;
+        if (d->queue_head == NULL) {
+            d->queue_tail = NULL;
+        }
+        d->queued -= demotion->element->len;
+        pthread_mutex_unlock(&d->queue_lock);
+
+        append(demotion->element);
+        cache_release(demotion->element);
+        free(demotion);
+    }
+}
+
+int disk_cache_init(const char* path, long long size){
+    struct disk_cache* d = &disk_cache;
+    // Every record has to fit in a segment
+    long long largest = sizeof(struct disk_record) + CACHE_KEY_MAX + cache.max_element_size;
+    d->segment_size = DISK_SEGMENT_SIZE;
+    if (size / d->segment_size < DISK_MIN_SEGMENTS) {
+        d->segment_size = size / DISK_MIN_SEGMENTS & ~4095LL;
+    }
+    if (d->segment_size < largest) {
+        printf("Disk cache of %lld bytes is too small\n", size);
+        return -1;
+    }
+    d->nsegments = size / d->segment_size;
+
+    d->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (d->fd < 0) {
+        perror("Error opening disk cache");
+        return -1;
+    }
+    // Sparse, blocks are only taken as the log fills
+    if (ftruncate(d->fd, d->nsegments * d->segment_size) < 0) {
+        perror("Error sizing disk cache");
+        close(d->fd);
+        return -1;
+    }
+    d->segments = (struct disk_segment*)calloc(d->nsegments, sizeof(struct disk_segment));
+    d->buckets = (struct disk_entry**)calloc(DISK_MIN_BUCKETS, sizeof(struct disk_entry*));
+    if (d->segments == NULL || d->buckets == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    d->mask = DISK_MIN_BUCKETS - 1;
+    d->count = 0;
+    d->fresh = 0;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_mutex_lock(&d->lock);
+    open_next_segment();
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_init(&d->queue_lock, NULL);
+    pthread_cond_init(&d->queued_cond, NULL);
+    d->queue_head = d->queue_tail = NULL;
+    d->queued = 0;
+    d->stop = 0;
+    if (pthread_create(&d->writer, NULL, writer_fn, NULL) != 0) {
+        perror("pthread_create failed");
+        close(d->fd);
+        return -1;
+    }
+    cache.demote = disk_cache_demote;
+    printf("Disk cache %s: %d segments of %lld bytes\n", path, d->nsegments,
+           d->segment_size);
+    return 0;
+}
+
+void disk_cache_close(){
+    struct disk_cache* d = &disk_cache;
+    cache.demote = NULL;
+    pthread_mutex_lock(&d->queue_lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->queued_cond);
+    pthread_mutex_unlock(&d->queue_lock);
+    pthread_join(d->writer, NULL);
+    while (d->queue_head != NULL) {
+        struct disk_demotion* demotion = d->queue_head;
+        d->queue_head = demotion->next;
+        cache_release(demotion->element);
+        free(demotion);
+    }
+    d->queue_tail = NULL;
+    d->queued = 0;
+    for (int i = 0; i < d->nsegments; i++) {
+        while (d->segments[i].entries != NULL) {
+            remove_entry(d->segments[i].entries);
+        }
+    }
+    free(d->segments);
+    free(d->buckets);
+    close(d->fd);
+}
+
+void disk_cache_demote(cache_element* element){
+    struct disk_cache* d = &disk_cache;
+    if (element->expires != 0 && element->expires <= time(NULL)) {
+        return;
+    }
+    pthread_mutex_lock(&d->queue_lock);
+    if (d->queued + element->len > DISK_QUEUE_BYTES) {
+        // The disk falls behind, better lose this one than stall the shard
+        d->dropped++;
+        pthread_mutex_unlock(&d->queue_lock);
+        return;
+    }
+    struct disk_demotion* demotion = (struct disk_demotion*)malloc(sizeof(struct disk_demotion));
+    if (demotion == NULL) {
+        pthread_mutex_unlock(&d->queue_lock);
+        return;
+    }
+    __atomic_add_fetch(&element->refs, 1, __ATOMIC_RELAXED);
+    demotion->element = element;
+    demotion->next = NULL;
+    if (d->queue_tail != NULL) {
+        d->queue_tail->next = demotion;
+    } else {
+        d->queue_head = demotion;
+    }
+    d->queue_tail = demotion;
+    d->queued += element->len;
+    pthread_cond_signal(&d->queued_cond);
+    pthread_mutex_unlock(&d->queue_lock);
+}
+
+// Reads len bytes at offset, picking up after short reads. Returns -1 on
+// errors and at the end of the file.
+static int pread_all(int fd, char* buf, int len, long long offset){
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int disk_cache_has(const struct cache_key* key){
+    struct disk_cache* d = &disk_cache;
+    pthread_mutex_lock(&d->lock);
+    struct disk_entry* e = lookup(key->hash);
+    int found = e != NULL && (e->expires == 0 || e->expires > time(NULL));
+    if (!found) {
+        d->misses++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+char* disk_cache_read(const struct cache_key* key, int* len, int promote){
+    struct disk_cache* d = &disk_cache;
+    pthread_mutex_lock(&d->lock);
+    struct disk_entry* e = lookup(key->hash);
+    if (e != NULL && e->expires != 0 && e->expires <= time(NULL)) {
+        remove_entry(e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        d->misses++;
+        pthread_mutex_unlock(&d->lock);
+        return NULL;
+    }
+    int segment = e->segment;
+    long long offset = e->offset;
+    int bytes = e->bytes;
+    unsigned gen = d->segments[segment].gen;
+    pthread_mutex_unlock(&d->lock);
+
+    char* buf = (char*)malloc(bytes);
+    if (buf == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    struct disk_record record;
+    int valid = pread_all(d->fd, buf, bytes, offset) == 0;
+    if (valid) {
+        // Same key, not just the same hash
+        memcpy(&record, buf, sizeof(record));
+        valid = record.magic == DISK_RECORD_MAGIC && record.hash == key->hash &&
+                record.url_len == key->len &&
+                (long long)sizeof(record) + record.url_len + record.len == bytes &&
+                !memcmp(buf + sizeof(record), key->url, key->len);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (d->segments[segment].gen != gen) {
+        // Reclaimed while we read, what we got may be a newer record
+        valid = 0;
+    }
+    if (valid) {
+        d->hits++;
+        if (promote && (e = lookup(key->hash)) != NULL && e->offset == offset) {
+            remove_entry(e);
+        }
+    } else {
+        d->misses++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (!valid) {
+        free(buf);
+        return NULL;
+    }
+
+    memmove(buf, buf + sizeof(record) + record.url_len, record.len);
+    *len = record.len;
+    if (promote) {
+        restore_cache_element(buf, record.len, key, record.expires);
+    }
+    return buf;
+}
+
+void disk_cache_print_stats(){
+    struct disk_cache* d = &disk_cache;
+    pthread_mutex_lock(&d->lock);
+    long long live = 0;
+    for (int i = 0; i < d->nsegments; i++) {
+        live += d->segments[i].live;
+    }
+    long long lookups = d->hits + d->misses;
+    printf("Disk cache: %lld hits, %lld misses (%.3f hit ratio), %u records, "
+           "%lld of %lld bytes live, %lld written, %lld dropped, "
+           "%lld segments reclaimed with %lld records\n",
+           d->hits, d->misses, lookups ? (double)d->hits / lookups : 0.0,
+           d->count, live, d->nsegments * d->segment_size, d->written,
+           d->dropped, d->reclaimed, d->lost);
+    pthread_mutex_unlock(&d->lock);
+}
@@ -0,0 +1,114 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "cache.h"
+
+#include <pthread.h>
+
+#define DISK_SEGMENT_SIZE (64LL << 20) // unit the log is reclaimed in
+#define DISK_MIN_SEGMENTS 4            // smaller files get smaller segments
+#define DISK_QUEUE_BYTES (64 << 20)    // demoted bytes waiting for the writer
+#define DISK_MIN_BUCKETS 4096
+#define DISK_RECORD_MAGIC 0x4b534944u  // "DISK"
+
+// Header in front of every record in the log, followed by the url and the
+// response
+struct disk_record {
+    unsigned magic;
+    int url_len;
+    int len;
+    unsigned pad;
+    unsigned long long hash;
+    long long expires;          // of the element, 0 if never
+};
+
+// Where the index finds a record
+struct disk_entry {
+    unsigned long long hash;
+    int segment;
+    long long offset;           // of the record in the file
+    int bytes;                  // of the whole record
+    time_t expires;             // stale records are dropped when looked up
+    struct disk_entry* next;    // hash chain
+    struct disk_entry* seg_prev;  // records of the same segment
+    struct disk_entry* seg_next;
+};
+
+struct disk_segment {
+    unsigned gen;               // bumped every time it is reclaimed
+    long long live;             // bytes of its records in the index
+    struct disk_entry* entries;
+};
+
+// An element evicted from memory, waiting to be written
+struct disk_demotion {
+    cache_element* element;
+    struct disk_demotion* next;
+};
+
+// Second cache tier in one file, written as a log. The file is cut into
+// segments and records are appended to the open one by a single writer
+// thread. When the log is full, the segment with the fewest live bytes is
+// reclaimed as a whole and its records are dropped from the index.
+//
+// Readers look the index up under the lock and pread() the record without
+// it. The segment's generation tells them afterwards whether it was
+// reclaimed, and maybe overwritten, while they were reading.
+struct disk_cache {
+    int fd;
+    long long segment_size;
+    int nsegments;
+    struct disk_segment* segments;
+
+    pthread_mutex_t lock;       // index and segments
+    struct disk_entry** buckets;
+    unsigned mask;
+    unsigned count;
+    int open;                   // segment being appended to
+    long long open_used;        // bytes appended to it
+    int fresh;                  // segments never written so far
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queued_cond;
+    struct disk_demotion* queue_head;
+    struct disk_demotion* queue_tail;
+    long long queued;           // bytes of the elements in the queue
+    int stop;
+    pthread_t writer;
+
+    long long hits;
+    long long misses;
+    long long written;          // records appended
+    long long dropped;          // demotions the writer could not keep up with
+    long long reclaimed;        // segments reclaimed
+    long long lost;             // records dropped with them
+};
+
+extern struct disk_cache disk_cache;
+
+// Creates (or truncates) the log at path with size bytes, starts the
+// writer and hooks the tier up to the memory cache. Returns -1 if the file
+// cannot be set up.
+int disk_cache_init(const char* path, long long size);
+
+// Stops the writer and closes the file. Demotions still queued are lost.
+void disk_cache_close();
+
+// Queues an element evicted from memory for the log, see cache.demote.
+// Elements that expired are not worth keeping and are left out.
+void disk_cache_demote(cache_element* element);
+
+// Whether the index has a live record for key, without touching the file.
+// A lookup that ends here counts as a miss. The record may still turn out
+// to be gone, or to belong to another key, when it is read.
+int disk_cache_has(const struct cache_key* key);
+
+// Reads the response stored under key. Returns a malloc'd copy and sets
+// *len, or NULL if the key is not on disk or expired. With promote the
+// response is added to the memory cache again and dropped from the log.
+char* disk_cache_read(const struct cache_key* key, int* len, int promote);
+
+// Prints the hit ratio of the tier, its fill and how much GC dropped
+void disk_cache_print_stats();
+
+#endif // DISK_CACHE_H
@@ -0,0 +1,182 @@
+#include "dns_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+struct dns_cache dns_cache;
+
+static unsigned hash_host(const char* host){
+    // FNV-1a over the lower-cased name, host names are case-insensitive
+    unsigned h = 2166136261u;
+    for (; *host; host++) {
+        unsigned char c = (unsigned char)*host;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static struct dns_entry* lookup(const char* host){
+    struct dns_entry* e = dns_cache.buckets[hash_host(host) % DNS_BUCKETS];
+    while (e != NULL && strcasecmp(e->host, host)) {
+        e = e->next;
+    }
+    return e;
+}
+
+static void unlink_entry(struct dns_entry* victim){
+    struct dns_entry** p = &dns_cache.buckets[hash_host(victim->host) % DNS_BUCKETS];
+    while (*p != victim) {
+        p = &(*p)->next;
+    }
+    *p = victim->next;
+    dns_cache.entries--;
+}
+
+// Frees every expired answer. Called with the lock held when the cache is
+// full, so the common path never walks the table.
+static void drop_expired(time_t now){
+    for (int b = 0; b < DNS_BUCKETS; b++) {
+        struct dns_entry** p = &dns_cache.buckets[b];
+        while (*p != NULL) {
+            struct dns_entry* e = *p;
+            if (e->state != DNS_RESOLVING && e->expires <= now) {
+                *p = e->next;
+                free(e);
+                dns_cache.entries--;
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+}
+
+// getaddrinfo is thread-safe, unlike the gethostbyname it replaces
+static int resolve_now(const char* host, struct in_addr* addr){
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host, NULL, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "No such host exists: %s (%s)\n", host, gai_strerror(err));
+        return -1;
+    }
+    *addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return 0;
+}
+
+void dns_cache_init(int ttl, int negative_ttl){
+    memset(&dns_cache, 0, sizeof(dns_cache));
+    pthread_mutex_init(&dns_cache.lock, NULL);
+    pthread_cond_init(&dns_cache.resolved, NULL);
+    dns_cache.ttl = ttl;
+    dns_cache.negative_ttl = negative_ttl;
+}
+
+int dns_cache_peek(const char* host, struct in_addr* addr){
+    if (inet_pton(AF_INET, host, addr) == 1) {
+        return 0;
+    }
+    if (strlen(host) >= DNS_HOST_LEN || dns_cache.ttl <= 0) {
+        return 1;
+    }
+    int ret = 1;
+    pthread_mutex_lock(&dns_cache.lock);
+    struct dns_entry* e = lookup(host);
+    if (e != NULL && e->state != DNS_RESOLVING && e->expires > time(NULL)) {
+        dns_cache.hits++;
+        ret = e->state == DNS_POSITIVE ? 0 : -1;
+        *addr = e->addr;
+    }
+    pthread_mutex_unlock(&dns_cache.lock);
+    return ret;
+}
+
+int dns_cache_resolve(const char* host, struct in_addr* addr){
+    // Literal addresses need no lookup at all
+    if (inet_pton(AF_INET, host, addr) == 1) {
+        return 0;
+    }
+    if (strlen(host) >= DNS_HOST_LEN || dns_cache.ttl <= 0) {
+        return resolve_now(host, addr);
+    }
+
+    pthread_mutex_lock(&dns_cache.lock);
+    struct dns_entry* e = lookup(host);
+    while (e != NULL && e->state == DNS_RESOLVING) {
+        // Someone is already asking for this host, wait for the answer
+        dns_cache.waits++;
+        pthread_cond_wait(&dns_cache.resolved, &dns_cache.lock);
+        e = lookup(host);
+    }
+
+    time_t now = time(NULL);
+    if (e != NULL && e->expires > now) {
+        dns_cache.hits++;
+        int ret = e->state == DNS_POSITIVE ? 0 : -1;
+        *addr = e->addr;
+        pthread_mutex_unlock(&dns_cache.lock);
+        return ret;
+    }
+    dns_cache.misses++;
+
+    // Claim the lookup so concurrent callers wait instead of resolving too
+    if (e == NULL) {
+        if (dns_cache.entries >= DNS_MAX_ENTRIES) {
+            drop_expired(now);
+        }
+        if (dns_cache.entries < DNS_MAX_ENTRIES) {
+            e = (struct dns_entry*)calloc(1, sizeof(struct dns_entry));
+        }
+        if (e != NULL) {
+            strcpy(e->host, host);
+            unsigned b = hash_host(host) % DNS_BUCKETS;
+            e->next = dns_cache.buckets[b];
+            dns_cache.buckets[b] = e;
+            dns_cache.entries++;
+        }
+    }
+    if (e == NULL) {
+        // Cache is full of live answers, resolve without caching
+        pthread_mutex_unlock(&dns_cache.lock);
+        return resolve_now(host, addr);
+    }
+    e->state = DNS_RESOLVING;
+    pthread_mutex_unlock(&dns_cache.lock);
+
+    int ret = resolve_now(host, addr);
+
+    pthread_mutex_lock(&dns_cache.lock);
+    if (ret == 0) {
+        e->state = DNS_POSITIVE;
+        e->addr = *addr;
+        e->expires = time(NULL) + dns_cache.ttl;
+    } else if (dns_cache.negative_ttl > 0) {
+        e->state = DNS_NEGATIVE;
+        e->expires = time(NULL) + dns_cache.negative_ttl;
+    } else {
+        unlink_entry(e);
+        free(e);
+    }
+    pthread_cond_broadcast(&dns_cache.resolved);
+    pthread_mutex_unlock(&dns_cache.lock);
+    return ret;
+}
+
+void dns_cache_print_stats(){
+    pthread_mutex_lock(&dns_cache.lock);
+    printf("DNS cache: %d entries, %lld hits, %lld misses, %lld waits\n",
+           dns_cache.entries, dns_cache.hits, dns_cache.misses, dns_cache.waits);
+    pthread_mutex_unlock(&dns_cache.lock);
+}
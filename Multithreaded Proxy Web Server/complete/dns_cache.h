@@ -0,0 +1,54 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define DNS_BUCKETS 1024
+#define DNS_MAX_ENTRIES 4096
+#define DNS_HOST_LEN 256
+
+#define DNS_RESOLVING 0     // a thread is running getaddrinfo for it
+#define DNS_POSITIVE  1
+#define DNS_NEGATIVE  2     // host does not resolve, remembered briefly
+
+struct dns_entry {
+    char host[DNS_HOST_LEN];
+    int state;
+    struct in_addr addr;
+    time_t expires;
+    struct dns_entry* next;
+};
+
+// Process-wide cache of host name lookups, shared by every mode
+struct dns_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t resolved;        // broadcast whenever a lookup finishes
+    struct dns_entry* buckets[DNS_BUCKETS];
+    int entries;
+    int ttl;                        // seconds a positive answer is kept
+    int negative_ttl;               // seconds a failed lookup is kept
+
+    long long hits;
+    long long misses;
+    long long waits;                // lookups that joined one in progress
+};
+
+extern struct dns_cache dns_cache;
+
+void dns_cache_init(int ttl, int negative_ttl);
+
+// Resolves host to an IPv4 address. Cached answers cost a hash lookup,
+// and concurrent lookups of the same host share one getaddrinfo call.
+// Returns -1 if the host does not resolve.
+int dns_cache_resolve(const char* host, struct in_addr* addr);
+
+// Answers from the cache only, never waits. Returns 0 with *addr set, -1 if
+// the host is known not to resolve and 1 if it has to be resolved with
+// dns_cache_resolve().
+int dns_cache_peek(const char* host, struct in_addr* addr);
+
+void dns_cache_print_stats();
+
+#endif // DNS_CACHE_H
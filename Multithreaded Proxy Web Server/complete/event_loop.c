@@ -0,0 +1,1381 @@
+#include "event_loop.h"
+#include "disk_cache.h"
+#include "http_response.h"
+#include "snapshot.h"
+#include "upgrade.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256
+
+struct event_loop {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int pinned;     // owns listen_fd alone and runs on core `id`
+    pthread_t thread;
+    // Connections closed while handling the current batch of events. They
+    // are freed after the batch, because a later event of the same batch
+    // may still point at them.
+    struct connection* closed;
+    // Connections with a deadline, on the origin or on a slow client, and
+    // the earliest deadline among them (0 if unknown)
+    struct connection* timers;
+    long long next_deadline;
+    int accepting;  // listen_fd is still watched, see upgrade.h
+    int upgrade_slot;
+    int wake_fd;    // eventfd the handoff wakes us with, its events carry loop
+};
+
+long long monotonic_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_stop(struct event_loop* loop, struct connection* c){
+    if (c->deadline == 0) {
+        return;
+    }
+    if (c->timer_prev != NULL) {
+        c->timer_prev->timer_next = c->timer_next;
+    } else {
+        loop->timers = c->timer_next;
+    }
+    if (c->timer_next != NULL) {
+        c->timer_next->timer_prev = c->timer_prev;
+    }
+    c->timer_prev = c->timer_next = NULL;
+    c->deadline = 0;
+}
+
+// (Re)starts the deadline of the phase c is in
+static void timer_start(struct event_loop* loop, struct connection* c){
+    int timeout = conn_timeout(c);
+    if (timeout <= 0) {
+        timer_stop(loop, c);
+        return;
+    }
+    if (c->deadline == 0) {
+        c->timer_prev = NULL;
+        c->timer_next = loop->timers;
+        if (loop->timers != NULL) {
+            loop->timers->timer_prev = c;
+        }
+        loop->timers = c;
+    }
+    c->deadline = monotonic_ms() + timeout;
+    if (loop->next_deadline == 0 || c->deadline < loop->next_deadline) {
+        loop->next_deadline = c->deadline;
+    }
+}
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void conn_close(struct event_loop* loop, struct connection* c){
+    if (c->state == CONN_DONE) {
+        return;
+    }
+    timer_stop(loop, c);
+    if (c->job != NULL) {
+        // The helper thread may keep the eventfd open a while longer
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->job->fd, NULL);
+    }
+    // Closing the descriptors also removes them from the epoll set
+    close(c->client.fd);
+    if (c->upstream.fd >= 0) {
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    c->state = CONN_DONE;
+    c->next_closed = loop->closed;
+    loop->closed = c;
+}
+
+// Queue of the helper threads, shared by every loop
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct loop_job* head;
+    struct loop_job* tail;
+    int started;
+} helpers = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+
+static void job_release(struct loop_job* job){
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (job->shared != NULL) {
+            // Nothing writes to the eventfd after this
+            inflight_unwatch(job->shared, &job->watcher);
+            inflight_release(job->shared);
+        }
+        close(job->fd);
+        free(job->data);
+        free(job);
+    }
+}
+
+static void* helper_fn(void* arg){
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&helpers.lock);
+        while (helpers.head == NULL) {
+            pthread_cond_wait(&helpers.queued, &helpers.lock);
+        }
+        struct loop_job* job = helpers.head;
+        helpers.head = job->next;
+        if (helpers.head == NULL) {
+            helpers.tail = NULL;
+        }
+        pthread_mutex_unlock(&helpers.lock);
+
+        if (job->kind == JOB_RESOLVE) {
+            job->status = dns_cache_resolve(job->host, &job->addr);
+        } else if (job->kind == JOB_SNAPSHOT_LOAD) {
+            job->status = snapshot_load_claimed(job->entry, &job->key);
+        } else {
+            job->data = disk_cache_read(&job->key, &job->len, config.disk_promote);
+        }
+        // The write publishes the result to the loop
+        unsigned long long one = 1;
+        if (write(job->fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write failed");
+        }
+        job_release(job);
+    }
+    return NULL;
+}
+
+int loop_helpers_start(void){
+    for (int i = helpers.started; i < LOOP_HELPERS; i++) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, helper_fn, NULL);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            break;
+        }
+        helpers.started++;
+    }
+    if (helpers.started == 0) {
+        printf("No helper threads, the loops do their blocking work themselves\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns NULL if the work cannot be handed off, the caller does it itself
+static struct loop_job* job_create(int kind){
+    if (kind != JOB_FOLLOW && helpers.started == 0) {
+        return NULL;
+    }
+    struct loop_job* job = (struct loop_job*)calloc(1, sizeof(struct loop_job));
+    if (job == NULL) {
+        return NULL;
+    }
+    job->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (job->fd < 0) {
+        perror("eventfd failed");
+        free(job);
+        return NULL;
+    }
+    job->kind = kind;
+    // A followed fetch only writes to the eventfd, the connection owns it
+    job->refs = kind == JOB_FOLLOW ? 1 : 2;
+    return job;
+}
+
+static void job_submit(struct loop_job* job){
+    pthread_mutex_lock(&helpers.lock);
+    if (helpers.tail != NULL) {
+        helpers.tail->next = job;
+    } else {
+        helpers.head = job;
+    }
+    helpers.tail = job;
+    pthread_cond_signal(&helpers.queued);
+    pthread_mutex_unlock(&helpers.lock);
+}
+
+void conn_free(struct connection* c){
+    if (c->job != NULL) {
+        job_release(c->job);
+    }
+    // Those attached fetch on their own if it was not done
+    conn_unshare(c, INFLIGHT_FAILED, 0);
+    if (c->parsed != NULL) {
+        ParsedRequest_destroy(c->parsed);
+    }
+    free(c->request);
+    free(c->key);
+    free(c->upstream_req);
+    free(c->response);
+    if (c->stale != NULL) {
+        cache_release(c->stale);
+    }
+    free(c);
+    __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+}
+
+int response_reserve(struct connection* c, int extra){
+    if (c->response_len + extra <= c->response_cap) {
+        return 0;
+    }
+    int cap = c->response_cap ? c->response_cap : MAX_BYTES;
+    while (cap < c->response_len + extra) {
+        cap *= 2; // Double the size
+    }
+    // Collecting stops once the response is too big to cache, it never
+    // takes more than that and one last read
+    int limit = cache.max_element_size + MAX_BYTES;
+    if (cap > limit && c->response_len + extra <= limit) {
+        cap = limit;
+    }
+    char* bigger = (char*)realloc(c->response, cap);
+    if (bigger == NULL) {
+        return -1;
+    }
+    c->response = bigger;
+    c->response_cap = cap;
+    return 0;
+}
+
+void response_relayed(struct connection* c){
+    c->response_len = c->response_sent = 0;
+    if (c->response_cap > RELAY_BUFFER) {
+        char* window = (char*)realloc(c->response, RELAY_BUFFER);
+        if (window != NULL) {
+            c->response = window;
+            c->response_cap = RELAY_BUFFER;
+        }
+    }
+}
+
+struct connection* conn_create(int client_fd){
+    struct connection* c = (struct connection*)calloc(1, sizeof(struct connection));
+    if (c == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    c->request = (char*)malloc(MAX_BYTES + 1);
+    if (c->request == NULL) {
+        perror("Memory allocation failed");
+        free(c);
+        return NULL;
+    }
+    c->state = CONN_READ_REQUEST;
+    c->client.fd = client_fd;
+    c->client.is_upstream = 0;
+    c->client.conn = c;
+    c->upstream.fd = -1;
+    c->upstream.is_upstream = 1;
+    c->upstream.conn = c;
+    c->io_buf = -1;
+    http_framing_init(&c->framing);
+    __atomic_add_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+int conn_upstream_header(struct connection* c){
+    http_framing_update(&c->framing, c->response, c->response_len);
+    int header_len = c->framing.header_len;
+    if (header_len == 0) {
+        return 0;
+    }
+    // Nothing goes out before it is known whether the stale copy answers
+    if (c->stale != NULL && c->framing.status == 304) {
+        return CONN_UPSTREAM_RECV;
+    }
+    if (c->stale != NULL && c->framing.status >= 500 && conn_serve_stale(c) == 0) {
+        // Those attached see the error and do the same
+        conn_unshare(c, INFLIGHT_FAILED, -1);
+        return CONN_WRITE_RESPONSE;
+    }
+    // Same rule as the relay in thread mode: only what the origin allows to
+    // be shared, and only what is not announced as too big
+    if (c->key != NULL && http_response_cacheable(c->response, header_len) &&
+        (c->framing.mode != FRAMING_LENGTH ||
+         c->framing.message_len <= cache.max_element_size)) {
+        return CONN_FILL_RESPONSE;
+    }
+    // Not kept, so not shared either
+    conn_unshare(c, INFLIGHT_UNSHARED, 0);
+    return CONN_RELAY_RESPONSE;
+}
+
+void conn_upstream_share(struct connection* c){
+    // Only we append, what the fetch has is what we shared so far
+    if (c->shared != NULL && c->response_len > c->shared->len &&
+        inflight_append(c->shared, c->response + c->shared->len,
+                        c->response_len - c->shared->len) < 0) {
+        // Too big to share, it ended as failed
+        inflight_release(c->shared);
+        c->shared = NULL;
+    }
+}
+
+void conn_unshare(struct connection* c, int state, int status){
+    if (c->shared != NULL) {
+        inflight_end(c->shared, state, status);
+        inflight_release(c->shared);
+        c->shared = NULL;
+    }
+}
+
+void conn_upstream_done(struct connection* c){
+    if (c->state == CONN_FILL_RESPONSE) {
+        // Decided to be cached when the header block came in, unless the
+        // origin cut it short. add_cache_element() takes the expiry from
+        // its headers.
+        conn_upstream_share(c);
+        if (http_framing_update(&c->framing, c->response, c->response_len) ||
+            c->framing.mode == FRAMING_CLOSE) {
+            // Cached before the fetch is ended, a request that no longer
+            // finds the fetch in flight finds the response
+            add_cache_element(c->response, c->response_len, c->key);
+            conn_unshare(c, INFLIGHT_DONE, 0);
+        } else {
+            conn_unshare(c, INFLIGHT_FAILED, 0);
+        }
+        return;
+    }
+    if (c->stale != NULL && c->framing.status == 304) {
+        // Unchanged, the client gets the cached copy instead. Whoever
+        // waits for this fetch finds it in the cache.
+        cache_refresh(c->stale, c->response, c->framing.header_len);
+        conn_unshare(c, INFLIGHT_UNSHARED, 0);
+        c->response_len = 0;
+        if (response_reserve(c, c->stale->len) == 0) {
+            cache_element_copy(c->stale, c->response);
+            c->response_len = c->stale->len;
+        }
+    }
+    // The origin closed before its header block was complete
+    conn_unshare(c, INFLIGHT_FAILED, 0);
+}
+
+int conn_upstream_overflow(struct connection* c){
+    return c->response_len > cache.max_element_size;
+}
+
+int conn_upstream_too_big(struct connection* c){
+    if (c->stale != NULL &&
+        http_response_status(c->response, c->response_len) >= 500 &&
+        conn_serve_stale(c) == 0) {
+        conn_unshare(c, INFLIGHT_FAILED, -1);
+        return CONN_WRITE_RESPONSE;
+    }
+    // Those attached that got nothing yet fetch on their own
+    conn_unshare(c, INFLIGHT_FAILED, 0);
+    printf("Response does not fit in the cache, relaying it\n");
+    return CONN_RELAY_RESPONSE;
+}
+
+int conn_serve_stale(struct connection* c){
+    if (c->stale == NULL || !stale_servable(c->stale, config.stale_if_error)) {
+        return -1;
+    }
+    c->response_len = 0;
+    c->response_sent = 0;
+    if (response_reserve(c, c->stale->len) < 0) {
+        return -1;
+    }
+    cache_element_copy(c->stale, c->response);
+    c->response_len = c->stale->len;
+    printf("Origin failed, serving a stale copy\n");
+    return 0;
+}
+
+int conn_timeout(struct connection* c){
+    switch (c->state) {
+        case CONN_READ_REQUEST:
+        case CONN_WRITE_RESPONSE:
+            return config.keepalive_timeout > 0 ? config.keepalive_timeout * 1000
+                                                : config.read_timeout;
+        case CONN_RESOLVE:
+        case CONN_UPSTREAM_CONNECT:
+            return config.connect_timeout;
+        case CONN_UPSTREAM_SEND:
+            return config.first_byte_timeout;
+        case CONN_UPSTREAM_RECV:
+            return c->response_len == 0 ? config.first_byte_timeout
+                                        : config.read_timeout;
+        case CONN_FILL_RESPONSE:
+        case CONN_RELAY_RESPONSE:
+            return config.read_timeout;
+        case CONN_SHARED_RESPONSE:
+            return c->response_sent < c->response_len ? config.read_timeout : 0;
+        default:
+            return 0;
+    }
+}
+
+static void accept_clients(struct event_loop* loop){
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int fd = accept4(loop->listen_fd, (struct sockaddr*)&client_addr,
+                         &client_len, SOCK_NONBLOCK);
+        if (fd < 0) {
+            // EAGAIN: another loop took it or the queue is drained
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept failed");
+            }
+            return;
+        }
+
+        struct connection* c = conn_create(fd);
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+
+        // Edge-triggered: we are told once per change of readiness and have
+        // to drain the socket every time.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c->client;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            conn_free(c);
+            close(fd);
+            continue;
+        }
+        // The whole request has to be in by then, trickling it in byte by
+        // byte does not buy more time
+        timer_start(loop, c);
+    }
+}
+
+// READ_REQUEST: read until the end of the headers. Returns 1 once the whole
+// request is in, 0 if we have to wait for more data, -1 to drop the client.
+static int read_request(struct connection* c){
+    while (c->request_len < MAX_BYTES) {
+        int n = recv(c->client.fd, c->request + c->request_len,
+                     MAX_BYTES - c->request_len, 0);
+        if (n > 0) {
+            c->request_len += n;
+            c->request[c->request_len] = '\0';
+            // Any HTTP request ends with "\r\n\r\n"
+            if (strstr(c->request, "\r\n\r\n") != NULL) {
+                return 1;
+            }
+        } else if (n == 0) {
+            printf("Client is disconnected\n");
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            perror("Error receiving request");
+            return -1;
+        }
+    }
+    // Headers do not fit in our buffer
+    sendErrorMessage(c->client.fd, 400);
+    return -1;
+}
+
+// Serves a hit of the memory cache and gives temp back
+static int serve_cached(struct connection* c, cache_element* temp){
+    ParsedRequest_destroy(c->parsed);
+    c->parsed = NULL;
+    int err = response_reserve(c, temp->len);
+    if (err == 0) {
+        cache_element_copy(temp, c->response);
+        c->response_len = temp->len;
+    }
+    cache_release(temp);
+    if (err < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    return CONN_WRITE_RESPONSE;
+}
+
+// Serves a response read from disk, stored is taken over as the buffer
+static int serve_stored(struct connection* c, char* stored, int stored_len){
+    ParsedRequest_destroy(c->parsed);
+    c->parsed = NULL;
+    free(c->response);
+    c->response = stored;
+    c->response_len = c->response_cap = stored_len;
+    return CONN_WRITE_RESPONSE;
+}
+
+// Prepares the origin request of what no tier had
+static int prepare_origin(struct connection* c, struct ParsedRequest* request){
+    c->upstream_req = (char*)malloc(MAX_BYTES);
+    if (c->upstream_req == NULL) {
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    if (c->key != NULL) {
+        c->stale = prepare_revalidation(request, c->key);
+    }
+    c->upstream_req_len = build_upstream_request(request, c->upstream_req, MAX_BYTES, 0);
+
+    int server_port = request->port ? atoi(request->port) : 80;
+    memset(&c->upstream_addr, 0, sizeof(c->upstream_addr));
+    c->upstream_addr.sin_family = AF_INET;
+    c->upstream_addr.sin_port = htons(server_port);
+    int known = c->upstream_req_len < 0 ? -1 :
+                dns_cache_peek(request->host, &c->upstream_addr.sin_addr);
+    if (known > 0 && strlen(request->host) < DNS_HOST_LEN &&
+        (c->job = job_create(JOB_RESOLVE)) != NULL) {
+        strcpy(c->job->host, request->host);
+        job_submit(c->job);
+        return CONN_RESOLVE;
+    }
+    if (known > 0) {
+        // Could not hand it off, resolve here like the thread mode does
+        known = resolveRemoteServer(request->host, server_port, &c->upstream_addr);
+    }
+    if (known < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    return CONN_UPSTREAM_CONNECT;
+}
+
+static int fetch_origin(struct connection* c){
+    int next = prepare_origin(c, c->parsed);
+    ParsedRequest_destroy(c->parsed);
+    c->parsed = NULL;
+    return next;
+}
+
+// Another connection fetches the response, we pass on its parts as they
+// come in instead of going to the origin too
+static int follow_fetch(struct connection* c, struct inflight* shared){
+    c->job = job_create(JOB_FOLLOW);
+    if (c->job == NULL) {
+        inflight_release(shared);
+        return fetch_origin(c);
+    }
+    c->job->shared = shared;
+    c->job->watcher.fd = c->job->fd;
+    inflight_watch(shared, &c->job->watcher);
+    // Whatever came in before we watched is not reported
+    return conn_follow(c);
+}
+
+// What the memory cache and the disk tier did not have: a stale copy served
+// right away, the fetch of another connection or our own
+static int lookup_origin(struct connection* c){
+    // The loop does not wait for the origin to refresh what expired lately
+    cache_element* temp = c->key != NULL ?
+                          find_stale(c->key, config.stale_while_revalidate) : NULL;
+    if (temp != NULL) {
+        refresh_in_background(c->request, c->request_len, c->key);
+        return serve_cached(c, temp);
+    }
+    if (c->key == NULL) {
+        return fetch_origin(c);
+    }
+    // A burst of misses makes one trip to the origin
+    int leader;
+    struct inflight* shared = inflight_join(c->key, &leader);
+    if (shared == NULL) {
+        return fetch_origin(c);
+    }
+    if (!leader) {
+        return follow_fetch(c, shared);
+    }
+    c->shared = shared;
+    // The fetcher before us caches the response before it leaves the
+    // table, so it may have done both since our lookup
+    temp = cache_peek(c->key, 0);
+    if (temp != NULL) {
+        conn_unshare(c, INFLIGHT_UNSHARED, 0);
+        return serve_cached(c, temp);
+    }
+    return fetch_origin(c);
+}
+
+// The memory cache missed: asks the disk tier, then the origin
+static int lookup_disk(struct connection* c){
+    if (c->key != NULL && config.disk_cache != NULL && disk_cache_has(c->key)) {
+        // The read goes to a helper thread, the index said it is worth it
+        c->job = job_create(JOB_DISK_READ);
+        if (c->job != NULL) {
+            c->job->key = *c->key;
+            job_submit(c->job);
+            return CONN_DISK_READ;
+        }
+        int stored_len;
+        char* stored = disk_cache_read(c->key, &stored_len, config.disk_promote);
+        if (stored != NULL) {
+            return serve_stored(c, stored, stored_len);
+        }
+    }
+    return lookup_origin(c);
+}
+
+int conn_lookup(struct connection* c){
+    struct ParsedRequest* request = ParsedRequest_create();
+    if (ParsedRequest_parse(request, c->request, c->request_len) < 0) {
+        printf("Parsing failed\n");
+        sendErrorMessage(c->client.fd, 400);
+        ParsedRequest_destroy(request);
+        return -1;
+    }
+    if (strcmp(request->method, "GET")) {
+        printf("This code does not support any method except GET\n");
+        sendErrorMessage(c->client.fd, 501);
+        ParsedRequest_destroy(request);
+        return -1;
+    }
+    if (!request->host || !request->path ||
+        checkHTTPversion(request->version) != 1) {
+        sendErrorMessage(c->client.fd, 500);
+        ParsedRequest_destroy(request);
+        return -1;
+    }
+
+    c->key = (struct cache_key*)malloc(sizeof(struct cache_key));
+    if (c->key != NULL &&
+        cache_key_build(c->key, request->method, request->host, request->port,
+                        request->path) < 0) {
+        // Fetched, but not cached
+        free(c->key);
+        c->key = NULL;
+    }
+    c->parsed = request;
+    cache_element* temp = c->key != NULL ? find(c->key) : NULL;
+    if (temp != NULL) {
+        return serve_cached(c, temp);
+    }
+    struct snapshot_entry* entry = c->key != NULL ? snapshot_claim(c->key) : NULL;
+    if (entry != NULL) {
+        // Still in the snapshot being loaded after a restart or takeover,
+        // a helper thread reads the record
+        c->job = job_create(JOB_SNAPSHOT_LOAD);
+        if (c->job != NULL) {
+            c->job->key = *c->key;
+            c->job->entry = entry;
+            job_submit(c->job);
+            return CONN_DISK_READ;
+        }
+        if (snapshot_load_claimed(entry, c->key) &&
+            (temp = find(c->key)) != NULL) {
+            return serve_cached(c, temp);
+        }
+    }
+    return lookup_disk(c);
+}
+
+int conn_disk_read(struct connection* c){
+    struct loop_job* job = c->job;
+    c->job = NULL;
+    if (job->kind == JOB_SNAPSHOT_LOAD) {
+        int loaded = job->status;
+        job_release(job);
+        cache_element* temp = loaded ? find(c->key) : NULL;
+        if (temp != NULL) {
+            return serve_cached(c, temp);
+        }
+        return lookup_disk(c);
+    }
+    char* stored = job->data;
+    int stored_len = job->len;
+    job->data = NULL;
+    job_release(job);
+    if (stored != NULL) {
+        return serve_stored(c, stored, stored_len);
+    }
+    return lookup_origin(c);
+}
+
+int conn_follow(struct connection* c){
+    struct loop_job* job = c->job;
+    unsigned long long count;
+    if (read(job->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
+    }
+    response_relayed(c);
+    if (response_reserve(c, RELAY_BUFFER) < 0) {
+        perror("Memory allocation failed");
+        if (job->offset == 0) {
+            sendErrorMessage(c->client.fd, 500);
+        }
+        return -1;
+    }
+    int n = inflight_try_read(job->shared, job->offset, c->response, c->response_cap);
+    if (n == INFLIGHT_AGAIN) {
+        return CONN_SHARED_RESPONSE;
+    }
+    if (n > 0) {
+        job->offset += n;
+        c->response_len = n;
+        return CONN_SHARED_RESPONSE;
+    }
+
+    // The fetch has ended, its state no longer changes
+    int state = job->shared->state;
+    int status = job->shared->status;
+    long long passed = job->offset;
+    c->job = NULL;
+    job_release(job);
+    if (n == 0) {
+        printf("Relayed %lld bytes of a response fetched for another request\n", passed);
+        return CONN_WRITE_RESPONSE;
+    }
+    if (passed > 0) {
+        printf("Response fetched for another request was cut short\n");
+        return -1;
+    }
+    // A revalidation leaves the response in the cache, a failed fetch may
+    // leave a stale copy to stand in. The client of the fetcher going away
+    // is no reason to fail ours.
+    int fallback = state == INFLIGHT_UNSHARED || status >= 0;
+    cache_element* temp = cache_peek(c->key, 0);
+    if (temp == NULL && !fallback) {
+        temp = find_stale(c->key, config.stale_if_error);
+        if (temp == NULL) {
+            sendErrorMessage(c->client.fd, status == UPSTREAM_TIMEOUT ? 504 : 500);
+            return -1;
+        }
+        printf("Origin failed, serving a stale copy\n");
+    }
+    if (temp != NULL) {
+        return serve_cached(c, temp);
+    }
+    return fetch_origin(c);
+}
+
+int conn_resolved(struct connection* c){
+    struct loop_job* job = c->job;
+    c->job = NULL;
+    int status = job->status;
+    c->upstream_addr.sin_addr = job->addr;
+    job_release(job);
+    if (status < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    return 0;
+}
+
+// The origin failed, code is the error the client gets unless a stale copy
+// stands in. Returns -1 if the connection is done, 0 if it moved on to
+// CONN_WRITE_RESPONSE.
+static int upstream_error(struct event_loop* loop, struct connection* c, int code){
+    timer_stop(loop, c);
+    conn_unshare(c, INFLIGHT_FAILED, code == 504 ? UPSTREAM_TIMEOUT : -1);
+    if (c->job != NULL) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->job->fd, NULL);
+        job_release(c->job);
+        c->job = NULL;
+    }
+    if (c->upstream.fd >= 0) {
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    if (conn_serve_stale(c) == 0) {
+        c->state = CONN_WRITE_RESPONSE;
+        timer_start(loop, c);
+        return 0;
+    }
+    sendErrorMessage(c->client.fd, code);
+    return -1;
+}
+
+// Starts the non-blocking connect to c->upstream_addr. Returns -1 when the
+// connection is finished with an error.
+static int connect_upstream(struct event_loop* loop, struct connection* c){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("Error in creating your socket");
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    c->upstream.fd = fd;
+    if (connect(fd, (struct sockaddr*)&c->upstream_addr, sizeof(c->upstream_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("Error in connecting");
+        return upstream_error(loop, c, 500);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->upstream;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        sendErrorMessage(c->client.fd, 500);
+        return -1;
+    }
+    c->state = CONN_UPSTREAM_CONNECT;
+    timer_start(loop, c);
+    return 0;
+}
+
+// Moves c on to what conn_lookup() or conn_disk_read() returned: serve from
+// the cache, wait for a helper thread or a fetch in flight, or start the
+// origin connection.
+// Returns -1 when the connection is finished with an error.
+static int lookup_next(struct event_loop* loop, struct connection* c, int next){
+    if (next < 0) {
+        return -1;
+    }
+    if (next == CONN_WRITE_RESPONSE) {
+        c->state = CONN_WRITE_RESPONSE;
+        timer_start(loop, c);
+        return 0;
+    }
+    if (next == CONN_DISK_READ || next == CONN_RESOLVE ||
+        next == CONN_SHARED_RESPONSE) {
+        // The eventfd of the job stands in for the origin socket until then
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &c->upstream;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, c->job->fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            sendErrorMessage(c->client.fd, 500);
+            return -1;
+        }
+        c->state = (enum conn_state)next;
+        timer_start(loop, c);
+        return 0;
+    }
+    return connect_upstream(loop, c);
+}
+
+// Whether the helper thread is done with the job of c. Only its eventfd
+// reports to the origin end while there is one.
+static int job_done(struct conn_end* end){
+    unsigned long long count;
+    return end->is_upstream &&
+           read(end->conn->job->fd, &count, sizeof(count)) == sizeof(count);
+}
+
+// UPSTREAM_RECV, FILL_RESPONSE: collect the origin response. Returns 1 once
+// the origin has closed, 2 once the response is too big to cache, 3 once
+// its header block is in, with what happens to it in *next, 0 to wait for
+// more data and -1 on error.
+static int read_upstream(struct connection* c, int* next){
+    while (!conn_upstream_overflow(c)) {
+        if (response_reserve(c, MAX_BYTES) < 0) {
+            perror("Memory reallocation failed");
+            return -1;
+        }
+        int n = recv(c->upstream.fd, c->response + c->response_len,
+                     MAX_BYTES, 0);
+        if (n > 0) {
+            c->response_len += n;
+            if (c->state == CONN_UPSTREAM_RECV && c->framing.header_len == 0 &&
+                (*next = conn_upstream_header(c)) != 0) {
+                return 3;
+            }
+        } else if (n == 0) {
+            return 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            perror("Error receiving data from remote server");
+            return -1;
+        }
+    }
+    return 2;
+}
+
+// Sends buf[*sent..len) on fd. Returns 1 when everything went out, 0 if the
+// socket is full and -1 on error.
+static int send_pending(int fd, const char* buf, int len, int* sent){
+    while (*sent < len) {
+        int n = send(fd, buf + *sent, len - *sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            *sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// RELAY_RESPONSE: pass the response on through a RELAY_BUFFER window,
+// reading more from the origin only once the client took what came before.
+// Returns 1 once the origin closed and all of it went out, 0 to wait for
+// either socket and -1 on error. *progress is set if any bytes moved.
+static int relay_response(struct connection* c, int* progress){
+    while (1) {
+        int sent = c->response_sent;
+        int status = send_pending(c->client.fd, c->response, c->response_len,
+                                  &c->response_sent);
+        if (c->response_sent != sent) {
+            *progress = 1;
+        }
+        if (status <= 0) {
+            if (status < 0) {
+                perror("Error sending data to client");
+            }
+            return status;
+        }
+        if (c->upstream.fd < 0) {
+            return 1;
+        }
+        response_relayed(c);
+        int n = recv(c->upstream.fd, c->response, c->response_cap, 0);
+        if (n > 0) {
+            c->response_len = n;
+            *progress = 1;
+        } else if (n == 0) {
+            close(c->upstream.fd);
+            c->upstream.fd = -1;
+            return 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            perror("Error receiving data from remote server");
+            return -1;
+        }
+    }
+}
+
+// Runs the state machine of one connection as far as it can go without
+// blocking. `end` is the socket that became ready.
+static void conn_advance(struct event_loop* loop, struct conn_end* end,
+                         uint32_t events){
+    struct connection* c = end->conn;
+    int status;
+
+    if (c->state == CONN_DONE) {
+        return;
+    }
+    if (!end->is_upstream && (events & (EPOLLERR | EPOLLHUP))) {
+        // Client went away, nothing left to answer
+        conn_close(loop, c);
+        return;
+    }
+
+    while (1) {
+        switch (c->state) {
+            case CONN_READ_REQUEST:
+                status = read_request(c);
+                if (status <= 0) {
+                    if (status < 0) {
+                        conn_close(loop, c);
+                    }
+                    return;
+                }
+                c->state = CONN_CACHE_LOOKUP;
+                break;
+
+            case CONN_CACHE_LOOKUP:
+                if (lookup_next(loop, c, conn_lookup(c)) < 0) {
+                    conn_close(loop, c);
+                    return;
+                }
+                break;
+
+            case CONN_DISK_READ:
+                if (!job_done(end)) {
+                    return;
+                }
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->job->fd, NULL);
+                if (lookup_next(loop, c, conn_disk_read(c)) < 0) {
+                    conn_close(loop, c);
+                    return;
+                }
+                break;
+
+            case CONN_RESOLVE:
+                if (!job_done(end)) {
+                    return;
+                }
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->job->fd, NULL);
+                if (conn_resolved(c) < 0 || connect_upstream(loop, c) < 0) {
+                    conn_close(loop, c);
+                    return;
+                }
+                break;
+
+            case CONN_UPSTREAM_CONNECT: {
+                // Only the origin socket becoming writable (or failing)
+                // tells us the connect finished
+                if (!end->is_upstream) {
+                    return;
+                }
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err != 0) {
+                    fprintf(stderr, "Error in connecting: %s\n", strerror(err));
+                    if (upstream_error(loop, c, 500) < 0) {
+                        conn_close(loop, c);
+                        return;
+                    }
+                    break;
+                }
+                // The first byte timeout covers sending the request too
+                c->state = CONN_UPSTREAM_SEND;
+                timer_start(loop, c);
+                break;
+            }
+
+            case CONN_UPSTREAM_SEND:
+                status = send_pending(c->upstream.fd, c->upstream_req,
+                                      c->upstream_req_len, &c->upstream_req_sent);
+                if (status < 0) {
+                    perror("Error sending request to remote server");
+                    if (upstream_error(loop, c, 500) < 0) {
+                        conn_close(loop, c);
+                        return;
+                    }
+                    break;
+                }
+                if (status == 0) {
+                    return;
+                }
+                c->state = CONN_UPSTREAM_RECV;
+                break;
+
+            case CONN_UPSTREAM_RECV:
+            case CONN_FILL_RESPONSE: {
+                int received = c->response_len;
+                int next;
+                status = read_upstream(c, &next);
+                if (status < 0 && c->state == CONN_FILL_RESPONSE) {
+                    // Part of it may be out already, it can only be cut short
+                    conn_close(loop, c);
+                    return;
+                }
+                if (status < 0) {
+                    if (upstream_error(loop, c, 500) < 0) {
+                        conn_close(loop, c);
+                        return;
+                    }
+                    break;
+                }
+                if (status == 3) {
+                    c->state = (enum conn_state)next;
+                    if (c->state == CONN_WRITE_RESPONSE) {
+                        close(c->upstream.fd);
+                        c->upstream.fd = -1;
+                    }
+                    timer_start(loop, c);
+                    break;
+                }
+                if (c->state == CONN_FILL_RESPONSE) {
+                    conn_upstream_share(c);
+                    if (send_pending(c->client.fd, c->response, c->response_len,
+                                     &c->response_sent) < 0) {
+                        perror("Error sending data to client");
+                        conn_close(loop, c);
+                        return;
+                    }
+                }
+                if (status == 0) {
+                    // Any progress restarts the idle read timeout
+                    if (c->response_len != received) {
+                        timer_start(loop, c);
+                    }
+                    return;
+                }
+                if (status == 2) {
+                    c->state = (enum conn_state)conn_upstream_too_big(c);
+                    if (c->state == CONN_WRITE_RESPONSE) {
+                        close(c->upstream.fd);
+                        c->upstream.fd = -1;
+                    }
+                    timer_start(loop, c);
+                    break;
+                }
+                close(c->upstream.fd);
+                c->upstream.fd = -1;
+                conn_upstream_done(c);
+                c->state = CONN_WRITE_RESPONSE;
+                timer_start(loop, c);
+                break;
+            }
+
+            case CONN_WRITE_RESPONSE: {
+                int sent = c->response_sent;
+                status = send_pending(c->client.fd, c->response,
+                                      c->response_len, &c->response_sent);
+                if (status == 0) {
+                    // A client that reads keeps its connection
+                    if (c->response_sent != sent) {
+                        timer_start(loop, c);
+                    }
+                    return;
+                }
+                if (status < 0) {
+                    perror("Error sending data to client");
+                }
+                shutdown(c->client.fd, SHUT_RDWR);
+                conn_close(loop, c);
+                return;
+            }
+
+            case CONN_RELAY_RESPONSE: {
+                // The response went out in part already, an error can only
+                // cut it short
+                int progress = 0;
+                status = relay_response(c, &progress);
+                if (status == 0) {
+                    if (progress) {
+                        timer_start(loop, c);
+                    }
+                    return;
+                }
+                if (status > 0) {
+                    shutdown(c->client.fd, SHUT_RDWR);
+                }
+                conn_close(loop, c);
+                return;
+            }
+
+            case CONN_SHARED_RESPONSE: {
+                // Either the client took the last part or the fetch has more
+                status = send_pending(c->client.fd, c->response,
+                                      c->response_len, &c->response_sent);
+                if (status < 0) {
+                    perror("Error sending data to client");
+                    conn_close(loop, c);
+                    return;
+                }
+                if (status == 0) {
+                    timer_start(loop, c);
+                    return;
+                }
+                int next = conn_follow(c);
+                if (next != CONN_SHARED_RESPONSE) {
+                    // The job and its eventfd are gone
+                    if (lookup_next(loop, c, next) < 0) {
+                        conn_close(loop, c);
+                        return;
+                    }
+                    break;
+                }
+                timer_start(loop, c);
+                if (c->response_len == 0) {
+                    return;
+                }
+                break;
+            }
+
+            case CONN_DONE:
+                return;
+        }
+    }
+}
+
+// Closes every client that missed its deadline and every relay that
+// stalled, and answers every
+// connection whose origin missed one with a 504, or the stale copy that
+// stands in for it.
+// Returns how long epoll_wait may sleep before the next deadline, -1 if
+// there is none. Only walks the timer list once the earliest deadline
+// has passed.
+static int expire_timers(struct event_loop* loop){
+    if (loop->timers == NULL) {
+        loop->next_deadline = 0;
+        return -1;
+    }
+    long long now = monotonic_ms();
+    if (loop->next_deadline > now) {
+        return (int)(loop->next_deadline - now);
+    }
+
+    // Connections that move on to a new deadline below record it here
+    loop->next_deadline = 0;
+    long long next = 0;
+    struct connection* c = loop->timers;
+    while (c != NULL) {
+        struct connection* following = c->timer_next;
+        if (c->deadline <= now &&
+            (c->state == CONN_READ_REQUEST || c->state == CONN_WRITE_RESPONSE)) {
+            printf("Client is idle, closing the connection\n");
+            conn_close(loop, c);
+        } else if (c->deadline <= now && (c->state == CONN_RELAY_RESPONSE ||
+                                          c->state == CONN_FILL_RESPONSE ||
+                                          c->state == CONN_SHARED_RESPONSE)) {
+            fprintf(stderr, "Relay stalled, closing the connection\n");
+            conn_close(loop, c);
+        } else if (c->deadline <= now) {
+            fprintf(stderr, "Timed out waiting for remote server\n");
+            if (upstream_error(loop, c, 504) < 0) {
+                conn_close(loop, c);
+            } else {
+                // The client socket is writable already, no event comes
+                conn_advance(loop, &c->client, 0);
+            }
+        } else if (next == 0 || c->deadline < next) {
+            next = c->deadline;
+        }
+        c = following;
+    }
+    if (next == 0 || (loop->next_deadline != 0 && loop->next_deadline < next)) {
+        next = loop->next_deadline;
+    }
+    loop->next_deadline = next;
+    return next ? (int)(next > now ? next - now : 0) : -1;
+}
+
+static void* event_loop_fn(void* arg){
+    struct event_loop* loop = (struct event_loop*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+
+    if (loop->pinned) {
+        pin_to_core(loop->id);
+    }
+    loop->accepting = 1;
+    loop->upgrade_slot = upgrade_register(loop->wake_fd);
+
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (loop->accepting) {
+                    accept_clients(loop);
+                }
+            } else if (events[i].data.ptr == loop) {
+                // Read before the flag is checked below, a wake-up that
+                // comes after the check stays pending for the next wait
+                unsigned long long count;
+                if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("eventfd read failed");
+                }
+            } else {
+                conn_advance(loop, (struct conn_end*)events[i].data.ptr,
+                             events[i].events);
+            }
+        }
+        if (loop->accepting && !upgrade_accepting()) {
+            // A successor accepts from now on, we finish our connections
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+            loop->accepting = 0;
+            upgrade_stopped(loop->upgrade_slot);
+        } else if (!loop->accepting && upgrade_accepting()) {
+            // The handoff failed, the listener is ours again. Clients that
+            // queued up meanwhile are reported right away.
+            struct epoll_event ev;
+            ev.events = loop->pinned ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = NULL;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+                perror("epoll_ctl failed");
+            } else {
+                loop->accepting = 1;
+            }
+        }
+        timeout = expire_timers(loop);
+        while (loop->closed != NULL) {
+            struct connection* c = loop->closed;
+            loop->closed = c->next_closed;
+            conn_free(c);
+        }
+    }
+    return NULL;
+}
+
+int run_event_loops(int* listen_fds, int nlisteners, int nthreads){
+    int owned = nlisteners > 1;
+    if (owned) {
+        nthreads = nlisteners;
+    } else if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+    for (int i = 0; i < nlisteners; i++) {
+        if (set_nonblocking(listen_fds[i]) < 0) {
+            perror("fcntl failed");
+            return -1;
+        }
+    }
+    loop_helpers_start();
+
+    struct event_loop* loops = (struct event_loop*)calloc(nthreads, sizeof(struct event_loop));
+    if (loops == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        loops[i].id = i;
+        loops[i].listen_fd = owned ? listen_fds[i] : listen_fds[0];
+        loops[i].pinned = owned;
+        loops[i].epoll_fd = epoll_create1(0);
+        if (loops[i].epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            break;
+        }
+        // A shared listening socket is watched by every loop. EPOLLEXCLUSIVE
+        // wakes up only one of them per incoming connection.
+        struct epoll_event ev;
+        ev.events = owned ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].listen_fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(loops[i].epoll_fd);
+            break;
+        }
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loops[i];
+        if (loops[i].wake_fd < 0 ||
+            epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) < 0) {
+            perror("Failed to set up the wake-up eventfd");
+            if (loops[i].wake_fd >= 0) {
+                close(loops[i].wake_fd);
+            }
+            close(loops[i].epoll_fd);
+            break;
+        }
+        if (pthread_create(&loops[i].thread, NULL, event_loop_fn, &loops[i]) != 0) {
+            perror("pthread_create failed");
+            close(loops[i].wake_fd);
+            close(loops[i].epoll_fd);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        free(loops);
+        return -1;
+    }
+    if (owned && started < nthreads) {
+        // Nobody accepts on the remaining listeners, the kernel would still
+        // hand them clients
+        fprintf(stderr, "Only %d of %d event loops started\n", started, nthreads);
+    }
+    printf("Started %d epoll event loops\n", started);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].wake_fd);
+        close(loops[i].epoll_fd);
+    }
+    free(loops);
+    return 0;
+}
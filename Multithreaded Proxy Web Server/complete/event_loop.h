@@ -0,0 +1,226 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "proxy_server_with_cache.h"
+#include "dns_cache.h"
+#include "http_response.h"
+#include "inflight.h"
+
+#include <linux/time_types.h>
+
+// Every client connection is a small state machine driven by epoll events
+// instead of a dedicated thread. A connection only moves forward when the
+// socket it is waiting on becomes ready.
+enum conn_state {
+    CONN_READ_REQUEST,      // reading the request headers from the client
+    CONN_CACHE_LOOKUP,      // looking the request up in the LRU cache
+    CONN_DISK_READ,         // a helper thread reads the response from disk
+                            // or from the snapshot being loaded
+    CONN_RESOLVE,           // a helper thread resolves the origin's name
+    CONN_UPSTREAM_CONNECT,  // non-blocking connect to the origin in progress
+    CONN_UPSTREAM_SEND,     // forwarding the request to the origin
+    CONN_UPSTREAM_RECV,     // reading the origin response until its header
+                            // block is in, or all of a revalidation
+    CONN_FILL_RESPONSE,     // passing a cacheable response on to the client
+                            // as it arrives, keeping all of it for the cache
+    CONN_WRITE_RESPONSE,    // writing the (cached or fetched) response out
+    CONN_RELAY_RESPONSE,    // passing a response that is not cached on to
+                            // the client as it arrives
+    CONN_SHARED_RESPONSE,   // passing on the response another connection
+                            // fetches for the same key as it arrives
+    CONN_DONE               // finished, waiting to be freed
+};
+
+struct connection;
+struct snapshot_entry;
+
+#define LOOP_HELPERS 4      // threads doing the blocking work of all loops
+
+#define JOB_RESOLVE   0     // a name the DNS cache did not know
+#define JOB_DISK_READ 1     // a response the disk tier has
+#define JOB_SNAPSHOT_LOAD 2 // a record of the snapshot being loaded
+#define JOB_FOLLOW    3     // a fetch in flight, no helper thread takes it
+
+// Blocking work handed to the helper threads so it does not stall a loop.
+// fd is an eventfd that becomes readable once the result is in, or for
+// JOB_FOLLOW whenever the fetch has more.
+struct loop_job {
+    int kind;
+    int fd;
+    int refs;               // the connection and the queue or helper
+    struct loop_job* next;  // helper queue
+
+    char host[DNS_HOST_LEN];    // JOB_RESOLVE
+    int status;                 // what dns_cache_resolve() returned
+    struct in_addr addr;
+
+    struct cache_key key;       // JOB_DISK_READ, JOB_SNAPSHOT_LOAD
+    char* data;                 // malloc'd response, NULL if not read
+    int len;
+
+    struct snapshot_entry* entry;   // claimed record, status is what
+                                    // snapshot_load_claimed() returned
+
+    struct inflight* shared;    // JOB_FOLLOW, watched through fd
+    struct inflight_watcher watcher;
+    long long offset;           // bytes of it passed on so far
+};
+
+// One end of a connection (client or origin socket). A pointer to it is
+// stored in the epoll event so we know which socket became ready.
+struct conn_end {
+    int fd;
+    int is_upstream;
+    struct connection* conn;
+};
+
+struct connection {
+    enum conn_state state;
+    struct conn_end client;
+    struct conn_end upstream;
+
+    char* request;          // raw request bytes
+    int request_len;
+    struct cache_key* key;  // what the response is cached under, NULL if
+                            // it is not cached
+    cache_element* stale;   // cached copy the origin is asked to confirm,
+                            // NULL if none
+
+    struct ParsedRequest* parsed;   // kept while the disk or snapshot is
+                                    // read and while a fetch is followed
+    struct loop_job* job;   // helper work in progress or the fetch followed,
+                            // NULL if none
+    struct inflight* shared;    // fetch we lead for the connections with
+                                // the same key, NULL if none
+
+    struct sockaddr_in upstream_addr;
+    char* upstream_req;     // request rewritten for the origin
+    int upstream_req_len;
+    int upstream_req_sent;
+
+    char* response;         // response bytes to write to the client
+    int response_len;
+    int response_cap;
+    int response_sent;
+    struct response_framing framing;    // of the origin response, its
+                                        // header_len is 0 until the
+                                        // header block is in
+
+    int io_buf;             // registered buffer in use (io_uring), -1 if none
+    struct __kernel_timespec io_timeout;  // linked timeout of the operation
+                                          // in flight (io_uring)
+
+    // Deadline of the phase in progress, in CLOCK_MONOTONIC ms, 0 if none.
+    // Connections with one are on their epoll loop's timer list. The
+    // io_uring backend only keeps the one of the request read here.
+    long long deadline;
+    struct connection* timer_prev;
+    struct connection* timer_next;
+
+    struct connection* next_closed;
+};
+
+// Connection handling shared by the epoll loops and the io_uring backend.
+// Only the way the sockets are driven differs between the two.
+struct connection* conn_create(int client_fd);
+void conn_free(struct connection* c);
+
+// Makes sure the response buffer can take `extra` more bytes
+int response_reserve(struct connection* c, int extra);
+
+// Empties the response buffer once a relayed part went out. What was
+// collected for the cache is gone by then, a RELAY_BUFFER window is kept.
+void response_relayed(struct connection* c);
+
+// Called after every read of the origin in CONN_UPSTREAM_RECV until the
+// header block of the response is in. Returns 0 while it is not, then
+// what happens to the response: CONN_FILL_RESPONSE if it is cached and
+// passed on meanwhile, CONN_RELAY_RESPONSE if it is only passed on,
+// CONN_UPSTREAM_RECV if it is collected first because it revalidates
+// c->stale, or CONN_WRITE_RESPONSE if the origin failed and the stale copy
+// in c->response stands in for it.
+int conn_upstream_header(struct connection* c);
+
+// Called after every read of the origin in CONN_FILL_RESPONSE. Shares what
+// came in with the connections that follow the fetch.
+void conn_upstream_share(struct connection* c);
+
+// Ends the fetch c leads for other connections, see inflight_end(). A no-op
+// if it leads none.
+void conn_unshare(struct connection* c, int state, int status);
+
+// Whether the origin response in c->response got too big to cache. It is
+// not collected any further then.
+int conn_upstream_overflow(struct connection* c);
+
+// Called once the response overflowed. Returns CONN_WRITE_RESPONSE if the
+// origin failed and the stale copy in c->response stands in for it,
+// CONN_RELAY_RESPONSE if what came so far and the rest go to the client.
+int conn_upstream_too_big(struct connection* c);
+
+// Parses the request once it is all in and looks its key up in the cache.
+// On a hit the response
+// is copied to c->response and CONN_WRITE_RESPONSE is returned. On a miss
+// the origin request and address are prepared and CONN_UPSTREAM_CONNECT is
+// returned, or CONN_RESOLVE if the address is still being looked up.
+// CONN_DISK_READ means the response is being read from the disk tier or
+// the snapshot being loaded, the lookup goes on with conn_disk_read() once
+// c->job->fd became readable. CONN_SHARED_RESPONSE means another
+// connection fetches the response already, see conn_follow(). -1 means
+// the connection has to be closed (an error response has already been sent
+// where one is due).
+int conn_lookup(struct connection* c);
+
+// Serves the response read from disk or the snapshot, or carries on looking
+// the request up if it was not there after all. Returns what conn_lookup()
+// does.
+int conn_disk_read(struct connection* c);
+
+// Called in CONN_SHARED_RESPONSE once the last part went out. Reads
+// c->job->fd empty and puts the next part of the followed fetch in
+// c->response, which stays empty if there is none yet: a write to the
+// eventfd tells about more. Returns CONN_SHARED_RESPONSE until the fetch
+// ended, then CONN_WRITE_RESPONSE once all of it went out or what
+// conn_lookup() does for a client that is still waiting for an answer of
+// its own.
+int conn_follow(struct connection* c);
+
+// Called when c->job->fd became readable. Puts the origin address in
+// c->upstream_addr and returns 0, or -1 if the connection has to be closed
+// (the error response has been sent).
+int conn_resolved(struct connection* c);
+
+// Called once the origin closed and the full response is in c->response.
+// Some of it may have gone to the client already in CONN_FILL_RESPONSE.
+void conn_upstream_done(struct connection* c);
+
+// The origin failed: puts the stale copy of the response in c->response if
+// it may stand in for an error. Returns -1 if the client has to get the
+// error instead.
+int conn_serve_stale(struct connection* c);
+
+// Milliseconds the phase c is in may take. The origin gets the connect
+// timeout while its name is resolved and while connecting, the first byte timeout until the response
+// starts and the read timeout between later reads. The client gets the
+// keep-alive timeout (the read timeout if keep-alive is off) to send its
+// whole request, and as much between writes of the response that make
+// progress. A relayed or filled response may stall on either side for the
+// read timeout. A followed fetch is only timed while the client does not
+// take a part, its fetcher keeps the deadlines of the origin. 0 means no
+// limit.
+int conn_timeout(struct connection* c);
+
+long long monotonic_ms(void);
+
+// Starts the LOOP_HELPERS threads that resolve names and read from the disk
+// tier and the snapshot for the loops. Without them the loops do it themselves. Returns -1
+// if none could be started.
+int loop_helpers_start(void);
+
+// Starts the event loops and blocks until they exit. With one listener,
+// nthreads loops (0 = one per online CPU) share it. With several
+// SO_REUSEPORT listeners every loop owns one and is pinned to its own core,
+// and nthreads is ignored. Returns -1 if the loops could not be started.
+int run_event_loops(int* listen_fds, int nlisteners, int nthreads);
+
+#endif // EVENT_LOOP_H
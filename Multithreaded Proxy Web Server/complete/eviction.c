@@ -0,0 +1,380 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLRU_PROTECTED_PERCENT 80   // share of the budget for protected
+#define S3FIFO_SMALL_PERCENT 10     // share of the budget for the small queue
+#define S3FIFO_MAX_PASSES 3         // extra passes through main an element
+                                    // can earn with its hits
+
+void cache_list_unlink(struct cache_list* l, cache_element* e){
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        l->head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        l->tail = e->prev;
+    }
+    l->count--;
+    l->size -= e->size;
+}
+
+void cache_list_push_front(struct cache_list* l, cache_element* e){
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head != NULL) {
+        l->head->prev = e;
+    } else {
+        l->tail = e;
+    }
+    l->head = e;
+    l->count++;
+    l->size += e->size;
+}
+
+static void list_move_front(struct cache_list* from, struct cache_list* to,
+                            cache_element* e){
+    cache_list_unlink(from, e);
+    cache_list_push_front(to, e);
+}
+
+// Hits counted since the policy last looked at e, counting starts over
+static int take_hits(cache_element* e){
+    return __atomic_exchange_n(&e->hits, 0, __ATOMIC_RELAXED);
+}
+
+static void ghost_init(struct ghost_list* g, unsigned slots){
+    unsigned n = 1;
+    while (n < 2 * slots) {
+        n *= 2;
+    }
+    g->entries = (struct ghost_entry*)calloc(n, sizeof(struct ghost_entry));
+    if (g->entries == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    g->mask = n - 1;
+    g->added = 0;
+}
+
+static void ghost_add(struct ghost_list* g, unsigned long long hash){
+    struct ghost_entry* entry = &g->entries[hash & g->mask];
+    entry->hash = hash;
+    entry->added = ++g->added;
+}
+
+// Whether hash is among the last `remembered` keys added, forgetting it
+static int ghost_take(struct ghost_list* g, unsigned long long hash,
+                      unsigned long long remembered){
+    struct ghost_entry* entry = &g->entries[hash & g->mask];
+    if (entry->added == 0 || entry->hash != hash || g->added - entry->added >= remembered) {
+        return 0;
+    }
+    entry->added = 0;
+    return 1;
+}
+
+static unsigned long long ghost_count(struct ghost_list* g, unsigned long long remembered){
+    return g->added < remembered ? g->added : remembered;
+}
+
+// Ghosts remember about as many keys as the policy holds elements
+static unsigned long long ghost_remembered(struct eviction_state* st){
+    return st->count > 0 ? st->count : 1;
+}
+
+// Removal for the policies that only keep elements on their lists
+static void list_remove(struct eviction_state* st, cache_element* e, int evicted){
+    cache_list_unlink(&st->lists[e->queue], e);
+}
+
+// CLOCK: one list in insertion order. The hand is at the tail, an element
+// hit since it last passed goes around once more.
+static void clock_insert(struct eviction_state* st, cache_element* e){
+    e->queue = 0;
+    cache_list_push_front(&st->lists[0], e);
+}
+
+static cache_element* clock_victim(struct eviction_state* st, long long max_size){
+    struct cache_list* l = &st->lists[0];
+    for (unsigned chances = l->count; chances > 0; chances--) {
+        if (take_hits(l->tail) == 0) {
+            return l->tail;
+        }
+        list_move_front(l, l, l->tail);
+    }
+    return l->tail;
+}
+
+// Segmented LRU: new elements are on probation (lists[0]), those hit there
+// move to protected (lists[1]). Protected gets most of the budget, what it
+// has to give up goes back on probation, so one-time hits are evicted
+// before anything that was used twice.
+static void slru_insert(struct eviction_state* st, cache_element* e){
+    e->queue = 0;
+    cache_list_push_front(&st->lists[0], e);
+}
+
+static cache_element* slru_victim(struct eviction_state* st, long long max_size){
+    struct cache_list* probation = &st->lists[0];
+    struct cache_list* protect = &st->lists[1];
+    long long protected_max = max_size * SLRU_PROTECTED_PERCENT / 100;
+    for (unsigned chances = 2 * st->count; chances > 0; chances--) {
+        if (protect->size > protected_max) {
+            cache_element* e = protect->tail;
+            if (take_hits(e) > 0) {
+                list_move_front(protect, protect, e);
+            } else {
+                list_move_front(protect, probation, e);
+                e->queue = 0;
+            }
+            continue;
+        }
+        cache_element* e = probation->tail;
+        if (e == NULL) {
+            break;
+        }
+        if (take_hits(e) == 0) {
+            return e;
+        }
+        list_move_front(probation, protect, e);
+        e->queue = 1;
+    }
+    return probation->tail != NULL ? probation->tail : protect->tail;
+}
+
+// ARC: elements seen once (T1, lists[0]) and seen again (T2, lists[1]),
+// plus ghosts of what each evicted (B1 and B2). A key that comes back from
+// a ghost list shows which side gave it up too early, and moves the target
+// size of T1 in favour of that side.
+static void arc_insert(struct eviction_state* st, cache_element* e){
+    unsigned long long remembered = ghost_remembered(st);
+    long long b1 = ghost_count(&st->ghosts[0], remembered);
+    long long b2 = ghost_count(&st->ghosts[1], remembered);
+    e->queue = 1;
+    if (ghost_take(&st->ghosts[0], e->hash, remembered)) {
+        long long delta = b2 > b1 ? e->size * (b2 / b1) : e->size;
+        st->target = st->target + delta < st->size ? st->target + delta : st->size;
+    } else if (ghost_take(&st->ghosts[1], e->hash, remembered)) {
+        long long delta = b1 > b2 ? e->size * (b1 / b2) : e->size;
+        st->target = st->target > delta ? st->target - delta : 0;
+    } else {
+        e->queue = 0;
+    }
+    cache_list_push_front(&st->lists[e->queue], e);
+}
+
+static void arc_remove(struct eviction_state* st, cache_element* e, int evicted){
+    cache_list_unlink(&st->lists[e->queue], e);
+    if (evicted) {
+        ghost_add(&st->ghosts[e->queue], e->hash);
+    }
+}
+
+static cache_element* arc_victim(struct eviction_state* st, long long max_size){
+    struct cache_list* t1 = &st->lists[0];
+    struct cache_list* t2 = &st->lists[1];
+    if (st->target > max_size) {
+        st->target = max_size;
+    }
+    for (unsigned chances = 2 * st->count; chances > 0; chances--) {
+        struct cache_list* l = t1->tail != NULL &&
+                               (t1->size > st->target || t2->tail == NULL) ? t1 : t2;
+        cache_element* e = l->tail;
+        if (e == NULL) {
+            return NULL;
+        }
+        if (take_hits(e) == 0) {
+            return e;
+        }
+        // Hit again: to the front of T2
+        list_move_front(l, t2, e);
+        e->queue = 1;
+    }
+    return t1->tail != NULL ? t1->tail : t2->tail;
+}
+
+// S3-FIFO: a small FIFO (lists[0]) that new elements go through, a main
+// FIFO (lists[1]) for those hit while in it, and a ghost of what left the
+// small queue unused. Elements in main go around again as long as they have
+// hits left, one per pass.
+static void s3fifo_insert(struct eviction_state* st, cache_element* e){
+    e->queue = ghost_take(&st->ghosts[0], e->hash, ghost_remembered(st)) ? 1 : 0;
+    cache_list_push_front(&st->lists[e->queue], e);
+}
+
+static void s3fifo_remove(struct eviction_state* st, cache_element* e, int evicted){
+    cache_list_unlink(&st->lists[e->queue], e);
+    if (evicted && e->queue == 0) {
+        ghost_add(&st->ghosts[0], e->hash);
+    }
+}
+
+static cache_element* s3fifo_victim(struct eviction_state* st, long long max_size){
+    struct cache_list* small = &st->lists[0];
+    struct cache_list* main_fifo = &st->lists[1];
+    long long small_max = max_size * S3FIFO_SMALL_PERCENT / 100;
+    for (unsigned chances = (S3FIFO_MAX_PASSES + 1) * st->count; chances > 0; chances--) {
+        if (small->tail != NULL && (small->size > small_max || main_fifo->tail == NULL)) {
+            cache_element* e = small->tail;
+            if (take_hits(e) == 0) {
+                return e;
+            }
+            list_move_front(small, main_fifo, e);
+            e->queue = 1;
+            continue;
+        }
+        cache_element* e = main_fifo->tail;
+        if (e == NULL) {
+            return NULL;
+        }
+        int hits = take_hits(e);
+        if (hits == 0) {
+            return e;
+        }
+        hits = hits > S3FIFO_MAX_PASSES ? S3FIFO_MAX_PASSES : hits;
+        __atomic_fetch_add(&e->hits, hits - 1, __ATOMIC_RELAXED);
+        list_move_front(main_fifo, main_fifo, e);
+    }
+    return small->tail != NULL ? small->tail : main_fifo->tail;
+}
+
+// GDSF: evicts the lowest frequency / size, so many small popular
+// responses win over one big one. Every eviction ages the cache: new
+// priorities start from the one evicted last, so elements that were popular
+// long ago cannot stay forever.
+static double gdsf_priority(struct eviction_state* st, cache_element* e){
+    return st->age + (double)e->frequency / e->size;
+}
+
+static void heap_place(struct eviction_state* st, unsigned i, cache_element* e){
+    st->heap[i] = e;
+    e->heap_index = i;
+}
+
+static void heap_sift_up(struct eviction_state* st, unsigned i){
+    cache_element* e = st->heap[i];
+    while (i > 0 && st->heap[(i - 1) / 2]->priority > e->priority) {
+        heap_place(st, i, st->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_place(st, i, e);
+}
+
+static void heap_sift_down(struct eviction_state* st, unsigned i){
+    cache_element* e = st->heap[i];
+    while (2 * i + 1 < st->heap_len) {
+        unsigned child = 2 * i + 1;
+        if (child + 1 < st->heap_len &&
+            st->heap[child + 1]->priority < st->heap[child]->priority) {
+            child++;
+        }
+        if (st->heap[child]->priority >= e->priority) {
+            break;
+        }
+        heap_place(st, i, st->heap[child]);
+        i = child;
+    }
+    heap_place(st, i, e);
+}
+
+static void gdsf_insert(struct eviction_state* st, cache_element* e){
+    if (st->heap_len == st->heap_cap) {
+        unsigned cap = st->heap_cap ? st->heap_cap * 2 : 1024;
+        cache_element** bigger = (cache_element**)realloc(st->heap, cap * sizeof(cache_element*));
+        if (bigger == NULL) {
+            perror("Memory allocation failed");
+            exit(1);
+        }
+        st->heap = bigger;
+        st->heap_cap = cap;
+    }
+    e->frequency = 1 + take_hits(e);
+    e->priority = gdsf_priority(st, e);
+    heap_place(st, st->heap_len++, e);
+    heap_sift_up(st, e->heap_index);
+}
+
+static void gdsf_remove(struct eviction_state* st, cache_element* e, int evicted){
+    unsigned i = e->heap_index;
+    cache_element* last = st->heap[--st->heap_len];
+    if (i < st->heap_len) {
+        heap_place(st, i, last);
+        heap_sift_down(st, i);
+        heap_sift_up(st, last->heap_index);
+    }
+    if (evicted) {
+        st->age = e->priority;
+    }
+}
+
+static cache_element* gdsf_victim(struct eviction_state* st, long long max_size){
+    for (unsigned chances = st->heap_len; chances > 0; chances--) {
+        cache_element* e = st->heap[0];
+        int hits = take_hits(e);
+        if (hits == 0) {
+            return e;
+        }
+        // Its priority only catches up with its hits now
+        e->frequency += hits;
+        e->priority = gdsf_priority(st, e);
+        heap_sift_down(st, 0);
+    }
+    return st->heap_len > 0 ? st->heap[0] : NULL;
+}
+
+const struct eviction_policy eviction_policies[] = {
+    {"clock",  0, clock_insert,  list_remove,   clock_victim},
+    {"slru",   0, slru_insert,   list_remove,   slru_victim},
+    {"arc",    2, arc_insert,    arc_remove,    arc_victim},
+    {"s3fifo", 1, s3fifo_insert, s3fifo_remove, s3fifo_victim},
+    {"gdsf",   0, gdsf_insert,   gdsf_remove,   gdsf_victim},
+    {NULL,     0, NULL,          NULL,          NULL}
+};
+
+const struct eviction_policy* eviction_policy_find(const char* name){
+    for (const struct eviction_policy* p = eviction_policies; p->name != NULL; p++) {
+        if (!strcmp(p->name, name)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+void eviction_init(struct eviction_state* st, const struct eviction_policy* policy,
+                   unsigned ghost_slots){
+    memset(st, 0, sizeof(*st));
+    st->policy = policy;
+    for (int i = 0; i < policy->ghosts; i++) {
+        ghost_init(&st->ghosts[i], ghost_slots);
+    }
+}
+
+void eviction_destroy(struct eviction_state* st){
+    for (int i = 0; i < 2; i++) {
+        free(st->ghosts[i].entries);
+    }
+    free(st->heap);
+    memset(st, 0, sizeof(*st));
+}
+
+void eviction_insert(struct eviction_state* st, cache_element* e){
+    st->policy->insert(st, e);
+    st->count++;
+    st->size += e->size;
+}
+
+void eviction_remove(struct eviction_state* st, cache_element* e, int evicted){
+    st->policy->remove(st, e, evicted);
+    st->count--;
+    st->size -= e->size;
+}
+
+cache_element* eviction_victim(struct eviction_state* st, long long max_size){
+    return st->policy->victim(st, max_size);
+}
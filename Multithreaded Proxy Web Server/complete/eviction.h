@@ -0,0 +1,82 @@
+#ifndef EVICTION_H
+#define EVICTION_H
+
+typedef struct cache_element cache_element;
+
+// Recency list, most recently used first
+struct cache_list {
+    cache_element* head;
+    cache_element* tail;        // least recently used
+    unsigned count;
+    long long size;             // sum of the elements' size
+};
+
+void cache_list_unlink(struct cache_list* l, cache_element* e);
+void cache_list_push_front(struct cache_list* l, cache_element* e);
+
+// Hashes of recently evicted keys, for the policies that remember what they
+// evicted (ARC and S3-FIFO). Direct-mapped: a newer key may push out an
+// older one that lands on the same slot, which only makes the policy
+// forget a little early.
+struct ghost_entry {
+    unsigned long long hash;
+    unsigned long long added;   // value of ghost_list.added when stored
+};
+
+struct ghost_list {
+    struct ghost_entry* entries;
+    unsigned mask;
+    unsigned long long added;   // keys stored so far
+};
+
+// Everything an eviction policy keeps in a shard. What the lists stand for
+// depends on the policy.
+struct eviction_state {
+    const struct eviction_policy* policy;
+    struct cache_list lists[2];
+    unsigned count;             // elements handed to the policy
+    long long size;             // and their bytes
+    struct ghost_list ghosts[2];
+    cache_element** heap;       // GDSF: min-heap on priority
+    unsigned heap_len;
+    unsigned heap_cap;
+    double age;                 // GDSF: priority of the last eviction
+    long long target;           // ARC: bytes the recency list aims for
+};
+
+// An eviction policy decides which element of the main part of a shard is
+// evicted next. Every call is made with the shard lock held.
+//
+// Hits take no lock and cannot tell the policy about themselves. They only
+// count up cache_element.hits, and the policies act on that count whenever
+// they look at the element next: promote it, give it another pass, or
+// raise its priority.
+struct eviction_policy {
+    const char* name;
+    int ghosts;                 // ghost lists it needs
+    // e joins the elements the policy manages
+    void (*insert)(struct eviction_state* st, cache_element* e);
+    // e leaves them, evicted says whether it was the policy's own victim
+    void (*remove)(struct eviction_state* st, cache_element* e, int evicted);
+    // Element to evict next when the policy holds more than max_size
+    // bytes, NULL if it holds none. Does not remove it.
+    cache_element* (*victim)(struct eviction_state* st, long long max_size);
+};
+
+extern const struct eviction_policy eviction_policies[];
+
+// Looks a policy up by name ("clock", "slru", "arc", "s3fifo" or "gdsf"),
+// NULL if there is none
+const struct eviction_policy* eviction_policy_find(const char* name);
+
+// ghost_slots is about the number of elements the shard can hold
+void eviction_init(struct eviction_state* st, const struct eviction_policy* policy,
+                   unsigned ghost_slots);
+void eviction_destroy(struct eviction_state* st);
+
+// Go through st->policy and keep st->count and st->size up to date
+void eviction_insert(struct eviction_state* st, cache_element* e);
+void eviction_remove(struct eviction_state* st, cache_element* e, int evicted);
+cache_element* eviction_victim(struct eviction_state* st, long long max_size);
+
+#endif // EVICTION_H
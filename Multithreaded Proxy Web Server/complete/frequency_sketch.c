@@ -0,0 +1,75 @@
+#include "frequency_sketch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// One multiplier per row, so the rows disagree about which keys collide
+static const unsigned long long row_seeds[SKETCH_ROWS] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+static unsigned char* counter_of(struct frequency_sketch* f, int row,
+                                 unsigned long long hash){
+    unsigned index = (unsigned)((hash * row_seeds[row]) >> 32) & f->mask;
+    return &f->counters[(size_t)row * (f->mask + 1) + index];
+}
+
+void sketch_init(struct frequency_sketch* f, unsigned width){
+    unsigned w = 1;
+    while (w < width) {
+        w *= 2;
+    }
+    f->counters = (unsigned char*)calloc((size_t)SKETCH_ROWS * w, 1);
+    if (f->counters == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    f->mask = w - 1;
+    f->additions = 0;
+    // A key has to keep up with the others over about ten times as many
+    // lookups as there are counters
+    f->sample_size = 10 * w;
+}
+
+void sketch_destroy(struct frequency_sketch* f){
+    free(f->counters);
+    f->counters = NULL;
+}
+
+// Halves every counter. Only the thread that counted the last lookup of a
+// sample gets here.
+static void sketch_age(struct frequency_sketch* f){
+    size_t n = (size_t)SKETCH_ROWS * (f->mask + 1);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = __atomic_load_n(&f->counters[i], __ATOMIC_RELAXED);
+        if (c != 0) {
+            __atomic_store_n(&f->counters[i], c >> 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void sketch_increment(struct frequency_sketch* f, unsigned long long hash){
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned char* c = counter_of(f, row, hash);
+        unsigned char value = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (value < SKETCH_MAX_COUNT) {
+            __atomic_store_n(c, value + 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (__atomic_add_fetch(&f->additions, 1, __ATOMIC_RELAXED) == f->sample_size) {
+        __atomic_store_n(&f->additions, 0, __ATOMIC_RELAXED);
+        sketch_age(f);
+    }
+}
+
+int sketch_estimate(struct frequency_sketch* f, unsigned long long hash){
+    int estimate = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        int value = __atomic_load_n(counter_of(f, row, hash), __ATOMIC_RELAXED);
+        if (value < estimate) {
+            estimate = value;
+        }
+    }
+    return estimate;
+}
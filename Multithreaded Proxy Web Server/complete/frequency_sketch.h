@@ -0,0 +1,28 @@
+#ifndef FREQUENCY_SKETCH_H
+#define FREQUENCY_SKETCH_H
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX_COUNT 15     // counters saturate here
+
+// Count-min sketch estimating how often a key was looked up recently. Every
+// key hash bumps one counter per row, the estimate is the smallest of them.
+// Once sample_size lookups have been counted every counter is halved, so
+// keys that stopped being popular lose their weight.
+//
+// Counters are updated with relaxed atomics and without a lock. A lost
+// increment only makes the estimate a little lower.
+struct frequency_sketch {
+    unsigned char* counters;    // SKETCH_ROWS rows of mask + 1 counters
+    unsigned mask;
+    unsigned additions;         // counted since the last halving
+    unsigned sample_size;
+};
+
+// width is rounded up to a power of two
+void sketch_init(struct frequency_sketch* f, unsigned width);
+void sketch_destroy(struct frequency_sketch* f);
+
+void sketch_increment(struct frequency_sketch* f, unsigned long long hash);
+int sketch_estimate(struct frequency_sketch* f, unsigned long long hash);
+
+#endif // FREQUENCY_SKETCH_H
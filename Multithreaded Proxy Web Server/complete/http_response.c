@@ -0,0 +1,391 @@
+#include "http_response.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int http_response_header_end(const char* data, int len){
+    for (int i = 0; i + 3 < len; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n' &&
+            data[i + 2] == '\r' && data[i + 3] == '\n') {
+            return i + 4;
+        }
+    }
+    return -1;
+}
+
+int http_response_status(const char* data, int len){
+    // "HTTP/1.x 200 OK"
+    if (len < 12 || strncmp(data, "HTTP/", 5) != 0) {
+        return -1;
+    }
+    const char* space = (const char*)memchr(data, ' ', len);
+    if (space == NULL || space + 4 > data + len) {
+        return -1;
+    }
+    return atoi(space + 1);
+}
+
+int http_response_header(const char* data, int header_len, const char* name,
+                         char* value, int value_size){
+    int name_len = strlen(name);
+    // Skip the status line, every header starts after a "\r\n"
+    const char* line = (const char*)memchr(data, '\n', header_len);
+    const char* end = data + header_len;
+
+    while (line != NULL && ++line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        if (eol - line > name_len && line[name_len] == ':' &&
+            !strncasecmp(line, name, name_len)) {
+            const char* v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            const char* v_end = eol;
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ')) {
+                v_end--;
+            }
+            int n = v_end - v;
+            if (n >= value_size) {
+                n = value_size - 1;
+            }
+            memcpy(value, v, n);
+            value[n] = '\0';
+            return n;
+        }
+        line = eol;
+    }
+    return -1;
+}
+
+int http_response_cacheable(const char* data, int header_len){
+    if (http_response_status(data, header_len) != 200) {
+        return 0;
+    }
+    char value[256];
+    if (http_response_header(data, header_len, "Cache-Control", value,
+                             sizeof(value)) >= 0 &&
+        (strcasestr(value, "no-store") || strcasestr(value, "private"))) {
+        return 0;
+    }
+    return 1;
+}
+
+// Number after "name=" in a Cache-Control value, -1 if it is not there
+static long directive(const char* value, const char* name){
+    int name_len = strlen(name);
+    for (const char* p = strcasestr(value, name); p != NULL;
+         p = strcasestr(p + 1, name)) {
+        // Whole directives only, max-age must not match s-maxage
+        if ((p == value || p[-1] == ',' || p[-1] == ' ') && p[name_len] == '=') {
+            return atol(p + name_len + 1);
+        }
+    }
+    return -1;
+}
+
+// HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), -1 if it is not one
+static time_t http_date(const char* value){
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end != NULL ? timegm(&tm) : -1;
+}
+
+long http_response_ttl(const char* data, int header_len, time_t now){
+    char value[256];
+    if (http_response_header(data, header_len, "Cache-Control", value,
+                             sizeof(value)) >= 0) {
+        if (strcasestr(value, "no-cache")) {
+            return 0;
+        }
+        long ttl = directive(value, "s-maxage");
+        if (ttl < 0) {
+            ttl = directive(value, "max-age");
+        }
+        if (ttl >= 0) {
+            // Time it already spent in caches on the way
+            if (http_response_header(data, header_len, "Age", value,
+                                     sizeof(value)) >= 0) {
+                ttl -= atol(value);
+            }
+            return ttl > 0 ? ttl : 0;
+        }
+    }
+    if (http_response_header(data, header_len, "Expires", value,
+                             sizeof(value)) >= 0) {
+        // Against the origin's clock if it sent one, an invalid date means
+        // already expired
+        time_t expires = http_date(value);
+        time_t date = now;
+        if (http_response_header(data, header_len, "Date", value,
+                                 sizeof(value)) >= 0 && http_date(value) >= 0) {
+            date = http_date(value);
+        }
+        return expires > date ? expires - date : 0;
+    }
+    return -1;
+}
+
+int http_response_must_revalidate(const char* data, int header_len){
+    char value[256];
+    return http_response_header(data, header_len, "Cache-Control", value,
+                                sizeof(value)) >= 0 &&
+           (strcasestr(value, "no-cache") || strcasestr(value, "must-revalidate") ||
+            strcasestr(value, "proxy-revalidate"));
+}
+
+void http_framing_init(struct response_framing* f){
+    memset(f, 0, sizeof(*f));
+    f->mode = FRAMING_CLOSE;
+}
+
+static void framing_parse_headers(struct response_framing* f, const char* data){
+    char value[64];
+    f->status = http_response_status(data, f->header_len);
+
+    // HTTP/1.1 connections stay open unless closed explicitly, HTTP/1.0
+    // ones only if the origin asks for it
+    int http11 = !strncmp(data, "HTTP/1.1", 8);
+    f->reusable = http11;
+    if (http_response_header(data, f->header_len, "Connection", value,
+                             sizeof(value)) >= 0) {
+        if (strcasestr(value, "close")) {
+            f->reusable = 0;
+        } else if (strcasestr(value, "keep-alive")) {
+            f->reusable = 1;
+        }
+    }
+
+    if ((f->status >= 100 && f->status < 200) || f->status == 204 ||
+        f->status == 304) {
+        f->mode = FRAMING_NONE;
+        f->message_len = f->header_len;
+    } else if (http_response_header(data, f->header_len, "Transfer-Encoding",
+                                    value, sizeof(value)) >= 0 &&
+               strcasestr(value, "chunked")) {
+        f->mode = FRAMING_CHUNKED;
+        f->chunk_pos = f->header_len;
+    } else if (http_response_header(data, f->header_len, "Content-Length",
+                                    value, sizeof(value)) >= 0) {
+        f->mode = FRAMING_LENGTH;
+        f->message_len = f->header_len + atoll(value);
+    } else {
+        f->mode = FRAMING_CLOSE;
+        f->reusable = 0;
+    }
+}
+
+// Skips over every chunk that is completely in the window. Positions are
+// offsets in the whole response, data starts at `offset`.
+static int framing_scan_chunks(struct response_framing* f, const char* data,
+                               long long offset, int len){
+    long long end = offset + len;
+    while (f->chunk_pos < end && f->chunk_pos >= offset) {
+        const char* line = data + (f->chunk_pos - offset);
+        const char* eol = (const char*)memchr(line, '\n', end - f->chunk_pos);
+        if (eol == NULL) {
+            return 0;
+        }
+        long long size = strtoll(line, NULL, 16);
+        long long after_line = offset + (eol + 1 - data);
+        if (size > 0) {
+            // chunk data followed by "\r\n"
+            f->chunk_pos = after_line + size + 2;
+            continue;
+        }
+        // Last chunk, then optional trailers up to an empty line
+        const char* rest = data + (after_line - offset);
+        if (end - after_line >= 2 && rest[0] == '\r' && rest[1] == '\n') {
+            f->message_len = after_line + 2;
+            return 1;
+        }
+        int trailer_end = http_response_header_end(rest - 2, end - after_line + 2);
+        if (trailer_end < 0) {
+            return 0;
+        }
+        f->message_len = after_line - 2 + trailer_end;
+        return 1;
+    }
+    return 0;
+}
+
+int http_framing_update(struct response_framing* f, const char* data, int len){
+    return http_framing_update_at(f, data, 0, len);
+}
+
+int http_framing_update_at(struct response_framing* f, const char* data,
+                           long long offset, int len){
+    if (f->complete) {
+        return 1;
+    }
+    if (f->header_len == 0) {
+        int header_len = http_response_header_end(data, len);
+        if (header_len < 0) {
+            return 0;
+        }
+        f->header_len = header_len;
+        framing_parse_headers(f, data);
+    }
+    switch (f->mode) {
+        case FRAMING_NONE:
+            f->complete = 1;
+            break;
+        case FRAMING_LENGTH:
+            f->complete = offset + len >= f->message_len;
+            break;
+        case FRAMING_CHUNKED:
+            f->complete = framing_scan_chunks(f, data, offset, len);
+            break;
+        case FRAMING_CLOSE:
+            break;
+    }
+    return f->complete;
+}
+
+int send_all(int socket, const char* buf, int len){
+    int sent = 0;
+    while (sent < len) {
+        int n = send(socket, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// Headers that only describe the connection to the origin
+static int is_hop_by_hop(const char* line, int len){
+    const char* names[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:"};
+    for (int i = 0; i < 3; i++) {
+        int n = strlen(names[i]);
+        if (len >= n && !strncasecmp(line, names[i], n)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sends the parts with as few syscalls as the socket allows, skipping the
+// first skip bytes. Like send_all(), partial sends are picked up where they
+// stopped.
+static int send_parts(int socket, const struct iovec* parts, int nparts, long long skip){
+    struct iovec* iov = (struct iovec*)malloc(nparts * sizeof(struct iovec));
+    if (iov == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    memcpy(iov, parts, nparts * sizeof(struct iovec));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nparts;
+    long long n = skip;
+    while (msg.msg_iovlen > 0) {
+        // Drop what is already out
+        while (msg.msg_iovlen > 0 && (long long)msg.msg_iov->iov_len <= n) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0) {
+            break;
+        }
+        msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+        msg.msg_iov->iov_len -= n;
+        // writev() cannot be kept from raising SIGPIPE, sendmsg() can
+        n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(iov);
+            return -1;
+        }
+    }
+    free(iov);
+    return 0;
+}
+
+int send_framed_response(int socket, const char* data, int len, int keep_alive){
+    struct iovec part;
+    part.iov_base = (void*)data;
+    part.iov_len = len;
+    return send_framed_parts(socket, &part, 1, keep_alive);
+}
+
+int send_framed_parts(int socket, const struct iovec* parts, int nparts, int keep_alive){
+    const char* data = (const char*)parts[0].iov_base;
+    long long len = 0;
+    for (int i = 0; i < nparts; i++) {
+        len += parts[i].iov_len;
+    }
+    int header_len = http_response_header_end(data, parts[0].iov_len);
+    if (header_len < 0) {
+        // Not something we can reframe, the caller has to close afterwards
+        return send_parts(socket, parts, nparts, 0);
+    }
+    if (send_response_header(socket, data, header_len, len - header_len,
+                             keep_alive) < 0) {
+        return -1;
+    }
+    return send_parts(socket, parts, nparts, header_len);
+}
+
+int send_response_header(int socket, const char* data, int header_len,
+                         long long body_len, int keep_alive){
+    int status = http_response_status(data, header_len);
+    char value[64];
+    int has_length = http_response_header(data, header_len, "Content-Length",
+                                          value, sizeof(value)) >= 0;
+    int chunked = http_response_header(data, header_len, "Transfer-Encoding",
+                                       value, sizeof(value)) >= 0 &&
+                  strcasestr(value, "chunked") != NULL;
+    // 1xx, 204 and 304 never carry a body
+    int bodyless = (status >= 100 && status < 200) || status == 204 || status == 304;
+
+    // New header block: same lines minus hop-by-hop ones, plus ours
+    char* header = (char*)malloc(header_len + 128);
+    if (header == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int out = 0;
+    const char* line = data;
+    const char* end = data + header_len - 2;   // stop before the empty line
+    while (line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        const char* next = eol ? eol + 1 : end;
+        if (!is_hop_by_hop(line, next - line)) {
+            memcpy(header + out, line, next - line);
+            out += next - line;
+        }
+        line = next;
+    }
+    if (!has_length && !chunked && !bodyless) {
+        if (body_len >= 0) {
+            out += sprintf(header + out, "Content-Length: %lld\r\n", body_len);
+        } else {
+            // Only closing the connection can tell the client where it ends
+            keep_alive = 0;
+        }
+    }
+    out += sprintf(header + out, "Connection: %s\r\n\r\n",
+                   keep_alive ? "keep-alive" : "close");
+
+    int ret = send_all(socket, header, out);
+    free(header);
+    return ret < 0 ? -1 : keep_alive;
+}
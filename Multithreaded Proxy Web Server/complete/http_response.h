@@ -0,0 +1,90 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <time.h>
+#include <sys/uio.h>
+
+// Helpers to look into the raw responses we get from origins (and keep in
+// the cache) and to pass them on to clients.
+
+// Length of the status line plus headers including the final "\r\n\r\n",
+// or -1 if the header block is not complete within len bytes
+int http_response_header_end(const char* data, int len);
+
+// Status code from the status line, or -1 if it cannot be parsed
+int http_response_status(const char* data, int len);
+
+// Copies the value of header `name` (case-insensitive) found in the first
+// header_len bytes into value. Returns the value length or -1 if missing.
+int http_response_header(const char* data, int header_len, const char* name,
+                         char* value, int value_size);
+
+// Whether a response with this header block may be kept in the cache: a
+// 200 that the origin did not mark no-store or private
+int http_response_cacheable(const char* data, int header_len);
+
+// Seconds the response stays fresh after now, from Cache-Control
+// (s-maxage, then max-age, less Age) or else Expires. 0 if the origin
+// wants it revalidated every time, -1 if it says nothing.
+long http_response_ttl(const char* data, int header_len, time_t now);
+
+// Whether the origin forbids serving the response once it is stale
+// (no-cache, must-revalidate or proxy-revalidate)
+int http_response_must_revalidate(const char* data, int header_len);
+
+// How the end of a response body is found
+#define FRAMING_LENGTH  0   // Content-Length bytes follow the headers
+#define FRAMING_CHUNKED 1   // Transfer-Encoding: chunked
+#define FRAMING_CLOSE   2   // the body ends when the origin closes
+#define FRAMING_NONE    3   // no body at all (1xx, 204, 304)
+
+// Tracks where a response read from an origin ends, so the connection can
+// be reused for the next request instead of being read until it closes.
+struct response_framing {
+    int header_len;         // 0 until the header block is complete
+    int status;
+    int mode;               // FRAMING_*
+    long long message_len;  // total length once known (complete == 1)
+    long long chunk_pos;    // FRAMING_CHUNKED: offset of the next size line,
+                            // everything from there on is still needed
+    int complete;
+    int reusable;           // origin agreed to keep the connection open
+};
+
+void http_framing_init(struct response_framing* f);
+
+// Looks at everything received so far (data, len). Returns 1 once the
+// whole response is in, 0 while more is needed. FRAMING_CLOSE responses
+// are only complete when the origin closes.
+int http_framing_update(struct response_framing* f, const char* data, int len);
+
+// Same for a relay that only keeps a window of the response: data holds
+// len bytes starting at offset `offset` of the response. The header block
+// must be in the first window, and for chunked bodies the window must
+// still start at or before f->chunk_pos.
+int http_framing_update_at(struct response_framing* f, const char* data,
+                           long long offset, int len);
+
+// Sends all len bytes, retrying short sends. Returns -1 on error.
+int send_all(int socket, const char* buf, int len);
+
+// Sends a complete origin response to a client on a persistent connection.
+// Hop-by-hop headers of the origin are replaced with our own Connection
+// header, and a Content-Length is added when the origin delimited the body
+// by closing its connection, so the client knows where the response ends.
+// Returns -1 if the client could not be written to.
+int send_framed_response(int socket, const char* data, int len, int keep_alive);
+
+// Same for a response kept in pieces, sent with one sendmsg() over all of
+// them where the socket takes it. The header block has to be in the first.
+int send_framed_parts(int socket, const struct iovec* parts, int nparts, int keep_alive);
+
+// Sends only the header block (data, header_len) of an origin response,
+// rewritten the same way, ahead of a body that is relayed as it arrives.
+// body_len is announced for close-delimited bodies; -1 means it is not
+// known yet, the client is then told the connection closes after the body.
+// Returns whether the client connection can be kept alive, -1 on error.
+int send_response_header(int socket, const char* data, int header_len,
+                         long long body_len, int keep_alive);
+
+#endif // HTTP_RESPONSE_H
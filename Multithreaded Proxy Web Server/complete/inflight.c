@@ -0,0 +1,202 @@
+#include "inflight.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct inflight_table inflight_table;
+
+static struct inflight_stripe* stripe_of(unsigned long long hash){
+    return &inflight_table.stripes[hash & (INFLIGHT_STRIPES - 1)];
+}
+
+void inflight_init(){
+    for (int i = 0; i < INFLIGHT_STRIPES; i++) {
+        pthread_mutex_init(&inflight_table.stripes[i].lock, NULL);
+        inflight_table.stripes[i].head = NULL;
+    }
+}
+
+struct inflight* inflight_join(const struct cache_key* key, int* leader){
+    struct inflight_stripe* s = stripe_of(key->hash);
+    pthread_mutex_lock(&s->lock);
+    struct inflight* f = s->head;
+    while (f != NULL && (f->key.hash != key->hash || f->key.len != key->len ||
+                         memcmp(f->key.url, key->url, key->len))) {
+        f = f->next;
+    }
+    if (f != NULL) {
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+        __atomic_add_fetch(&inflight_table.coalesced, 1, __ATOMIC_RELAXED);
+        *leader = 0;
+        return f;
+    }
+
+    f = (struct inflight*)calloc(1, sizeof(struct inflight));
+    if (f == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    f->key.hash = key->hash;
+    f->key.len = key->len;
+    memcpy(f->key.url, key->url, key->len + 1);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->changed, NULL);
+    f->state = INFLIGHT_PENDING;
+    f->refs = 1;
+    f->next = s->head;
+    s->head = f;
+    pthread_mutex_unlock(&s->lock);
+    __atomic_add_fetch(&inflight_table.fetches, 1, __ATOMIC_RELAXED);
+    *leader = 1;
+    return f;
+}
+
+// Called with f->lock held
+static void notify_watchers(struct inflight* f){
+    unsigned long long one = 1;
+    for (struct inflight_watcher* w = f->watchers; w != NULL; w = w->next) {
+        if (write(w->fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+int inflight_append(struct inflight* f, const char* data, int len){
+    // Only the fetcher writes, it needs no lock to look at what it wrote
+    long long end = f->len;
+    while (len > 0) {
+        int used = end % INFLIGHT_CHUNK;
+        int chunk = end / INFLIGHT_CHUNK;
+        if (used == 0) {
+            if (chunk == INFLIGHT_MAX_CHUNKS ||
+                (f->chunks[chunk] = (char*)malloc(INFLIGHT_CHUNK)) == NULL) {
+                inflight_end(f, INFLIGHT_FAILED, 0);
+                return -1;
+            }
+        }
+        int n = INFLIGHT_CHUNK - used < len ? INFLIGHT_CHUNK - used : len;
+        memcpy(f->chunks[chunk] + used, data, n);
+        end += n;
+        data += n;
+        len -= n;
+    }
+    pthread_mutex_lock(&f->lock);
+    if (f->state == INFLIGHT_PENDING) {
+        f->state = INFLIGHT_STREAMING;
+    }
+    // Readers copy up to len, which is only raised once the bytes are there
+    f->len = end;
+    pthread_cond_broadcast(&f->changed);
+    notify_watchers(f);
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+}
+
+void inflight_end(struct inflight* f, int state, int status){
+    pthread_mutex_lock(&f->lock);
+    if (f->state > INFLIGHT_STREAMING) {
+        pthread_mutex_unlock(&f->lock);
+        return;
+    }
+    f->state = state;
+    f->status = status;
+    pthread_cond_broadcast(&f->changed);
+    notify_watchers(f);
+    pthread_mutex_unlock(&f->lock);
+
+    struct inflight_stripe* s = stripe_of(f->key.hash);
+    pthread_mutex_lock(&s->lock);
+    struct inflight** p = &s->head;
+    while (*p != f) {
+        p = &(*p)->next;
+    }
+    *p = f->next;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int read_at(struct inflight* f, long long offset, char* buf, int size,
+                   int wait){
+    pthread_mutex_lock(&f->lock);
+    while (wait && offset >= f->len && f->state <= INFLIGHT_STREAMING) {
+        pthread_cond_wait(&f->changed, &f->lock);
+    }
+    long long len = f->len;
+    int state = f->state;
+    pthread_mutex_unlock(&f->lock);
+    if (offset >= len && state <= INFLIGHT_STREAMING) {
+        return INFLIGHT_AGAIN;
+    }
+    if (offset >= len) {
+        return state == INFLIGHT_DONE ? 0 : -1;
+    }
+    if (state == INFLIGHT_FAILED || state == INFLIGHT_UNSHARED) {
+        return -1;
+    }
+
+    int copied = 0;
+    while (copied < size && offset < len) {
+        int used = offset % INFLIGHT_CHUNK;
+        long long n = INFLIGHT_CHUNK - used;
+        if (n > len - offset) {
+            n = len - offset;
+        }
+        if (n > size - copied) {
+            n = size - copied;
+        }
+        memcpy(buf + copied, f->chunks[offset / INFLIGHT_CHUNK] + used, n);
+        copied += n;
+        offset += n;
+    }
+    return copied;
+}
+
+int inflight_read(struct inflight* f, long long offset, char* buf, int size){
+    return read_at(f, offset, buf, size, 1);
+}
+
+int inflight_try_read(struct inflight* f, long long offset, char* buf, int size){
+    return read_at(f, offset, buf, size, 0);
+}
+
+void inflight_watch(struct inflight* f, struct inflight_watcher* w){
+    pthread_mutex_lock(&f->lock);
+    w->next = f->watchers;
+    f->watchers = w;
+    pthread_mutex_unlock(&f->lock);
+}
+
+void inflight_unwatch(struct inflight* f, struct inflight_watcher* w){
+    // No write to its eventfd can be under way once we hold the lock
+    pthread_mutex_lock(&f->lock);
+    struct inflight_watcher** p = &f->watchers;
+    while (*p != NULL && *p != w) {
+        p = &(*p)->next;
+    }
+    if (*p != NULL) {
+        *p = w->next;
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+void inflight_release(struct inflight* f){
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    for (int i = 0; i < INFLIGHT_MAX_CHUNKS && f->chunks[i] != NULL; i++) {
+        free(f->chunks[i]);
+    }
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->changed);
+    free(f);
+}
+
+void inflight_print_stats(){
+    printf("Request coalescing: %lld origin fetches, %lld requests attached "
+           "to one in flight\n",
+           __atomic_load_n(&inflight_table.fetches, __ATOMIC_RELAXED),
+           __atomic_load_n(&inflight_table.coalesced, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,95 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include "cache.h"
+
+#include <pthread.h>
+
+#define INFLIGHT_STRIPES 64             // locks the table is split over
+#define INFLIGHT_CHUNK CACHE_SEGMENT_SIZE
+#define INFLIGHT_MAX_CHUNKS CACHE_MAX_SEGMENTS
+
+// Where the fetch of an in-flight response is
+#define INFLIGHT_PENDING   0    // waiting for the origin's header block
+#define INFLIGHT_STREAMING 1    // bytes are coming in and are shared
+#define INFLIGHT_DONE      2    // the whole response is in
+#define INFLIGHT_FAILED    3    // the fetch broke off, see status
+#define INFLIGHT_UNSHARED  4    // not cacheable, everyone fetches their own
+
+// A reader that cannot block on the condition variable, like a connection
+// of an event loop. Its eventfd is written whenever the fetch changes.
+struct inflight_watcher {
+    int fd;
+    struct inflight_watcher* next;
+};
+
+// A response being fetched from the origin for a key that missed. The
+// first request to miss fetches it and appends what it relays to its own
+// client here too. Requests for the same key that miss meanwhile attach to
+// it instead of opening their own origin connection, and pass the bytes on
+// as they arrive. The data is kept in chunks that never move, so readers
+// copy out of them without the lock.
+struct inflight {
+    struct cache_key key;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // more data or a new state
+    int state;
+    int status;                 // what handle_request() returned, once failed
+    long long len;              // bytes appended so far
+    char* chunks[INFLIGHT_MAX_CHUNKS];
+    int refs;                   // the fetcher and every reader
+    struct inflight_watcher* watchers;  // told about every change
+    struct inflight* next;      // chain of its stripe
+};
+
+struct inflight_stripe {
+    pthread_mutex_t lock;
+    struct inflight* head;
+};
+
+struct inflight_table {
+    struct inflight_stripe stripes[INFLIGHT_STRIPES];
+    long long fetches;          // requests that became the fetcher
+    long long coalesced;        // requests that attached to one
+};
+
+extern struct inflight_table inflight_table;
+
+void inflight_init();
+
+// Attaches to the fetch of key in flight, or starts one and sets *leader
+// if there is none. NULL if memory runs out, the caller then fetches on
+// its own.
+struct inflight* inflight_join(const struct cache_key* key, int* leader);
+
+// The fetcher shares len more bytes of the response. Returns -1 once it
+// gets too big to be shared, the fetch is then ended as failed.
+int inflight_append(struct inflight* f, const char* data, int len);
+
+// The fetcher is done: state is INFLIGHT_DONE, INFLIGHT_FAILED (with the
+// status its client got) or INFLIGHT_UNSHARED. Later requests for the key
+// no longer find it. Only the first call counts, so it can end the fetch
+// where it knows and still make sure it is ended on the way out.
+void inflight_end(struct inflight* f, int state, int status);
+
+// Copies up to size bytes of the response from offset to buf, waiting for
+// them to arrive. Returns the number copied, 0 once the response ended
+// there, -1 if the fetch failed or is not shared (see f->state).
+int inflight_read(struct inflight* f, long long offset, char* buf, int size);
+
+// Like inflight_read(), but returns INFLIGHT_AGAIN instead of waiting if
+// nothing past offset is in yet
+#define INFLIGHT_AGAIN -2
+int inflight_try_read(struct inflight* f, long long offset, char* buf, int size);
+
+// Has the eventfd of w written to for every change from now on, w has to be
+// unwatched before it goes away. The fetch may have changed before, a
+// watcher tries to read once after it started watching.
+void inflight_watch(struct inflight* f, struct inflight_watcher* w);
+void inflight_unwatch(struct inflight* f, struct inflight_watcher* w);
+
+void inflight_release(struct inflight* f);
+
+void inflight_print_stats();
+
+#endif // INFLIGHT_H
@@ -0,0 +1,831 @@
+#include "io_uring_backend.h"
+#include "upgrade.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// What a submission was for. Stored in the low bits of user_data, the rest
+// is the connection pointer (calloc memory is at least 16-byte aligned).
+#define OP_ACCEPT           1
+#define OP_CLIENT_READ      2
+#define OP_UPSTREAM_CONNECT 3
+#define OP_UPSTREAM_SEND    4
+#define OP_UPSTREAM_READ    5
+#define OP_CLIENT_SEND      6
+#define OP_LINK_TIMEOUT     7   // deadline linked to an operation
+#define OP_CANCEL_ACCEPT    8
+#define OP_UPSTREAM_POLL    9   // origin has more of a relayed response
+#define OP_JOB              10  // helper thread finished the job of a connection
+#define OP_WAKE             11  // the handoff woke the loop, see upgrade.h
+#define OP_MASK             0xfULL
+
+struct uring_loop {
+    int id;
+    int listen_fd;
+    int pinned;
+    pthread_t thread;
+    struct uring ring;
+    int accepting;  // the multishot accept is armed, see upgrade.h
+    int upgrade_slot;
+    int wake_fd;    // eventfd the handoff wakes us with
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_init(struct uring* ring){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring: kernel is too old (no IORING_FEAT_SINGLE_MMAP)\n");
+        close(ring->fd);
+        return -1;
+    }
+
+    // Both rings live in one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes_mem = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes_mem == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        munmap(ring->ring_mem, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* base = (char*)ring->ring_mem;
+    ring->sq_head = (unsigned*)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + p.sq_off.array);
+    ring->sqes = (struct io_uring_sqe*)ring->sqes_mem;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+    // Register the relay buffers once, so the kernel does not have to map
+    // the user pages again on every read. Without them a relayed response
+    // goes through the connection buffer like any other.
+    ring->nfree = 0;
+    if (posix_memalign((void**)&ring->buffers, 4096, URING_BUFFERS * MAX_BYTES) == 0) {
+        struct iovec iov[URING_BUFFERS];
+        for (int i = 0; i < URING_BUFFERS; i++) {
+            iov[i].iov_base = ring->buffers + i * MAX_BYTES;
+            iov[i].iov_len = MAX_BYTES;
+        }
+        if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov,
+                                  URING_BUFFERS) == 0) {
+            for (int i = 0; i < URING_BUFFERS; i++) {
+                ring->free_buffers[ring->nfree++] = i;
+            }
+        } else {
+            perror("io_uring buffer registration failed");
+            free(ring->buffers);
+            ring->buffers = NULL;
+        }
+    }
+    return 0;
+}
+
+static void uring_destroy(struct uring* ring){
+    munmap(ring->sqes_mem, ring->sqes_size);
+    munmap(ring->ring_mem, ring->ring_size);
+    close(ring->fd);
+    free(ring->buffers);
+}
+
+// Hands every prepared SQE to the kernel and optionally waits for
+// min_complete completions
+static int uring_submit(struct uring* ring, unsigned min_complete){
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret = sys_io_uring_enter(ring->fd, ring->to_submit, min_complete, flags);
+    if (ret < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter failed");
+        }
+        return -1;
+    }
+    ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+    return ret;
+}
+
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head > *ring->sq_mask) {
+        // Submission queue is full, flush it before queuing more
+        uring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head > *ring->sq_mask) {
+            return NULL;
+        }
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// Makes sure n SQEs can be queued without a flush in between, so an
+// operation and its linked timeout always go to the kernel together
+static int uring_make_room(struct uring* ring, unsigned n){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (*ring->sq_mask + 1 - (ring->sq_local_tail - head) >= n) {
+        return 0;
+    }
+    uring_submit(ring, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return *ring->sq_mask + 1 - (ring->sq_local_tail - head) >= n ? 0 : -1;
+}
+
+static __u64 user_data(struct connection* c, int op){
+    return (__u64)(uintptr_t)c | (__u64)op;
+}
+
+// Operations are bounded by the timeout of the phase they belong to. The
+// request has to be in by the deadline set at its first read, a client
+// that trickles it in does not get more time with every read.
+static int op_timeout(struct connection* c, int op){
+    if (op == OP_CLIENT_READ) {
+        long long now = monotonic_ms();
+        if (c->deadline == 0) {
+            c->deadline = now + conn_timeout(c);
+        }
+        return c->deadline > now ? (int)(c->deadline - now) : 1;
+    }
+    if (op != OP_UPSTREAM_CONNECT && op != OP_UPSTREAM_SEND &&
+        op != OP_UPSTREAM_READ && op != OP_UPSTREAM_POLL &&
+        op != OP_JOB && op != OP_CLIENT_SEND) {
+        return 0;
+    }
+    return conn_timeout(c);
+}
+
+// Links a timeout to the operation in sqe. If it fires first, the operation
+// completes with -ECANCELED. Room for it has to be made beforehand.
+static void link_timeout(struct uring* ring, struct connection* c,
+                         struct io_uring_sqe* op, int timeout_ms){
+    op->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    c->io_timeout.tv_sec = timeout_ms / 1000;
+    c->io_timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (__u64)(uintptr_t)&c->io_timeout;
+    sqe->len = 1;
+    sqe->user_data = user_data(c, OP_LINK_TIMEOUT);
+}
+
+static void arm_accept(struct uring_loop* loop){
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "io_uring: no room to arm accept\n");
+        return;
+    }
+    // One multishot accept keeps producing a completion per new client
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data(NULL, OP_ACCEPT);
+}
+
+// Cancels the multishot accept, it completes one last time once it is gone
+static void cancel_accept(struct uring_loop* loop){
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data(NULL, OP_ACCEPT);
+    sqe->user_data = user_data(NULL, OP_CANCEL_ACCEPT);
+    loop->accepting = 0;
+}
+
+// Watches the wake-up eventfd, once per write to it
+static void arm_wake(struct uring_loop* loop){
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "io_uring: no room to watch the wake-up eventfd\n");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, OP_WAKE);
+}
+
+static char* fixed_buffer(struct uring* ring, struct connection* c){
+    return ring->buffers + c->io_buf * MAX_BYTES;
+}
+
+// Queues a read into c->io_buf if the connection holds a registered buffer,
+// a plain recv into dst otherwise. The request and a response that is
+// collected for the cache are received where they are kept, copying them
+// out of a registered buffer would cost more than it saves.
+static int queue_read(struct uring* ring, struct connection* c, int fd,
+                      char* dst, int len, int op){
+    int timeout = op_timeout(c, op);
+    if (uring_make_room(ring, timeout > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->fd = fd;
+    if (c->io_buf >= 0) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (__u64)(uintptr_t)fixed_buffer(ring, c);
+        sqe->len = MAX_BYTES;
+        sqe->buf_index = (__u16)c->io_buf;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (__u64)(uintptr_t)dst;
+        sqe->len = len;
+    }
+    sqe->user_data = user_data(c, op);
+    if (timeout > 0) {
+        link_timeout(ring, c, sqe, timeout);
+    }
+    return 0;
+}
+
+static int queue_send(struct uring* ring, struct connection* c, int fd,
+                      const char* buf, int len, int op){
+    int timeout = op_timeout(c, op);
+    if (uring_make_room(ring, timeout > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(c, op);
+    if (timeout > 0) {
+        link_timeout(ring, c, sqe, timeout);
+    }
+    return 0;
+}
+
+static void release_buffer(struct uring* ring, struct connection* c){
+    if (c->io_buf >= 0) {
+        ring->free_buffers[ring->nfree++] = c->io_buf;
+        c->io_buf = -1;
+    }
+}
+
+// A connection has at most one operation in flight, so it can be freed as
+// soon as the completion that ends it has been handled
+static void uring_conn_close(struct uring* ring, struct connection* c){
+    release_buffer(ring, c);
+    close(c->client.fd);
+    if (c->upstream.fd >= 0) {
+        close(c->upstream.fd);
+    }
+    conn_free(c);
+}
+
+// RELAY_RESPONSE: waits for the origin to have more before a registered
+// buffer is taken for it, so none sits idle while the origin is slow
+static int queue_upstream_poll(struct uring* ring, struct connection* c){
+    int timeout = op_timeout(c, OP_UPSTREAM_POLL);
+    if (uring_make_room(ring, timeout > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->upstream.fd;
+    sqe->poll32_events = POLLIN | POLLRDHUP;
+    sqe->user_data = user_data(c, OP_UPSTREAM_POLL);
+    if (timeout > 0) {
+        link_timeout(ring, c, sqe, timeout);
+    }
+    return 0;
+}
+
+static int queue_client_read(struct uring* ring, struct connection* c){
+    return queue_read(ring, c, c->client.fd, c->request + c->request_len,
+                      MAX_BYTES - c->request_len, OP_CLIENT_READ);
+}
+
+static int queue_upstream_read(struct uring* ring, struct connection* c){
+    if (response_reserve(c, MAX_BYTES) < 0) {
+        perror("Memory reallocation failed");
+        return -1;
+    }
+    return queue_read(ring, c, c->upstream.fd, c->response + c->response_len,
+                      c->response_cap - c->response_len, OP_UPSTREAM_READ);
+}
+
+// Sends the rest of the response, from the registered buffer it was read
+// into when it is relayed through one. A relayed or filled response
+// alternates between this and the next upstream read, a followed fetch
+// between this and waiting for its eventfd.
+static int queue_client_send(struct uring* ring, struct connection* c){
+    if (c->state != CONN_RELAY_RESPONSE && c->state != CONN_FILL_RESPONSE &&
+        c->state != CONN_SHARED_RESPONSE) {
+        c->state = CONN_WRITE_RESPONSE;
+    }
+    const char* data = c->io_buf >= 0 ? fixed_buffer(ring, c) : c->response;
+    return queue_send(ring, c, c->client.fd, data + c->response_sent,
+                      c->response_len - c->response_sent, OP_CLIENT_SEND);
+}
+
+static int start_upstream(struct uring* ring, struct connection* c){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Error in creating your socket");
+        return -1;
+    }
+    c->upstream.fd = fd;
+    c->state = CONN_UPSTREAM_CONNECT;
+    int timeout = op_timeout(c, OP_UPSTREAM_CONNECT);
+    if (uring_make_room(ring, timeout > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)&c->upstream_addr;
+    sqe->off = sizeof(c->upstream_addr);
+    sqe->user_data = user_data(c, OP_UPSTREAM_CONNECT);
+    if (timeout > 0) {
+        link_timeout(ring, c, sqe, timeout);
+    }
+    return 0;
+}
+
+// DISK_READ, RESOLVE: waits for the helper thread to signal the eventfd of
+// the job. SHARED_RESPONSE: waits for the fetch followed to have more.
+static int queue_job_wait(struct uring* ring, struct connection* c){
+    int timeout = op_timeout(c, OP_JOB);
+    if (uring_make_room(ring, timeout > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->job->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(c, OP_JOB);
+    if (timeout > 0) {
+        link_timeout(ring, c, sqe, timeout);
+    }
+    return 0;
+}
+
+// Moves c on to what conn_lookup() or conn_disk_read() returned
+static void lookup_next(struct uring* ring, struct connection* c, int next){
+    int status;
+    if (next < 0) {
+        status = -1;
+    } else if (next == CONN_WRITE_RESPONSE) {
+        c->state = CONN_WRITE_RESPONSE;
+        status = queue_client_send(ring, c);
+    } else if (next == CONN_DISK_READ || next == CONN_RESOLVE) {
+        c->state = (enum conn_state)next;
+        status = queue_job_wait(ring, c);
+        if (status < 0) {
+            sendErrorMessage(c->client.fd, 500);
+        }
+    } else if (next == CONN_SHARED_RESPONSE) {
+        // Pass on the part conn_follow() found or wait for one
+        c->state = CONN_SHARED_RESPONSE;
+        status = c->response_len > 0 ? queue_client_send(ring, c) :
+                                       queue_job_wait(ring, c);
+    } else {
+        status = start_upstream(ring, c);
+        if (status < 0) {
+            sendErrorMessage(c->client.fd, 500);
+        }
+    }
+    if (status < 0) {
+        uring_conn_close(ring, c);
+    }
+}
+
+static void on_client_read(struct uring* ring, struct connection* c, int res){
+    if (res <= 0) {
+        if (res == 0) {
+            printf("Client is disconnected\n");
+        } else if (res == -ECANCELED) {
+            printf("Client is idle, closing the connection\n");
+        } else {
+            fprintf(stderr, "Error receiving request: %s\n", strerror(-res));
+        }
+        uring_conn_close(ring, c);
+        return;
+    }
+    c->request_len += res;
+    c->request[c->request_len] = '\0';
+
+    // Any HTTP request ends with "\r\n\r\n"
+    if (strstr(c->request, "\r\n\r\n") == NULL) {
+        if (c->request_len >= MAX_BYTES) {
+            sendErrorMessage(c->client.fd, 400);
+            uring_conn_close(ring, c);
+        } else if (queue_client_read(ring, c) < 0) {
+            uring_conn_close(ring, c);
+        }
+        return;
+    }
+
+    c->state = CONN_CACHE_LOOKUP;
+    lookup_next(ring, c, conn_lookup(c));
+}
+
+// Answers a connection whose origin operation failed with the stale copy
+// that stands in for the error, or ends it with the error. -ECANCELED means
+// its linked timeout fired, the origin is too slow.
+static void upstream_failed(struct uring* ring, struct connection* c,
+                            const char* what, int res){
+    if (res == -ECANCELED) {
+        fprintf(stderr, "Timed out waiting for remote server\n");
+    } else {
+        fprintf(stderr, "%s: %s\n", what, strerror(-res));
+    }
+    if (c->state == CONN_RELAY_RESPONSE || c->state == CONN_FILL_RESPONSE) {
+        // Part of the response is out already, it can only be cut short
+        uring_conn_close(ring, c);
+        return;
+    }
+    conn_unshare(c, INFLIGHT_FAILED, res == -ECANCELED ? UPSTREAM_TIMEOUT : -1);
+    if (conn_serve_stale(c) == 0) {
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+        if (queue_client_send(ring, c) < 0) {
+            uring_conn_close(ring, c);
+        }
+        return;
+    }
+    sendErrorMessage(c->client.fd, res == -ECANCELED ? 504 : 500);
+    uring_conn_close(ring, c);
+}
+
+static void on_completion(struct uring_loop* loop, struct io_uring_cqe* cqe){
+    struct uring* ring = &loop->ring;
+    int op = (int)(cqe->user_data & OP_MASK);
+    struct connection* c = (struct connection*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    int res = cqe->res;
+
+    switch (op) {
+        case OP_ACCEPT:
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                if (loop->accepting) {
+                    // The kernel dropped the multishot request, arm a new one
+                    arm_accept(loop);
+                } else {
+                    upgrade_stopped(loop->upgrade_slot);
+                }
+            }
+            if (res == -ECANCELED && !loop->accepting) {
+                return;
+            }
+            if (res < 0) {
+                fprintf(stderr, "accept failed: %s\n", strerror(-res));
+                return;
+            }
+            c = conn_create(res);
+            if (c == NULL) {
+                close(res);
+                return;
+            }
+            if (queue_client_read(ring, c) < 0) {
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_CLIENT_READ:
+            on_client_read(ring, c, res);
+            return;
+
+        case OP_JOB:
+            if (res < 0 && c->state == CONN_SHARED_RESPONSE) {
+                fprintf(stderr, "Error waiting for a shared response: %s\n", strerror(-res));
+                uring_conn_close(ring, c);
+                return;
+            }
+            if (c->state == CONN_SHARED_RESPONSE) {
+                lookup_next(ring, c, conn_follow(c));
+                return;
+            }
+            if (res < 0 && c->state == CONN_RESOLVE) {
+                upstream_failed(ring, c, "Error resolving the remote server", res);
+                return;
+            }
+            if (res < 0) {
+                fprintf(stderr, "Error reading from the disk cache: %s\n", strerror(-res));
+                sendErrorMessage(c->client.fd, 500);
+                uring_conn_close(ring, c);
+            } else if (c->state == CONN_DISK_READ) {
+                lookup_next(ring, c, conn_disk_read(c));
+            } else if (conn_resolved(c) < 0) {
+                uring_conn_close(ring, c);
+            } else if (start_upstream(ring, c) < 0) {
+                sendErrorMessage(c->client.fd, 500);
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_UPSTREAM_CONNECT:
+            if (res < 0) {
+                upstream_failed(ring, c, "Error in connecting", res);
+                return;
+            }
+            c->state = CONN_UPSTREAM_SEND;
+            if (queue_send(ring, c, c->upstream.fd, c->upstream_req,
+                           c->upstream_req_len, OP_UPSTREAM_SEND) < 0) {
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_UPSTREAM_SEND:
+            if (res < 0) {
+                upstream_failed(ring, c, "Error sending request to remote server", res);
+                return;
+            }
+            c->upstream_req_sent += res;
+            if (c->upstream_req_sent < c->upstream_req_len) {
+                res = queue_send(ring, c, c->upstream.fd,
+                                 c->upstream_req + c->upstream_req_sent,
+                                 c->upstream_req_len - c->upstream_req_sent,
+                                 OP_UPSTREAM_SEND);
+            } else {
+                c->state = CONN_UPSTREAM_RECV;
+                res = queue_upstream_read(ring, c);
+            }
+            if (res < 0) {
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_UPSTREAM_READ:
+            if (res < 0) {
+                upstream_failed(ring, c, "Error receiving data from remote server", res);
+                return;
+            }
+            if (res == 0 && c->state == CONN_RELAY_RESPONSE) {
+                // Everything before went out already
+                shutdown(c->client.fd, SHUT_RDWR);
+                uring_conn_close(ring, c);
+                return;
+            }
+            if (res == 0) {
+                // Origin closed: the response is complete
+                close(c->upstream.fd);
+                c->upstream.fd = -1;
+                conn_upstream_done(c);
+                c->state = CONN_WRITE_RESPONSE;
+                res = queue_client_send(ring, c);
+            } else {
+                c->response_len += res;
+                int next = c->state == CONN_UPSTREAM_RECV && c->framing.header_len == 0 ?
+                           conn_upstream_header(c) : 0;
+                if (next != 0) {
+                    c->state = (enum conn_state)next;
+                }
+                if (c->state == CONN_FILL_RESPONSE) {
+                    conn_upstream_share(c);
+                }
+                if (c->state == CONN_RELAY_RESPONSE) {
+                    res = queue_client_send(ring, c);
+                } else if (c->state == CONN_WRITE_RESPONSE) {
+                    // The stale copy stands in for what the origin answered
+                    close(c->upstream.fd);
+                    c->upstream.fd = -1;
+                    res = queue_client_send(ring, c);
+                } else if (conn_upstream_overflow(c)) {
+                    c->state = (enum conn_state)conn_upstream_too_big(c);
+                    if (c->state == CONN_WRITE_RESPONSE) {
+                        close(c->upstream.fd);
+                        c->upstream.fd = -1;
+                    }
+                    res = queue_client_send(ring, c);
+                } else if (c->state == CONN_FILL_RESPONSE) {
+                    // Passed on before the next read, the copy stays
+                    res = queue_client_send(ring, c);
+                } else {
+                    res = queue_upstream_read(ring, c);
+                }
+            }
+            if (res < 0) {
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_UPSTREAM_POLL:
+            if (res < 0) {
+                upstream_failed(ring, c, "Error receiving data from remote server", res);
+                return;
+            }
+            if (ring->nfree > 0) {
+                c->io_buf = ring->free_buffers[--ring->nfree];
+            }
+            if (queue_upstream_read(ring, c) < 0) {
+                uring_conn_close(ring, c);
+            }
+            return;
+
+        case OP_CLIENT_SEND:
+            if (res < 0) {
+                fprintf(stderr, "Error sending data to client: %s\n", strerror(-res));
+                uring_conn_close(ring, c);
+                return;
+            }
+            c->response_sent += res;
+            if (c->response_sent < c->response_len) {
+                if (queue_client_send(ring, c) < 0) {
+                    uring_conn_close(ring, c);
+                }
+                return;
+            }
+            if (c->state == CONN_RELAY_RESPONSE) {
+                // The client took it all, on to the next part
+                release_buffer(ring, c);
+                response_relayed(c);
+                if (queue_upstream_poll(ring, c) < 0) {
+                    uring_conn_close(ring, c);
+                }
+                return;
+            }
+            if (c->state == CONN_FILL_RESPONSE) {
+                if (queue_upstream_read(ring, c) < 0) {
+                    uring_conn_close(ring, c);
+                }
+                return;
+            }
+            if (c->state == CONN_SHARED_RESPONSE) {
+                lookup_next(ring, c, conn_follow(c));
+                return;
+            }
+            shutdown(c->client.fd, SHUT_RDWR);
+            uring_conn_close(ring, c);
+            return;
+
+        case OP_CANCEL_ACCEPT:
+            // The accept itself reports that it is gone
+            return;
+
+        case OP_WAKE: {
+            // Read before the loop checks the flag, a wake-up that comes
+            // after the check stays pending for the next wait
+            unsigned long long count;
+            if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("eventfd read failed");
+            }
+            arm_wake(loop);
+            return;
+        }
+
+        case OP_LINK_TIMEOUT:
+            // Completes after (or along with) the operation it guarded,
+            // which already decided what happens to the connection. It may
+            // be freed by now, so c must not be touched.
+            return;
+    }
+}
+
+static void* uring_loop_fn(void* arg){
+    struct uring_loop* loop = (struct uring_loop*)arg;
+    struct uring* ring = &loop->ring;
+
+    if (loop->pinned) {
+        pin_to_core(loop->id);
+    }
+    loop->accepting = 1;
+    loop->upgrade_slot = upgrade_register(loop->wake_fd);
+    arm_accept(loop);
+    arm_wake(loop);
+
+    while (1) {
+        if (loop->accepting && !upgrade_accepting()) {
+            // A successor accepts from now on, we finish our connections
+            cancel_accept(loop);
+        } else if (!loop->accepting && upgrade_accepting()) {
+            // The handoff failed. It only did once our accept was gone.
+            loop->accepting = 1;
+            arm_accept(loop);
+        }
+        // Submit everything queued while handling the last batch and wait
+        // for at least one completion, all in a single system call
+        if (uring_submit(ring, 1) < 0 && errno != EINTR) {
+            break;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            on_completion(loop, cqe);
+            head++;
+            // Free the slot right away, handlers may submit and wait again
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+int run_uring_loops(int* listen_fds, int nlisteners, int nthreads){
+    int owned = nlisteners > 1;
+    if (owned) {
+        nthreads = nlisteners;
+    } else if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+
+    loop_helpers_start();
+
+    struct uring_loop* loops = (struct uring_loop*)calloc(nthreads, sizeof(struct uring_loop));
+    if (loops == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        loops[i].id = i;
+        loops[i].listen_fd = owned ? listen_fds[i] : listen_fds[0];
+        loops[i].pinned = owned;
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loops[i].wake_fd < 0) {
+            perror("eventfd failed");
+            break;
+        }
+        if (uring_init(&loops[i].ring) < 0) {
+            close(loops[i].wake_fd);
+            break;
+        }
+        if (loops[i].ring.nfree == 0) {
+            printf("io_uring loop %d runs without registered buffers\n", i);
+        }
+        if (pthread_create(&loops[i].thread, NULL, uring_loop_fn, &loops[i]) != 0) {
+            perror("pthread_create failed");
+            uring_destroy(&loops[i].ring);
+            close(loops[i].wake_fd);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        free(loops);
+        return -1;
+    }
+    if (owned && started < nthreads) {
+        fprintf(stderr, "Only %d of %d io_uring loops started\n", started, nthreads);
+    }
+    printf("Started %d io_uring loops\n", started);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        uring_destroy(&loops[i].ring);
+        close(loops[i].wake_fd);
+    }
+    free(loops);
+    return 0;
+}
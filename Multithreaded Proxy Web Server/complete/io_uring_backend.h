@@ -0,0 +1,48 @@
+#ifndef IO_URING_BACKEND_H
+#define IO_URING_BACKEND_H
+
+#include "event_loop.h"
+
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024      // submission queue size of every ring
+#define URING_BUFFERS 256       // registered MAX_BYTES buffers per ring
+
+// Minimal io_uring wrapper on top of the raw system calls (no liburing).
+// Every ring is used by a single thread.
+struct uring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_local_tail;     // SQEs prepared but not yet published
+    unsigned to_submit;
+
+    // Completion queue, shared with the kernel
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring_mem;
+    size_t ring_size;
+    void* sqes_mem;
+    size_t sqes_size;
+
+    // Buffers registered with IORING_REGISTER_BUFFERS. A relayed response
+    // is read into one and sent on from it.
+    char* buffers;
+    int free_buffers[URING_BUFFERS];
+    int nfree;
+};
+
+// Same contract as run_event_loops(), but every loop drives its sockets
+// through an io_uring: multishot accept, and batched recv and send
+// submissions with one io_uring_enter() per round of completions.
+int run_uring_loops(int* listen_fds, int nlisteners, int nthreads);
+
+#endif // IO_URING_BACKEND_H
@@ -83,7 +83,7 @@ size_t ParsedRequest_unparse_headers(struct ParsedRequest* pr, char* buf,
 size_t ParsedRequest_totalLen(struct ParsedRequest* pr);
 
 // 
-size_t ParsedHeader_headersLen(struct ParsedHeader* pr);
+size_t ParsedHeader_headersLen(struct ParsedRequest* pr);
 
 // SET, GET and REMOVE NULL-terminated header keys and values
 int ParsedHeader_set(struct ParsedRequest* pr, const char* key, 
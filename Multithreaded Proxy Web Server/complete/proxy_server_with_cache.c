@@ -1,4 +1,14 @@
-#include "proxy_parse.h"
+#include "proxy_server_with_cache.h"
+#include "disk_cache.h"
+#include "dns_cache.h"
+#include "event_loop.h"
+#include "http_response.h"
+#include "inflight.h"
+#include "io_uring_backend.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include "upgrade.h"
+#include "upstream_pool.h"
 
 #include <asm-generic/socket.h>
 #include <stdio.h>
@@ -11,52 +21,55 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
 #include <error.h>
+#include <getopt.h>
 #include <pthread.h>
-#include <semaphore.h>
 
-#define MAX_CLIENTS 10
-#define MAX_BYTES 4096    // bytes allocation space - 4KB
-#define MAX_ELEMENT_SIZE 10 * (1<<10)
-#define MAX_SIZE 200 * (1<<20) // size of cache
-
-typedef struct cache_element cache_element ;
-
-// Implementing the cache element for LRU cache (time-based)
-struct cache_element {
-    char* data;
-    int len;
-    char* url;
-    time_t lru_time_track;
-    cache_element* next; 
-    // We need a linked-list to access corresponding cache elements
+// Defaults, named in the order of the fields
+struct proxy_config config = {
+    .port = 8080,
+    .mode = MODE_THREAD,
+    .event_threads = 0,
+    .workers = MAX_CLIENTS,
+    .queue_depth = 128,
+    .acceptors = 1,
+    .backlog = SOMAXCONN,
+    .keepalive_timeout = 5,
+    .max_requests = 100,
+    .upstream_max_idle = 256,
+    .upstream_max_per_host = 8,
+    .upstream_idle_timeout = 30,
+    .dns_ttl = 60,
+    .dns_negative_ttl = 5,
+    .connect_timeout = 5000,
+    .first_byte_timeout = 30000,
+    .read_timeout = 30000,
+    .splice_relay = 1,
+    .cache_shards = 16,
+    .cache_policy = &eviction_policies[0],
+    .cache_admission = 1,
+    .cache_ttl = 0,
+    .revalidate_window = 3600,
+    .stale_while_revalidate = 0,
+    .stale_if_error = 0,
+    .disk_cache = NULL,
+    .disk_cache_size = 10240LL << 20,
+    .disk_promote = 1,
+    .snapshot = NULL,
+    .snapshot_interval = 0,
+    .upgrade_socket = NULL,
+    .takeover = 0,
 };
-
-cache_element* find(char* url);
-int add_cache_element(char* data, int size, char* url);
-void remove_cache_element();
-
-int port_number = 8080;
 int proxy_socketId;
 
-// Creating new thread for each socket connection with client
-// 1. Defining max-limit = 10 (array containig thread-ids)
-pthread_t tid[MAX_CLIENTS];
-
-// 2. LRU cache is a shared resource. When multiple threads access it there 
-// can be a race condition. Hence, we setup a lock.
-pthread_mutex_t lock;
-
-// 3. As we have setup a limit of 10 client connections, we might run out of 
-// client connections. In which case, we need to hold the further incoming 
-// requests till a connection becomes free.
-sem_t semaphore;
-
-// Global HEAD for the linkedlist which contains the LRU cache
-cache_element* head;
-int cache_size;
+long long relayed_bytes;
+long long zero_copy_bytes;
+long long active_clients;
 
 int sendErrorMessage(int socket, int status_code){
     char str[1024];
@@ -162,6 +175,25 @@ int sendErrorMessage(int socket, int status_code){
             printf("501 Not Implemented\n");
             send(socket, str, strlen(str), 0);
             break;
+        case 504:
+            sprintf(str,
+            "HTTP/1.1 504 Gateway Timeout\r\n\
+             Content-Length: 103\r\n\
+             Connection: keep-alive\r\n\
+             Content-Type: text/html\r\n\
+             Date: %s\r\n\
+             Server: \r\n\r\n\
+             <html>\
+                 <head>\
+                     <title>504 Gateway Timeout</title>\
+                 </head>\n\
+                 <body>\
+                     <h1>504 Gateway Timeout</h1>\n\
+                 </body>\
+             </html>", currentTime);
+            printf("504 Gateway Timeout\n");
+            send(socket, str, strlen(str), 0);
+            break;
         case 505: 
             sprintf(str,
             "HTTP/1.1 505 HTTP Version Not Supported\r\n\
@@ -188,6 +220,36 @@ int sendErrorMessage(int socket, int status_code){
 
 
 
+int resolveRemoteServer(char* host_addr, int port_num,
+                        struct sockaddr_in* server_addr){
+    bzero((char *)server_addr, sizeof(*server_addr));
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(port_num);
+
+    // Goes through the shared DNS cache, safe to call from any thread
+    if(dns_cache_resolve(host_addr, &server_addr->sin_addr) < 0){
+        return -1;
+    }
+    return 0;
+}
+
+// Waits until fd is ready for events. timeout_ms <= 0 waits forever.
+// Returns 1 when ready, 0 on timeout and -1 on errors.
+static int wait_for_socket(int fd, short events, int timeout_ms){
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1) {
+        int ready = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1);
+        if (ready >= 0) {
+            return ready;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
 int connectRemoteServer(char* host_addr, int port_num){
     // Creating remote server socket
 
@@ -196,46 +258,61 @@ int connectRemoteServer(char* host_addr, int port_num){
         printf("Error in creating your socket\n");
         return -1;
     }
-    struct hostent* host = gethostbyname(host_addr);
-    if(host == NULL){
-        fprintf(stderr, "No such host exists\n");
+    struct sockaddr_in server_addr;
+    if(resolveRemoteServer(host_addr, port_num, &server_addr) < 0){
+        close(remoteSocket);
         return -1;
     }
-    struct sockaddr_in server_addr;
-    bzero((char *)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-
-    bcopy((char *)&host->h_addr, (char *)&server_addr.sin_addr.s_addr, 
-          host->h_length);
-    // if(connect(remoteSocket, (struct sockaddr *)&server_addr, 
-    //     (size_t)sizeof(server_addr) < 0)){
-    //     fprintf(stderr, "Error in connecting\n");
-    //     return -1;
-    // }
+
+    // Connect without blocking so an origin that never answers only costs
+    // us the connect timeout
+    int flags = fcntl(remoteSocket, F_GETFL, 0);
+    fcntl(remoteSocket, F_SETFL, flags | O_NONBLOCK);
     if (connect(remoteSocket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        fprintf(stderr, "Error in connecting\n");
-        return -1;
+        if (errno != EINPROGRESS) {
+            perror("Error in connecting");
+            close(remoteSocket);
+            return -1;
+        }
+        int ready = wait_for_socket(remoteSocket, POLLOUT, config.connect_timeout);
+        if (ready <= 0) {
+            fprintf(stderr, "Timed out connecting to %s:%d\n", host_addr, port_num);
+            close(remoteSocket);
+            return ready == 0 ? UPSTREAM_TIMEOUT : -1;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(remoteSocket, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            fprintf(stderr, "Error in connecting: %s\n", strerror(err));
+            close(remoteSocket);
+            return err == ETIMEDOUT ? UPSTREAM_TIMEOUT : -1;
+        }
     }
+    // Reads are bounded with poll() from here on
+    fcntl(remoteSocket, F_SETFL, flags);
 
 
     // If connected successfully, return the socket (which is an integer)
     return remoteSocket;
 }
 
-int handle_request(int clientSocketId, struct ParsedRequest* request, char* tempReq) {
-    char* buf = (char*)malloc(MAX_BYTES);
-    if (buf == NULL) {
-        perror("Memory allocation failed");
+int build_upstream_request(struct ParsedRequest* request, char* buf, int size,
+                           int keep_alive) {
+    // Create the request to the remote server
+    int len = snprintf(buf, size,
+             "GET %s %s\r\n", request->path, request->version);
+    if (len < 0 || len >= size) {
         return -1;
     }
 
-    // Create the request to the remote server
-    snprintf(buf, MAX_BYTES,
-             "GET %s %s\r\n", request->path, request->version);
+    // Hop-by-hop headers of the client connection are not forwarded
+    ParsedHeader_remove(request, "Proxy-Connection");
+    ParsedHeader_remove(request, "Keep-Alive");
 
     // Add required headers
-    if (ParsedHeader_set(request, "Connection", "close") < 0) {
+    if (ParsedHeader_set(request, "Connection",
+                         keep_alive ? "keep-alive" : "close") < 0) {
         printf("Set header key is not working\n");
     }
     if (ParsedHeader_get(request, "Host") == NULL) {
@@ -243,85 +320,669 @@ int handle_request(int clientSocketId, struct ParsedRequest* request, char* temp
             printf("Set Host header key is not working\n");
         }
     }
-    if (ParsedRequest_unparse_headers(request, buf + strlen(buf), MAX_BYTES - strlen(buf)) < 0) {
+    // unparse_headers does not NUL terminate, so keep room for it
+    int headers_len = (int)ParsedHeader_headersLen(request);
+    if (len + headers_len >= size) {
+        return -1;
+    }
+    if (ParsedRequest_unparse_headers(request, buf + len, size - len) != 0) {
         printf("Unparse failed\n");
+        return -1;
     }
+    len += headers_len;
+    buf[len] = '\0';
+    return len;
+}
 
-    int server_port = request->port ? atoi(request->port) : 80;
-    int remoteSocketId = connectRemoteServer(request->host, server_port);
-    if (remoteSocketId < 0) {
-        perror("Error connecting to remote server");
-        free(buf);
+// Moves len body bytes, or everything until the origin closes if len < 0,
+// from the origin socket to the client socket through a pipe with splice().
+// The data never gets copied into user space. *sent counts what was moved.
+// Returns 0 once done, UPSTREAM_TIMEOUT or -1 on errors.
+static int splice_body(int from, int to, long long len, long long* sent){
+    // Every worker thread keeps its own pipe for the lifetime of the thread
+    static __thread int pipe_fds[2] = {-1, -1};
+    if (pipe_fds[0] < 0 && pipe(pipe_fds) < 0) {
+        perror("Failed to create a pipe");
         return -1;
     }
 
+    int ret = 0;
+    while (len != 0) {
+        int ready = wait_for_socket(from, POLLIN, config.read_timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                fprintf(stderr, "Timed out waiting for remote server\n");
+            }
+            ret = ready == 0 ? UPSTREAM_TIMEOUT : -1;
+            break;
+        }
+        size_t want = len < 0 || len > SPLICE_CHUNK ? SPLICE_CHUNK : (size_t)len;
+        ssize_t in = splice(from, NULL, pipe_fds[1], NULL, want,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("Error receiving data from remote server");
+            ret = -1;
+            break;
+        }
+        if (in == 0) {
+            if (len > 0) {
+                printf("Remote server closed in the middle of the response\n");
+                ret = -1;
+            }
+            break;
+        }
+
+        // Drain the pipe into the client before filling it again
+        ssize_t out = 0;
+        while (out < in) {
+            ssize_t n = splice(pipe_fds[0], NULL, to, NULL, in - out, SPLICE_F_MOVE);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("Error sending data to client");
+                break;
+            }
+            out += n;
+        }
+        *sent += out;
+        __atomic_fetch_add(&zero_copy_bytes, out, __ATOMIC_RELAXED);
+        if (out < in) {
+            // Whatever is left in the pipe belongs to this response, start
+            // over with a fresh pipe next time
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            pipe_fds[0] = pipe_fds[1] = -1;
+            ret = -1;
+            break;
+        }
+        if (len > 0) {
+            len -= in;
+        }
+    }
+    return ret;
+}
+
+// Sends the request on remoteSocketId and relays the response to the client
+// while it arrives, instead of reading all of it first. Only a window of
+// RELAY_BUFFER bytes is kept. As long as the response is cacheable under
+// key (NULL if the request has none) and fits in MAX_ELEMENT_SIZE, what
+// goes out is also appended to a cache fill, and shared with the requests
+// waiting on `shared` for the same response. *got_nothing tells
+// whether the origin closed before sending a single byte, which on a reused
+// connection means it timed it out on its side. *reusable says whether the
+// connection can serve another request. Bodies that are not cached go
+// through splice_body() when they are delimited by Content-Length or by the
+// origin closing. If the request revalidates `stale` and the origin
+// answers 304, the client gets `stale` instead, made fresh again. Returns
+// what handle_request does.
+static int relay_from_origin(int remoteSocketId, int clientSocketId,
+                             char* req, int req_len, const struct cache_key* key,
+                             int keep_alive, struct inflight* shared,
+                             cache_element* stale, int* got_nothing, int* reusable){
+    *got_nothing = 1;
+    *reusable = 0;
+
     // Send the request to the remote server
-    printf("Sending request: %s\n", buf);
-    if (send(remoteSocketId, buf, strlen(buf), 0) < 0) {
+    printf("Sending request: %s\n", req);
+    if (send_all(remoteSocketId, req, req_len) < 0) {
         perror("Error sending request to remote server");
-        close(remoteSocketId);
-        free(buf);
         return -1;
     }
 
-    // Buffer to receive data from the remote server
-    char* temp_buffer = (char*)malloc(MAX_BYTES);
-    if (temp_buffer == NULL) {
+    char* window = (char*)malloc(RELAY_BUFFER);
+    if (window == NULL) {
         perror("Memory allocation failed");
-        close(remoteSocketId);
-        free(buf);
         return -1;
     }
+    long long offset = 0;       // response offset of window[0]
+    int buffered = 0;           // bytes in the window
+    long long sent = 0;         // response bytes passed on to the client
+    struct cache_fill fill;     // cache copy of the response, if caching
+    int filling = 0;
+    int client_keep_alive = -1; // known once the header went out
+    int closed = 0;
+    int result;
+    struct response_framing framing;
+    http_framing_init(&framing);
+
+    while (1) {
+        if (buffered == RELAY_BUFFER) {
+            // A header block or chunk size line longer than the window
+            printf("Response does not fit in %d bytes\n", RELAY_BUFFER);
+            result = client_keep_alive < 0 ? -1 : 0;
+            break;
+        }
 
-    int temp_buffer_size = MAX_BYTES;
-    int temp_buffer_index = 0;
-    int bytes_received;
+        // The first byte may take the origin longer than any later one
+        int timeout = *got_nothing ? config.first_byte_timeout : config.read_timeout;
+        int ready = wait_for_socket(remoteSocketId, POLLIN, timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                fprintf(stderr, "Timed out waiting for remote server\n");
+            }
+            // Once the header is out the client can only be cut off
+            if (client_keep_alive >= 0) {
+                result = 0;
+            } else {
+                result = ready == 0 ? UPSTREAM_TIMEOUT : -1;
+            }
+            break;
+        }
+        int n = recv(remoteSocketId, window + buffered, RELAY_BUFFER - buffered, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error receiving data from remote server");
+            result = client_keep_alive < 0 ? -1 : 0;
+            break;
+        }
+        if (n == 0) {
+            closed = 1;
+        } else {
+            *got_nothing = 0;
+            buffered += n;
+        }
 
-    while ((bytes_received = recv(remoteSocketId, buf, MAX_BYTES - 1, 0)) > 0) {
-        // Check if temp_buffer needs resizing
-        if (temp_buffer_index + bytes_received > temp_buffer_size) {
-            temp_buffer_size *= 2; // Double the size
-            char* new_buffer = (char*)realloc(temp_buffer, temp_buffer_size);
-            if (new_buffer == NULL) {
-                perror("Memory reallocation failed");
-                close(remoteSocketId);
-                free(buf);
-                free(temp_buffer);
-                return -1;
+        long long end = offset + buffered;
+        int complete = http_framing_update_at(&framing, window, offset, buffered);
+        if (framing.header_len == 0) {
+            if (closed) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        if (closed && framing.mode == FRAMING_CLOSE) {
+            framing.complete = complete = 1;
+            framing.message_len = end;
+        }
+
+        if (client_keep_alive < 0 && stale != NULL && framing.status == 304) {
+            // Unchanged, the origin sent no body and we have it. Whoever
+            // waits for this fetch finds it in the cache.
+            cache_refresh(stale, window, framing.header_len);
+            if (shared != NULL) {
+                inflight_end(shared, INFLIGHT_UNSHARED, 0);
+            }
+            printf("Revalidated the cached response\n");
+            result = 0;
+            if (clientSocketId >= 0) {
+                result = send_framed_parts(clientSocketId, stale->parts, stale->nparts,
+                                           keep_alive) < 0 ? 0 : keep_alive;
+            }
+            *reusable = framing.reusable && complete && !closed &&
+                        end == framing.message_len;
+            break;
+        }
+        if (client_keep_alive < 0 && framing.status >= 500 && stale != NULL &&
+            stale_servable(stale, config.stale_if_error)) {
+            // Failed like an origin that is down, the stale copy stands in
+            printf("Remote server answered %d\n", framing.status);
+            result = -1;
+            break;
+        }
+        if (client_keep_alive < 0) {
+            // Decide about caching before anything goes out
+            if (key != NULL && http_response_cacheable(window, framing.header_len) &&
+                (framing.mode != FRAMING_LENGTH ||
+                 framing.message_len <= MAX_ELEMENT_SIZE)) {
+                cache_fill_init(&fill);
+                filling = 1;
+            } else if (shared != NULL) {
+                // Not kept, so not shared either
+                inflight_end(shared, INFLIGHT_UNSHARED, 0);
+            }
+            long long body_len = complete ? framing.message_len - framing.header_len : -1;
+            client_keep_alive = clientSocketId < 0 ? 0 :
+                                send_response_header(clientSocketId, window,
+                                                     framing.header_len, body_len,
+                                                     keep_alive);
+            if (client_keep_alive < 0) {
+                perror("Error sending data to client");
+                result = 0;
+                break;
+            }
+            sent = framing.header_len;
+        }
+
+        // Bytes past the end of the message are not part of this response
+        long long stop = complete ? framing.message_len : end;
+        if (filling) {
+            long long from = fill.len;
+            if (cache_fill_append(&fill, window + (from - offset), stop - from) < 0) {
+                // Too big to cache after all, keep relaying without a copy
+                filling = 0;
+                if (shared != NULL) {
+                    inflight_end(shared, INFLIGHT_FAILED, 0);
+                }
+            } else if (shared != NULL) {
+                inflight_append(shared, window + (from - offset), stop - from);
+            }
+        }
+        if (clientSocketId >= 0 && stop > sent) {
+            if (send_all(clientSocketId, window + (sent - offset), stop - sent) < 0) {
+                perror("Error sending data to client");
+                result = 0;
+                break;
+            }
+            sent = stop;
+        }
+
+        if (complete) {
+            if (filling) {
+                // Cached before the fetch is ended, a request that no longer
+                // finds the fetch in flight finds the response
+                cache_fill_finish(&fill, key);
+                filling = 0;
+                if (shared != NULL) {
+                    inflight_end(shared, INFLIGHT_DONE, 0);
+                }
+            }
+            *reusable = framing.reusable && !closed && end == framing.message_len;
+            result = client_keep_alive;
+            break;
+        }
+        if (closed) {
+            printf("Remote server closed in the middle of the response\n");
+            result = 0;
+            break;
+        }
+
+        if (!filling && clientSocketId < 0) {
+            // Fetched for the cache only and it is not kept
+            result = 0;
+            break;
+        }
+
+        // Nothing of the rest has to be looked at, hand it to the kernel.
+        // Chunked bodies stay on the copying path, their size lines have to
+        // be parsed.
+        if (!filling && config.splice_relay &&
+            (framing.mode == FRAMING_LENGTH || framing.mode == FRAMING_CLOSE)) {
+            long long remaining = framing.mode == FRAMING_LENGTH ?
+                                  framing.message_len - end : -1;
+            if (splice_body(remoteSocketId, clientSocketId, remaining, &sent) < 0) {
+                result = 0;
+            } else {
+                *reusable = framing.mode == FRAMING_LENGTH && framing.reusable;
+                result = client_keep_alive;
             }
-            temp_buffer = new_buffer;
+            break;
+        }
+
+        // Drop what has been sent, except what the chunk parser still needs
+        long long keep_from = stop;
+        if (framing.mode == FRAMING_CHUNKED && framing.chunk_pos < keep_from) {
+            keep_from = framing.chunk_pos;
+        }
+        if (keep_from > offset) {
+            memmove(window, window + (keep_from - offset), end - keep_from);
+            buffered = end - keep_from;
+            offset = keep_from;
+        }
+    }
+
+    long long total = __atomic_add_fetch(&relayed_bytes, sent, __ATOMIC_RELAXED);
+    printf("Relayed %lld bytes from remote server, %lld of %lld zero-copy so far\n",
+           sent, __atomic_load_n(&zero_copy_bytes, __ATOMIC_RELAXED), total);
+    if (filling) {
+        cache_fill_abort(&fill);
+    }
+    free(window);
+    return result;
+}
+
+cache_element* prepare_revalidation(struct ParsedRequest* request,
+                                    const struct cache_key* key){
+    if (ParsedHeader_get(request, "If-None-Match") != NULL ||
+        ParsedHeader_get(request, "If-Modified-Since") != NULL) {
+        // The client's own validators go to the origin as they are
+        return NULL;
+    }
+    cache_element* stale = cache_peek(key, 1);
+    if (stale == NULL) {
+        return NULL;
+    }
+    char etag[256], modified[64];
+    int header_len = http_response_header_end(stale->data, stale->parts[0].iov_len);
+    int has_etag = header_len > 0 &&
+                   http_response_header(stale->data, header_len, "ETag", etag,
+                                        sizeof(etag)) > 0;
+    int has_modified = header_len > 0 &&
+                       http_response_header(stale->data, header_len, "Last-Modified",
+                                            modified, sizeof(modified)) > 0;
+    if (!has_etag && !has_modified) {
+        // Nothing to revalidate with, but it may stand in if the origin fails
+        if (stale_servable(stale, config.stale_if_error)) {
+            return stale;
         }
+        cache_release(stale);
+        return NULL;
+    }
+    if ((has_etag && ParsedHeader_set(request, "If-None-Match", etag) < 0) ||
+        (has_modified && ParsedHeader_set(request, "If-Modified-Since", modified) < 0)) {
+        cache_release(stale);
+        return NULL;
+    }
+    return stale;
+}
 
-        // Copy the received data to temp_buffer
-        memcpy(temp_buffer + temp_buffer_index, buf, bytes_received);
-        temp_buffer_index += bytes_received;
+int stale_servable(cache_element* stale, int window){
+    time_t expires = __atomic_load_n(&stale->expires, __ATOMIC_RELAXED);
+    if (window <= 0 || expires == 0 || time(NULL) >= expires + window) {
+        return 0;
     }
+    int header_len = http_response_header_end(stale->data, stale->parts[0].iov_len);
+    return header_len > 0 && !http_response_must_revalidate(stale->data, header_len);
+}
 
-    if (bytes_received < 0) {
-        perror("Error receiving data from remote server");
+cache_element* find_stale(const struct cache_key* key, int window){
+    cache_element* stale = window > 0 ? cache_peek(key, 1) : NULL;
+    if (stale != NULL && !stale_servable(stale, window)) {
+        cache_release(stale);
+        return NULL;
     }
+    return stale;
+}
 
-    // Print the received response (for debugging)
-    printf("Received %d bytes from remote server\n", temp_buffer_index);
-    printf("Response: %.*s\n", temp_buffer_index, temp_buffer);
+// handle_request() once the request is final
+static int fetch_from_origin(int clientSocketId, struct ParsedRequest* request,
+                             const struct cache_key* key, int keep_alive,
+                             struct inflight* shared, cache_element* stale) {
+    char* buf = (char*)malloc(MAX_BYTES);
+    if (buf == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
 
-    // Handle cache and client response
-    add_cache_element(temp_buffer, temp_buffer_index, tempReq);
+    int pooling = upstream_pool.max_idle > 0;
+    int req_len = build_upstream_request(request, buf, MAX_BYTES, pooling);
+    if (req_len < 0) {
+        printf("Request does not fit in %d bytes\n", MAX_BYTES);
+        free(buf);
+        return -1;
+    }
 
-    // Send the received data to the client
-    if (send(clientSocketId, temp_buffer, temp_buffer_index, 0) < 0) {
-        perror("Error sending data to client");
+    int server_port = request->port ? atoi(request->port) : 80;
+    int got_nothing, reusable;
+    int remoteSocketId = pooling ? upstream_pool_get(request->host, server_port) : -1;
+    int status = -1;
+
+    if (remoteSocketId >= 0) {
+        printf("Reusing pooled connection to %s:%d\n", request->host, server_port);
+        status = relay_from_origin(remoteSocketId, clientSocketId, buf, req_len,
+                                   key, keep_alive, shared, stale, &got_nothing,
+                                   &reusable);
+        if (status < 0) {
+            close(remoteSocketId);
+            remoteSocketId = -1;
+            if (!got_nothing || status == UPSTREAM_TIMEOUT) {
+                free(buf);
+                return status;
+            }
+            // The origin dropped the idle connection just before we used
+            // it, nothing was lost. Retry on a fresh one.
+        }
+    }
+    if (remoteSocketId < 0) {
+        remoteSocketId = connectRemoteServer(request->host, server_port);
+        if (remoteSocketId < 0) {
+            fprintf(stderr, "Error connecting to remote server\n");
+            free(buf);
+            return remoteSocketId;
+        }
+        status = relay_from_origin(remoteSocketId, clientSocketId, buf, req_len,
+                                   key, keep_alive, shared, stale, &got_nothing,
+                                   &reusable);
+        if (status < 0) {
+            close(remoteSocketId);
+            free(buf);
+            return status;
+        }
+    }
+
+    if (pooling && reusable) {
+        upstream_pool_put(request->host, server_port, remoteSocketId);
+    } else {
+        close(remoteSocketId);
     }
 
     // Clean up
-    close(remoteSocketId);
     free(buf);
-    free(temp_buffer);
+    return status;
+}
 
-    return 0;
+int handle_request(int clientSocketId, struct ParsedRequest* request,
+                   const struct cache_key* key, int keep_alive,
+                   struct inflight* shared) {
+    // If the origin only has to confirm a stale copy, it sends no body
+    cache_element* stale = key != NULL ? prepare_revalidation(request, key) : NULL;
+    int status = fetch_from_origin(clientSocketId, request, key, keep_alive,
+                                   shared, stale);
+    if (status < 0 && clientSocketId >= 0 && stale != NULL &&
+        stale_servable(stale, config.stale_if_error)) {
+        // Those attached to the fetch see the error and do the same
+        if (shared != NULL) {
+            inflight_end(shared, INFLIGHT_FAILED, status);
+        }
+        printf("Origin failed, serving a stale copy\n");
+        status = send_framed_parts(clientSocketId, stale->parts, stale->nparts,
+                                   keep_alive) < 0 ? 0 : keep_alive;
+    }
+    if (stale != NULL) {
+        cache_release(stale);
+    }
+    return status;
+}
+
+// A stale response being refreshed while it is served
+struct refresh {
+    char* request;              // the request that found it stale
+    int len;
+    struct cache_key key;
+    struct inflight* shared;
+};
+
+static void* refresh_fn(void* arg){
+    struct refresh* r = (struct refresh*)arg;
+    struct ParsedRequest* request = ParsedRequest_create();
+    int status = 0;
+    if (ParsedRequest_parse(request, r->request, r->len) < 0) {
+        printf("Parsing failed\n");
+    } else {
+        status = handle_request(-1, request, &r->key, 0, r->shared);
+    }
+    inflight_end(r->shared, INFLIGHT_FAILED, status);
+    inflight_release(r->shared);
+    ParsedRequest_destroy(request);
+    free(r->request);
+    free(r);
+    return NULL;
+}
+
+void refresh_in_background(const char* raw, int len, const struct cache_key* key){
+    // Joining the fetches in flight makes it one refresh per key, and
+    // requests that find nothing servable wait for it like for any fetch
+    int leader;
+    struct inflight* shared = inflight_join(key, &leader);
+    if (shared == NULL) {
+        return;
+    }
+    if (!leader) {
+        inflight_release(shared);
+        return;
+    }
+    struct refresh* r = (struct refresh*)malloc(sizeof(struct refresh));
+    char* copy = (char*)malloc(len + 1);
+    if (r == NULL || copy == NULL) {
+        perror("Memory allocation failed");
+        free(r);
+        free(copy);
+        inflight_end(shared, INFLIGHT_FAILED, 0);
+        inflight_release(shared);
+        return;
+    }
+    memcpy(copy, raw, len);
+    copy[len] = '\0';
+    r->request = copy;
+    r->len = len;
+    r->key = *key;
+    r->shared = shared;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, refresh_fn, r) != 0) {
+        perror("pthread_create failed");
+        // Attached requests fetch on their own
+        inflight_end(shared, INFLIGHT_FAILED, 0);
+        inflight_release(shared);
+        free(copy);
+        free(r);
+    }
+    pthread_attr_destroy(&attr);
 }
 
 
+// Passes on the response another request is fetching for the same key,
+// reframed for our client the way relay_from_origin() does. Sets
+// *fallback if the fetch ended without anything for us, and the client is
+// still waiting for an answer of its own. Returns what handle_request does.
+static int relay_from_inflight(struct inflight* f, int clientSocketId,
+                               int keep_alive, int* fallback){
+    *fallback = 0;
+    char* window = (char*)malloc(RELAY_BUFFER);
+    if (window == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int buffered = 0;
+    int header_len;
+    while (1) {
+        if (buffered == RELAY_BUFFER) {
+            printf("Response does not fit in %d bytes\n", RELAY_BUFFER);
+            free(window);
+            return -1;
+        }
+        int n = inflight_read(f, buffered, window + buffered, RELAY_BUFFER - buffered);
+        if (n <= 0) {
+            free(window);
+            // The fetch has ended, its state no longer changes. The client
+            // of the fetcher going away is no reason to fail ours.
+            if (f->state == INFLIGHT_UNSHARED ||
+                (f->state == INFLIGHT_FAILED && f->status >= 0)) {
+                *fallback = 1;
+                return -1;
+            }
+            return f->state == INFLIGHT_FAILED ? f->status : -1;
+        }
+        buffered += n;
+        header_len = http_response_header_end(window, buffered);
+        if (header_len > 0) {
+            break;
+        }
+    }
+
+    struct response_framing framing;
+    http_framing_init(&framing);
+    int complete = http_framing_update(&framing, window, buffered);
+    long long body_len = complete ? framing.message_len - header_len : -1;
+    int client_keep_alive = send_response_header(clientSocketId, window, header_len,
+                                                 body_len, keep_alive);
+    int result = client_keep_alive;
+    long long offset = buffered;        // response bytes read so far
+    long long sent = header_len;
+    if (client_keep_alive < 0) {
+        perror("Error sending data to client");
+        result = 0;
+    } else if (send_all(clientSocketId, window + header_len, buffered - header_len) < 0) {
+        perror("Error sending data to client");
+        result = 0;
+    } else {
+        // The fetcher only shares the response itself, it ends where the
+        // stream does
+        sent = buffered;
+        int n;
+        while ((n = inflight_read(f, offset, window, RELAY_BUFFER)) > 0) {
+            offset += n;
+            if (send_all(clientSocketId, window, n) < 0) {
+                perror("Error sending data to client");
+                break;
+            }
+            sent += n;
+        }
+        if (n != 0) {
+            // Cut off, by the origin or by our client
+            result = 0;
+        }
+    }
+    __atomic_add_fetch(&relayed_bytes, sent, __ATOMIC_RELAXED);
+    printf("Relayed %lld bytes of a response fetched for another request\n", sent);
+    free(window);
+    return result;
+}
+
+// Fetches what a request for key missed in every tier, unless a request
+// for the same key is fetching it already. Then we wait for its bytes and
+// pass them on, so a burst of misses makes one trip to the origin. Returns
+// what handle_request does.
+static int fetch_coalesced(int socket, struct ParsedRequest* request,
+                           const struct cache_key* key, int keep_alive){
+    int leader;
+    struct inflight* shared = inflight_join(key, &leader);
+    if (shared == NULL) {
+        return handle_request(socket, request, key, keep_alive, NULL);
+    }
+    int status;
+    if (!leader) {
+        int fallback;
+        status = relay_from_inflight(shared, socket, keep_alive, &fallback);
+        inflight_release(shared);
+        if (!fallback && status >= 0) {
+            return status;
+        }
+        // A revalidation leaves the response in the cache, a failed fetch
+        // may leave a stale copy to stand in
+        cache_element* cached = cache_peek(key, 0);
+        if (cached == NULL && !fallback) {
+            cached = find_stale(key, config.stale_if_error);
+            if (cached == NULL) {
+                return status;
+            }
+            printf("Origin failed, serving a stale copy\n");
+        }
+        if (cached == NULL) {
+            return handle_request(socket, request, key, keep_alive, NULL);
+        }
+        status = send_framed_parts(socket, cached->parts, cached->nparts,
+                                   keep_alive) < 0 ? 0 : keep_alive;
+        cache_release(cached);
+        return status;
+    }
+
+    // The fetcher before us caches the response before it leaves the
+    // table, so it may have done both since our lookup
+    cache_element* cached = cache_peek(key, 0);
+    if (cached != NULL) {
+        inflight_end(shared, INFLIGHT_UNSHARED, 0);
+        inflight_release(shared);
+        status = send_framed_parts(socket, cached->parts, cached->nparts,
+                                   keep_alive) < 0 ? 0 : keep_alive;
+        cache_release(cached);
+        return status;
+    }
+    status = handle_request(socket, request, key, keep_alive, shared);
+    // A no-op if the response was complete or never shared
+    inflight_end(shared, INFLIGHT_FAILED, status);
+    inflight_release(shared);
+    return status;
+}
 
 int checkHTTPversion(char* msg){
     int version = -1;
@@ -337,184 +998,316 @@ int checkHTTPversion(char* msg){
 }
 
 
-void *thread_fn(void *socketNew){
-    // Using a semaphore. If the value has become negative then it waits, 
-    // otherwise it proceeds.
-    sem_wait(&semaphore);
-    int p;
-    sem_getvalue(&semaphore, &p);
-    printf("Semaphore value is %d\n", p);
-
-    // Making a pointer
-    int *t = (int*) socketNew;
-    // Getting the value out of the pointer
-    int socket = *t;
-
-    // Now that a thread + socket has been allocated to the client, he will 
-    // start sending bytes. We need to receive them.
-    int bytes_send_client, len;
-
-    char *buffer = (char*)calloc(MAX_BYTES, sizeof(char));
-    bzero(buffer, MAX_BYTES);
-    // Params - 
-    bytes_send_client = recv(socket, buffer, MAX_BYTES, 0);
-    
-    while(bytes_send_client > 0){
-        len = strlen(buffer);
-        // Any HTTP request ends with "\r\n\r\n", we need to compare substring
-        // and see if we have reached that spot or not. If no then we must 
-        // keep reading else break out of the loop
-        if (strstr(buffer, "\r\n\r\n") == NULL){
-            bytes_send_client = recv(socket, buffer + len, MAX_BYTES - len, 0);
-        } else {
-            break;
+// Reads one request (up to and including the "\r\n\r\n") into buffer, which
+// may already hold *buffered bytes left over from the previous request.
+// timeout_ms bounds how long we wait for the client, -1 waits forever.
+// Returns the length of the request, 0 if the client closed or went idle
+// and -1 on errors.
+static int read_client_request(int socket, char* buffer, int* buffered,
+                               int timeout_ms){
+    while (1) {
+        char* end = strstr(buffer, "\r\n\r\n");
+        if (end != NULL) {
+            return end + 4 - buffer;
+        }
+        if (*buffered >= MAX_BYTES) {
+            // Headers do not fit in our buffer
+            sendErrorMessage(socket, 400);
+            return -1;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = socket;
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0) {
+            printf("Client is idle, closing the connection\n");
+            return 0;
+        }
+        if (ready < 0) {
+            perror("poll failed");
+            return -1;
         }
+
+        int bytes_send_client = recv(socket, buffer + *buffered,
+                                     MAX_BYTES - *buffered, 0);
+        if (bytes_send_client == 0) {
+            printf("Client is disconnected\n");
+            return 0;
+        }
+        if (bytes_send_client < 0) {
+            perror("Error receiving request");
+            return -1;
+        }
+        *buffered += bytes_send_client;
+        buffer[*buffered] = '\0';
     }
+}
 
-    // Dynamically allocating this because sizeof-character tends to 
-    // differ from OS-to-OS so we cannot hardcode this value
-    char *tempReq = (char *)malloc(strlen(buffer) + 1);
-;
-    for(int i = 0; i < strlen(buffer); i++){
-        tempReq[i] = buffer[i];
+// Whether the client allows the connection to stay open after this request.
+// HTTP/1.1 keeps it open unless told otherwise, HTTP/1.0 only on request.
+static int client_wants_keep_alive(struct ParsedRequest* request){
+    int keep_alive = request->version && !strcmp(request->version, "HTTP/1.1");
+    const char* headers[] = {"Connection", "Proxy-Connection"};
+    for (int i = 0; i < 2; i++) {
+        struct ParsedHeader* h = ParsedHeader_get(request, headers[i]);
+        if (h == NULL) {
+            continue;
+        }
+        if (!strcasecmp(h->value, "close")) {
+            return 0;
+        }
+        if (!strcasecmp(h->value, "keep-alive")) {
+            keep_alive = 1;
+        }
+    }
+    return keep_alive;
+}
+
+// Answers one request. keep_alive says whether we are willing to keep the
+// connection. Returns 1 if the client may send another request.
+static int serve_request(int socket, char* tempReq, int len, int keep_alive){
+    int bytes_send_client;
+    struct ParsedRequest* request = ParsedRequest_create();
+
+    if(ParsedRequest_parse(request, tempReq, len) < 0){
+        printf("Parsing failed\n");
+        sendErrorMessage(socket, 400);
+        ParsedRequest_destroy(request);
+        return 0;
+    }
+    keep_alive = keep_alive && client_wants_keep_alive(request);
+
+    // Requests for the same resource share one entry whatever their headers
+    // and spelling, those without a usable key bypass the cache
+    struct cache_key key;
+    int has_key = request->host && request->path &&
+                  cache_key_build(&key, request->method, request->host,
+                                  request->port, request->path) == 0;
+    struct cache_element* temp = has_key ? find(&key) : NULL;
+    if (temp == NULL && has_key && snapshot_load(&key)) {
+        // Not restored from the last snapshot or upgrade image yet
+        temp = find(&key);
+    }
+    // Memory misses go to the disk tier, read right here on the worker
+    char* stored = NULL;
+    int stored_len;
+    if (temp == NULL && has_key && config.disk_cache != NULL) {
+        stored = disk_cache_read(&key, &stored_len, config.disk_promote);
+    }
+    // Then to what expired lately, if it may be served until it is refreshed
+    struct cache_element* stale = NULL;
+    if (temp == NULL && stored == NULL && has_key) {
+        stale = find_stale(&key, config.stale_while_revalidate);
     }
-    struct cache_element* temp = find(tempReq);
 
     // if the element is found in LRU cache
     if(temp != NULL){
-        int size = temp -> len / sizeof(char);
-        int pos = 0;
-        char response[MAX_BYTES];
-        while(pos < size){
-            bzero(response, MAX_BYTES);
-            for(int i = 0; i < MAX_BYTES; i++){
-                response[i] = temp -> data[i];
-                pos++;
+        if (send_framed_parts(socket, temp->parts, temp->nparts, keep_alive) < 0) {
+            perror("Error sending data to client");
+            keep_alive = 0;
+        }
+        // It may have been evicted while we were sending, only now can it go
+        cache_release(temp);
+        printf("Data retrived from the cache\n");
+    }
+    else if(stored != NULL){
+        if (send_framed_response(socket, stored, stored_len, keep_alive) < 0) {
+            perror("Error sending data to client");
+            keep_alive = 0;
+        }
+        free(stored);
+        printf("Data retrived from the disk cache\n");
+    }
+    else if(stale != NULL){
+        // The client does not wait for the origin, the refresh runs behind
+        refresh_in_background(tempReq, len, &key);
+        if (send_framed_parts(socket, stale->parts, stale->nparts, keep_alive) < 0) {
+            perror("Error sending data to client");
+            keep_alive = 0;
+        }
+        cache_release(stale);
+        printf("Stale data retrived from the cache, refreshing it\n");
+    }
+    else if(!strcmp(request -> method, "GET")){
+        if(request->host && 
+            request->path && 
+            checkHTTPversion(request->version) == 1){
+            
+            bytes_send_client = has_key ?
+                                fetch_coalesced(socket, request, &key, keep_alive) :
+                                handle_request(socket, request, NULL, keep_alive, NULL);
+            if(bytes_send_client == UPSTREAM_TIMEOUT){
+                // Origin did not answer in time
+                sendErrorMessage(socket, 504);
+                keep_alive = 0;
+            } else if(bytes_send_client == -1){
+                // Internal server error - due to main server
+                sendErrorMessage(socket, 500);
+                keep_alive = 0;
+            } else if(bytes_send_client == 0){
+                // Response was cut short or ends with the connection
+                keep_alive = 0;
             }
-            send(socket, response, MAX_BYTES, 0);
+        } else {
+            // Internal server error - due to proxy server
+            sendErrorMessage(socket, 500);
+            keep_alive = 0;
         }
-        printf("Data retrived from the cache");
-        printf("%s\n\n", response);
+    } else {
+        printf("This code does not support any method except GET\n");
+        sendErrorMessage(socket, 501);
+        keep_alive = 0;
     }
-    // if element is not found in LRU cache, then first check if the bytes
-    // send by the client is greater than 0 or not (managing invalid requests)
-    else if (bytes_send_client > 0){
-        len = strlen(buffer);
-        struct ParsedRequest* request = ParsedRequest_create();
+    // Free everything
+    ParsedRequest_destroy(request);
+    return keep_alive;
+}
 
-        if(ParsedRequest_parse(request, buffer, len) < 0){
-            printf("Parsing failed\n");
-        } else {
-            bzero(buffer, MAX_BYTES);
-
-            if(!strcmp(request -> method, "GET")){
-                if(request->host && 
-                    request->path && 
-                    checkHTTPversion(request->version) == 1){
-                    
-                    bytes_send_client = handle_request(socket, request, tempReq);
-                    if(bytes_send_client == -1){
-                        // Internal server error - due to main server
-                        sendErrorMessage(socket, 500);
-                    }
-                } else {
-                    // Internal server error - due to proxy server
-                    sendErrorMessage(socket, 500);
-                }
-            } else {
-                printf("This code does not support any method except GET\n");
-            }
+// Runs on a worker of the thread pool for every accepted client socket.
+// The pool size already limits how many clients are served at once.
+// Requests on the same connection are answered one after the other until
+// the client closes, stays idle for too long or reaches the request limit.
+void thread_fn(int socket){
+    char *buffer = (char*)calloc(MAX_BYTES + 1, sizeof(char));
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        close(socket);
+        __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int buffered = 0;
+    int served = 0;
+    int keep_alive = config.keepalive_timeout > 0;
+
+    while (1) {
+        // The first request may take as long as it wants unless keep-alive
+        // is enabled, then the idle timeout also guards against silent clients
+        int timeout_ms = keep_alive ? config.keepalive_timeout * 1000 : -1;
+        int len = read_client_request(socket, buffer, &buffered, timeout_ms);
+        if (len <= 0) {
+            break;
+        }
+
+        // Dynamically allocating this because sizeof-character tends to 
+        // differ from OS-to-OS so we cannot hardcode this value
+        char *tempReq = (char *)malloc(len + 1);
+        memcpy(tempReq, buffer, len);
+        tempReq[len] = '\0';
+
+        // Pipelined bytes of the next request stay in the buffer
+        memmove(buffer, buffer + len, buffered - len);
+        buffered -= len;
+        buffer[buffered] = '\0';
+
+        served++;
+        int more = keep_alive && served < config.max_requests;
+        more = serve_request(socket, tempReq, len, more);
+        free(tempReq);
+        if (!more) {
+            break;
         }
-        // Free everything
-        ParsedRequest_destroy(request);
-    } else if (bytes_send_client == 0){
-        printf("Client is disconnected");
     }
     shutdown(socket, SHUT_RDWR);
     close(socket);
     free(buffer);
-
-    // Release semaphore
-    sem_post(&semaphore);
-    sem_getvalue(&semaphore, &p);
-    printf("Semaphore post value is %d\n", p);
-    free(tempReq);
-
-    return NULL;
-}
-
-
-int main(int argc, char* argv[]){
-    int client_socketId, client_len;
-    // When we open a socket, it returns a descriptor (same as opening files)
-    struct sockaddr_in server_addr, client_addr;
-    // Semaphore - minVal = 0, maxVal = 10
-    sem_init(&semaphore, 0, MAX_CLIENTS);
-    // Initializing lock with NULL
-    pthread_mutex_init(&lock, NULL);
-
-if (argc != 2) {
-    printf("Usage: %s <port_number>\n", argv[0]);
-    exit(EXIT_FAILURE);
-}
-
-int port_number = atoi(argv[1]);
-if (port_number <= 0 || port_number > 65535) {
-    printf("Invalid port number\n");
-    exit(EXIT_FAILURE);
+    __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
 }
 
 
-
-    printf("Starting Proxy server at port: %d\n", port_number);
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+// Opens a listening socket on port. With reuseport several sockets can be
+// bound to the same port and the kernel spreads new connections over them.
+void initialize_server(int* server_socket, struct sockaddr_in* server_addr,
+                       int port, int backlog, int reuseport){
+    *server_socket = socket(AF_INET, SOCK_STREAM, 0);
 
     // If socket creation fails, it returns a negative value and exit
-    if (proxy_socketId < 0) {
+    if (*server_socket < 0) {
         perror("Failed to create a socket\n");
         exit(1);
     }
 
     int reuse = 1;
-    if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, 
+    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEADDR, 
         (const char*)&reuse, sizeof(reuse)) < 0) {
         perror("setSockOpt failed\n");
     }
-    bzero((char*)&server_addr, sizeof(server_addr));
+    if (reuseport && setsockopt(*server_socket, SOL_SOCKET, SO_REUSEPORT,
+        (const char*)&reuse, sizeof(reuse)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(1);
+    }
+    bzero((char*)server_addr, sizeof(*server_addr));
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(port);
+    server_addr->sin_addr.s_addr = INADDR_ANY;
 
     // Port binding
-    if (bind(proxy_socketId, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(*server_socket, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
         perror("Port is not available");
         exit(1);
     }
 
-    printf("Binding on port %d\n", port_number);
-    int listen_status = listen(proxy_socketId, MAX_CLIENTS);
-    if (listen_status < 0){
+    if (listen(*server_socket, backlog) < 0){
         perror("Error in listening\n");
         exit(1);
     }
+}
 
-    int i = 0;
-    int Connected_socketId[MAX_CLIENTS];
+// Restricts the calling thread to one CPU (modulo the online CPUs)
+int pin_to_core(int core){
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % ncpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Could not pin thread to core %d: %s\n", core, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// An accept loop owning one listening socket. Accepted clients go to the
+// shared worker pool.
+struct acceptor {
+    int listen_fd;
+    int core;       // CPU to pin to, -1 to leave it unpinned
+    struct thread_pool* pool;
+    pthread_t thread;
+};
+
+static void* acceptor_fn(void* arg){
+    struct acceptor* a = (struct acceptor*)arg;
+    struct sockaddr_in client_addr;
+    int client_socketId, client_len;
+    long long accepted = 0;
+
+    if (a->core >= 0) {
+        pin_to_core(a->core);
+    }
 
-    while(1){
+    int upgrade_slot = upgrade_register(-1);
+    while(upgrade_accepting() || upgrade_pause(upgrade_slot)){
         bzero((char *)&client_addr, sizeof(client_addr));
         client_len = sizeof(client_addr);
-        client_socketId = accept(proxy_socketId, 
+        client_socketId = accept(a->listen_fd, 
                 (struct sockaddr *)&client_addr, 
                 (socklen_t*)&client_len);
 
         if(client_socketId < 0){
+            if (errno == EINTR) {
+                // Woken up to hand the listener over
+                continue;
+            }
             printf("Not able to connect");
             exit(1);
-        } else {
-            Connected_socketId[i] = client_socketId;
         }
+        __atomic_add_fetch(&active_clients, 1, __ATOMIC_RELAXED);
 
         struct sockaddr_in* client_pt = (struct sockaddr_in *)&client_addr;
         // Extract the client address from whichever socket that was opened
@@ -526,106 +1319,373 @@ if (port_number <= 0 || port_number > 65535) {
         printf("Client is connected with port number %d and ip address is %s\n",
                ntohs(client_addr.sin_port), str);
 
-        // All connections are open and have been accepted by the client
-        // Provide a socket to the thread so that other clients can come and 
-        // then a new socket is created and given to them.
-        pthread_create(&tid[i], NULL, thread_fn, (void *)&Connected_socketId[i]);
-        i++;
+        // Queue the socket for the next free worker. Blocks while the
+        // queue is full so bursts are held back instead of piling up threads.
+        thread_pool_submit(a->pool, client_socketId);
+
+        if (++accepted % 1000 == 0) {
+            struct queue_stats stats;
+            thread_pool_stats(a->pool, &stats);
+            printf("Queue stats: depth %d, max depth %d, %lld clients, "
+                   "avg wait %lld us, max wait %lld us\n",
+                   stats.depth, stats.max_depth, stats.total_jobs,
+                   stats.avg_wait_us, stats.max_wait_us);
+            cache_print_stats();
+            if (config.disk_cache != NULL) {
+                disk_cache_print_stats();
+            }
+            inflight_print_stats();
+            upstream_pool_print_stats();
+            dns_cache_print_stats();
+        }
     }
+    return NULL;
+}
 
-    // Deallocate the socket memory
-    close(proxy_socketId);
-    return 1;
+static void usage(char* name){
+    printf("Usage: %s [-m thread|epoll|uring] [-e event_threads] [-t workers] "
+           "[-q queue_depth] [-a acceptors] [-b backlog] [-k keepalive_secs] "
+           "[-r max_requests] [--upstream-idle n] [--upstream-per-host n] "
+           "[--upstream-idle-timeout secs] [--dns-ttl secs] "
+           "[--dns-negative-ttl secs] [--connect-timeout ms] "
+           "[--first-byte-timeout ms] [--read-timeout ms] [--no-splice] "
+           "[--cache-shards n] [--cache-policy clock|slru|arc|s3fifo|gdsf] "
+           "[--no-admission] [--cache-ttl secs] [--revalidate-window secs] "
+           "[--stale-while-revalidate secs] [--stale-if-error secs] "
+           "[--disk-cache file] [--disk-cache-size mb] "
+           "[--no-disk-promote] [--snapshot file] [--snapshot-interval secs] "
+           "[--upgrade-socket path [--takeover]] <port_number>\n", name);
 }
 
-cache_element *find(char* url){
-    // finding element inside linked-list
-    cache_element* site = NULL;
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Remove cache Lock acquired %d\n", temp_lock_val);
-    if(head != NULL){
-        site = head;
-        while(site != NULL){
-            if(!strcmp(site->url, url)){
-                printf("LRU time track before: %ld", site->lru_time_track);
-                printf("\n URL found\n");
-                site->lru_time_track = time(NULL);
-                printf("LRU time track after %ld", site->lru_time_track);
+int main(int argc, char* argv[]){
+    struct sockaddr_in server_addr;
+
+    // Options without a short form
+    enum {
+        OPT_UPSTREAM_IDLE = 256,
+        OPT_UPSTREAM_PER_HOST,
+        OPT_UPSTREAM_IDLE_TIMEOUT,
+        OPT_DNS_TTL,
+        OPT_DNS_NEGATIVE_TTL,
+        OPT_CONNECT_TIMEOUT,
+        OPT_FIRST_BYTE_TIMEOUT,
+        OPT_READ_TIMEOUT,
+        OPT_NO_SPLICE,
+        OPT_CACHE_SHARDS,
+        OPT_CACHE_POLICY,
+        OPT_NO_ADMISSION,
+        OPT_CACHE_TTL,
+        OPT_REVALIDATE_WINDOW,
+        OPT_STALE_WHILE_REVALIDATE,
+        OPT_STALE_IF_ERROR,
+        OPT_DISK_CACHE,
+        OPT_DISK_CACHE_SIZE,
+        OPT_NO_DISK_PROMOTE,
+        OPT_SNAPSHOT,
+        OPT_SNAPSHOT_INTERVAL,
+        OPT_UPGRADE_SOCKET,
+        OPT_TAKEOVER
+    };
+    static struct option long_options[] = {
+        {"upstream-idle",         required_argument, NULL, OPT_UPSTREAM_IDLE},
+        {"upstream-per-host",     required_argument, NULL, OPT_UPSTREAM_PER_HOST},
+        {"upstream-idle-timeout", required_argument, NULL, OPT_UPSTREAM_IDLE_TIMEOUT},
+        {"dns-ttl",               required_argument, NULL, OPT_DNS_TTL},
+        {"dns-negative-ttl",      required_argument, NULL, OPT_DNS_NEGATIVE_TTL},
+        {"connect-timeout",       required_argument, NULL, OPT_CONNECT_TIMEOUT},
+        {"first-byte-timeout",    required_argument, NULL, OPT_FIRST_BYTE_TIMEOUT},
+        {"read-timeout",          required_argument, NULL, OPT_READ_TIMEOUT},
+        {"no-splice",             no_argument,       NULL, OPT_NO_SPLICE},
+        {"cache-shards",          required_argument, NULL, OPT_CACHE_SHARDS},
+        {"cache-policy",          required_argument, NULL, OPT_CACHE_POLICY},
+        {"no-admission",          no_argument,       NULL, OPT_NO_ADMISSION},
+        {"cache-ttl",             required_argument, NULL, OPT_CACHE_TTL},
+        {"revalidate-window",     required_argument, NULL, OPT_REVALIDATE_WINDOW},
+        {"stale-while-revalidate", required_argument, NULL, OPT_STALE_WHILE_REVALIDATE},
+        {"stale-if-error",        required_argument, NULL, OPT_STALE_IF_ERROR},
+        {"disk-cache",            required_argument, NULL, OPT_DISK_CACHE},
+        {"disk-cache-size",       required_argument, NULL, OPT_DISK_CACHE_SIZE},
+        {"no-disk-promote",       no_argument,       NULL, OPT_NO_DISK_PROMOTE},
+        {"snapshot",              required_argument, NULL, OPT_SNAPSHOT},
+        {"snapshot-interval",     required_argument, NULL, OPT_SNAPSHOT_INTERVAL},
+        {"upgrade-socket",        required_argument, NULL, OPT_UPGRADE_SOCKET},
+        {"takeover",              no_argument,       NULL, OPT_TAKEOVER},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:e:t:q:a:b:k:r:", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                // Serving mode: "thread" (default), "epoll" or "uring"
+                if (!strcmp(optarg, "epoll")) {
+                    config.mode = MODE_EPOLL;
+                } else if (!strcmp(optarg, "uring")) {
+                    config.mode = MODE_URING;
+                } else if (!strcmp(optarg, "thread")) {
+                    config.mode = MODE_THREAD;
+                } else {
+                    printf("Unknown mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
                 break;
-            }
-            site = site->next;
+            case 'e':
+                // Number of event loop threads in epoll/uring mode
+                config.event_threads = atoi(optarg);
+                break;
+            case 't':
+                // Number of pre-spawned worker threads in thread mode
+                config.workers = atoi(optarg);
+                break;
+            case 'q':
+                // How many accepted clients may wait for a free worker
+                config.queue_depth = atoi(optarg);
+                break;
+            case 'a':
+                // Number of SO_REUSEPORT listeners, one pinned thread each
+                config.acceptors = atoi(optarg);
+                break;
+            case 'b':
+                // Length of the kernel queue of not yet accepted clients
+                config.backlog = atoi(optarg);
+                break;
+            case 'k':
+                // Seconds a client connection may stay idle between
+                // requests, 0 closes it after every response
+                config.keepalive_timeout = atoi(optarg);
+                break;
+            case 'r':
+                // Requests served on one client connection before closing
+                config.max_requests = atoi(optarg);
+                break;
+            case OPT_UPSTREAM_IDLE:
+                // Idle origin connections kept for reuse, 0 disables pooling
+                config.upstream_max_idle = atoi(optarg);
+                break;
+            case OPT_UPSTREAM_PER_HOST:
+                config.upstream_max_per_host = atoi(optarg);
+                break;
+            case OPT_UPSTREAM_IDLE_TIMEOUT:
+                // 0 keeps idle connections until the origin closes them
+                config.upstream_idle_timeout = atoi(optarg);
+                break;
+            case OPT_DNS_TTL:
+                // Seconds a resolved host is cached, 0 disables the cache
+                config.dns_ttl = atoi(optarg);
+                break;
+            case OPT_DNS_NEGATIVE_TTL:
+                // Seconds a host that failed to resolve is not retried
+                config.dns_negative_ttl = atoi(optarg);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                // Origin timeouts are in milliseconds, 0 waits forever
+                config.connect_timeout = atoi(optarg);
+                break;
+            case OPT_FIRST_BYTE_TIMEOUT:
+                config.first_byte_timeout = atoi(optarg);
+                break;
+            case OPT_READ_TIMEOUT:
+                config.read_timeout = atoi(optarg);
+                break;
+            case OPT_NO_SPLICE:
+                // Copy uncached bodies through user space like cached ones
+                config.splice_relay = 0;
+                break;
+            case OPT_CACHE_SHARDS:
+                // Every shard has its own lock, LRU list and share of MAX_SIZE
+                config.cache_shards = atoi(optarg);
+                break;
+            case OPT_CACHE_POLICY:
+                // What every shard evicts first, "clock" by default
+                config.cache_policy = eviction_policy_find(optarg);
+                if (config.cache_policy == NULL) {
+                    printf("Unknown cache policy %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_NO_ADMISSION:
+                // Let everything that leaves the window into the cache
+                config.cache_admission = 0;
+                break;
+            case OPT_CACHE_TTL:
+                // For responses without Cache-Control max-age or Expires
+                config.cache_ttl = atoi(optarg);
+                break;
+            case OPT_REVALIDATE_WINDOW:
+                // 0 drops stale responses right away, validators or not
+                config.revalidate_window = atoi(optarg);
+                break;
+            case OPT_STALE_WHILE_REVALIDATE:
+                config.stale_while_revalidate = atoi(optarg);
+                break;
+            case OPT_STALE_IF_ERROR:
+                config.stale_if_error = atoi(optarg);
+                break;
+            case OPT_DISK_CACHE:
+                // What memory evicts is kept in this file
+                config.disk_cache = optarg;
+                break;
+            case OPT_DISK_CACHE_SIZE:
+                config.disk_cache_size = atoll(optarg) << 20;
+                break;
+            case OPT_NO_DISK_PROMOTE:
+                // Serve disk hits from disk, leave memory to fresh fetches
+                config.disk_promote = 0;
+                break;
+            case OPT_SNAPSHOT:
+                // Warm the cache up from this file and save it there again
+                // on SIGINT or SIGTERM
+                config.snapshot = optarg;
+                break;
+            case OPT_SNAPSHOT_INTERVAL:
+                config.snapshot_interval = atoi(optarg);
+                break;
+            case OPT_UPGRADE_SOCKET:
+                // A newer binary started with --takeover takes over here
+                config.upgrade_socket = optarg;
+                break;
+            case OPT_TAKEOVER:
+                config.takeover = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
         }
-    } else {
-        printf("URL not found in cache");
     }
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Lock is unlocked");
-    return site;
-}
 
-void remove_cache_element(){
-    // if cache is not empty, search for the node which has the least 
-    // lru_time_track and delete it.
-
-    cache_element *p;
-    cache_element *q;
-    cache_element *temp;
-
-    // Removing elements from a linked list but with a mutex-lock
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Lock is acquired\n");
-    if(head != NULL){
-        for(q=head, p=head, temp=head; q->next != NULL; q = q->next){
-            if(((q->next)->lru_time_track) < (temp->lru_time_track)){
-                temp = q->next;
-                p = q;
-            }
+    if (optind != argc - 1 || (config.takeover && config.upgrade_socket == NULL)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int port_number = atoi(argv[optind]);
+    if (port_number <= 0 || port_number > 65535) {
+        printf("Invalid port number\n");
+        exit(EXIT_FAILURE);
+    }
+    config.port = port_number;
+    upstream_pool_init(config.upstream_max_idle, config.upstream_max_per_host,
+                       config.upstream_idle_timeout);
+    dns_cache_init(config.dns_ttl, config.dns_negative_ttl);
+    cache_init(MAX_SIZE, MAX_ELEMENT_SIZE, config.cache_shards, config.cache_policy,
+               config.cache_admission);
+    cache.default_ttl = config.cache_ttl;
+    cache.revalidate_window = config.revalidate_window;
+    cache.stale_window = config.stale_while_revalidate > config.stale_if_error ?
+                         config.stale_while_revalidate : config.stale_if_error;
+    inflight_init();
+    // Before any thread is started, they must not take its signals
+    if (config.snapshot != NULL &&
+        snapshot_init(config.snapshot, config.snapshot_interval, !config.takeover) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (config.disk_cache != NULL &&
+        disk_cache_init(config.disk_cache, config.disk_cache_size) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    cache_start_sweeper();
+    // A client that goes away must make send() and splice() fail with
+    // EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    if (config.acceptors < 1) {
+        config.acceptors = 1;
+    }
+
+    printf("Starting Proxy server at port: %d\n", port_number);
+
+    // With more than one acceptor every one of them gets its own listening
+    // socket on the same port instead of all of them fighting over one.
+    int* listen_fds = (int*)malloc(UPGRADE_MAX_LISTENERS * sizeof(int));
+    if (listen_fds == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    if (config.takeover) {
+        // Same sockets, and as many of them, as the proxy we replace
+        config.acceptors = upgrade_takeover(config.upgrade_socket, listen_fds,
+                                            UPGRADE_MAX_LISTENERS);
+        if (config.acceptors < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (config.acceptors > UPGRADE_MAX_LISTENERS) {
+            config.acceptors = UPGRADE_MAX_LISTENERS;
         }
-        if(temp==head){
-            head = head->next;
+        for (int i = 0; i < config.acceptors; i++) {
+            initialize_server(&listen_fds[i], &server_addr, port_number,
+                              config.backlog, config.acceptors > 1);
+        }
+        printf("Binding on port %d with %d listener(s), backlog %d\n",
+               port_number, config.acceptors, config.backlog);
+    }
+    proxy_socketId = listen_fds[0];
+    if (config.upgrade_socket != NULL &&
+        upgrade_init(config.upgrade_socket, listen_fds, config.acceptors) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.mode == MODE_EPOLL || config.mode == MODE_URING) {
+        // The event loops never return unless they fail to start
+        if (config.mode == MODE_EPOLL) {
+            run_event_loops(listen_fds, config.acceptors, config.event_threads);
         } else {
-            // Removing the least recently used
-            p->next = temp->next;
+            run_uring_loops(listen_fds, config.acceptors, config.event_threads);
+        }
+        for (int i = 0; i < config.acceptors; i++) {
+            close(listen_fds[i]);
         }
+        free(listen_fds);
+        return 1;
+    }
 
-        cache_size = cache_size - (temp->len) - sizeof(cache_element) 
-            - strlen(temp->url) - 1;
+    // Workers are created once here instead of one thread per client
+    struct thread_pool* pool = thread_pool_create(config.workers,
+                                                  config.queue_depth, thread_fn);
+    if (pool == NULL) {
+        exit(1);
+    }
+    printf("Started %d workers with a queue of %d clients\n",
+           pool->nworkers, config.queue_depth);
 
-        // Deallocate things one by one
-        free(temp->data);
-        free(temp->url);
-        free(temp);
+    struct acceptor* acceptors = (struct acceptor*)calloc(config.acceptors,
+                                                          sizeof(struct acceptor));
+    if (acceptors == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    if (config.acceptors == 1) {
+        // A single listener is served right here, like before
+        acceptors[0].listen_fd = listen_fds[0];
+        acceptors[0].core = -1;
+        acceptors[0].pool = pool;
+        acceptor_fn(&acceptors[0]);
+    } else {
+        for (int i = 0; i < config.acceptors; i++) {
+            acceptors[i].listen_fd = listen_fds[i];
+            acceptors[i].core = i;
+            acceptors[i].pool = pool;
+            if (pthread_create(&acceptors[i].thread, NULL, acceptor_fn,
+                               &acceptors[i]) != 0) {
+                perror("pthread_create failed");
+                exit(1);
+            }
+        }
+        for (int i = 0; i < config.acceptors; i++) {
+            pthread_join(acceptors[i].thread, NULL);
+        }
     }
 
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Remove cache lock\n");
-}
+    if (!upgrade_accepting()) {
+        // Handed over, the handoff thread exits once our clients are done
+        upgrade_wait();
+    }
 
-int add_cache_element(char *data, int size, char* url){
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Remove cache Lock acquired %d\n", temp_lock_val);
-    int element_size = size + 1 + strlen(url) + sizeof(cache_element);
-    if(element_size > MAX_ELEMENT_SIZE){
-        // element is too big, do something else
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add cache lock is unlocked");
-    } else {
-        while(cache_size + element_size > MAX_SIZE){
-            remove_cache_element();
-        }
-        cache_element* element = (cache_element*)malloc(sizeof(cache_element));
-        element->data = (char*)malloc(size+1);
-        strcpy(element->data, data);
-        element->url = (char*)malloc(1 + (strlen(url) * sizeof(char)));
-        strcpy(element->url, url);
-        element->lru_time_track = time(NULL);
-        element->next = head;
-        element->len = size;
-
-        cache_size += element_size;
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add cache lock is unlocked\n");
-        return 1;
+    // Deallocate the socket memory
+    for (int i = 0; i < config.acceptors; i++) {
+        close(listen_fds[i]);
     }
-    return 0;
+    free(listen_fds);
+    free(acceptors);
+    return 1;
 }
@@ -0,0 +1,140 @@
+#ifndef PROXY_SERVER_WITH_CACHE_H
+#define PROXY_SERVER_WITH_CACHE_H
+
+#include "cache.h"
+#include "proxy_parse.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define MAX_CLIENTS 10
+#define MAX_BYTES 4096    // bytes allocation space - 4KB
+#define RELAY_BUFFER (4 * MAX_BYTES) // window of a response relayed to a client
+#define SPLICE_CHUNK (1 << 16)       // bytes moved per splice(), one pipe's worth
+#define MAX_ELEMENT_SIZE 4 * (1<<20)
+#define MAX_SIZE 200 * (1<<20) // size of cache
+
+// How the accepted client connections are served
+#define MODE_THREAD 0   // one thread per client (blocking recv/send)
+#define MODE_EPOLL  1   // non-blocking, edge-triggered epoll event loops
+#define MODE_URING  2   // event loops doing their socket I/O through io_uring
+
+// Settings picked up from the command line in main()
+struct proxy_config {
+    int port;
+    int mode;            // MODE_THREAD, MODE_EPOLL or MODE_URING
+    int event_threads;   // number of event loops in MODE_EPOLL/MODE_URING
+    int workers;         // worker threads in MODE_THREAD
+    int queue_depth;     // accepted clients waiting for a worker
+    int acceptors;       // SO_REUSEPORT listeners, each with a pinned thread
+    int backlog;         // listen() backlog of every listener
+    int keepalive_timeout; // idle seconds before a client connection is
+                           // closed, 0 disables keep-alive (MODE_THREAD)
+    int max_requests;    // requests served per client connection
+    int upstream_max_idle;      // idle origin connections kept in total
+    int upstream_max_per_host;  // idle origin connections per host:port
+    int upstream_idle_timeout;  // seconds an idle origin connection is kept
+    int dns_ttl;                // seconds a resolved host name is cached
+    int dns_negative_ttl;       // seconds a failed lookup is cached
+    int connect_timeout;        // ms to establish an origin connection
+    int first_byte_timeout;     // ms from sending the request to the first
+                                // response byte
+    int read_timeout;           // ms the origin may go quiet mid-response
+    int splice_relay;           // move uncached bodies with splice()
+    int cache_shards;           // independently locked parts of the cache
+    const struct eviction_policy* cache_policy;
+    int cache_admission;        // W-TinyLFU admission in front of the policy
+    int cache_ttl;              // seconds responses without freshness info
+                                // are cached, 0 = until evicted
+    int revalidate_window;      // seconds a stale response with an ETag or
+                                // Last-Modified is kept to be revalidated
+    int stale_while_revalidate; // seconds past expiry a response is served
+                                // while it is refreshed in the background
+    int stale_if_error;         // seconds past expiry a response is served
+                                // when the origin fails
+    const char* disk_cache;     // log file of the disk tier, NULL if none
+    long long disk_cache_size;  // bytes of the log
+    int disk_promote;           // move disk hits back into memory
+    const char* snapshot;       // file the cache is saved to, NULL if none
+    int snapshot_interval;      // seconds between saves, 0 = on exit only
+    const char* upgrade_socket; // Unix socket a successor takes over on
+    int takeover;               // take the listeners and cache over from
+                                // the proxy waiting on upgrade_socket
+};
+
+extern struct proxy_config config;
+
+// Response bytes relayed from origins to clients, and how many of them were
+// moved with splice() without being copied through user space
+extern long long relayed_bytes;
+extern long long zero_copy_bytes;
+
+// Client connections accepted and not closed yet, in every mode
+extern long long active_clients;
+
+void initialize_server(int* server_socket, struct sockaddr_in* server_addr,
+                       int port, int backlog, int reuseport);
+int pin_to_core(int core);
+void thread_fn(int socket);
+
+
+int sendErrorMessage(int socket, int status_code);
+int checkHTTPversion(char* msg);
+
+// Fills server_addr for host_addr:port_num. Returns -1 if the host is unknown
+int resolveRemoteServer(char* host_addr, int port_num,
+                        struct sockaddr_in* server_addr);
+// Connects without blocking past config.connect_timeout. Returns the socket,
+// UPSTREAM_TIMEOUT if the origin did not answer in time or -1 on errors.
+int connectRemoteServer(char* host_addr, int port_num);
+
+// Returned when an origin missed one of its deadlines, answered with a 504
+#define UPSTREAM_TIMEOUT -2
+
+struct inflight;
+
+// Fetches the request from the origin and relays the response to the
+// client while it arrives, caching it under key on the side when possible
+// (key may be NULL to bypass the cache). What is cached is also shared
+// with the requests attached to `shared` (NULL if there is none). Returns
+// 1 if the client connection can serve another request and 0 if it has to
+// be closed. -1 if nothing could be sent to the client, UPSTREAM_TIMEOUT if
+// the origin timed out before anything was sent. If the origin fails and a
+// stale copy may stand in for an error, the client gets that instead.
+// clientSocketId is -1 to fetch for the cache only.
+int handle_request(int clientSocketId, struct ParsedRequest* request,
+                   const struct cache_key* key, int keep_alive,
+                   struct inflight* shared);
+
+// Looks for a stale copy of key the origin can confirm with a conditional
+// request, and adds its ETag and Last-Modified to request as If-None-Match
+// and If-Modified-Since. A copy without them is returned as well if it may
+// stand in when the origin fails. Returns it with a reference the caller
+// gives back, NULL if there is none or the client made the request
+// conditional itself.
+cache_element* prepare_revalidation(struct ParsedRequest* request,
+                                    const struct cache_key* key);
+
+// Whether stale may still be served, up to window seconds after it expired,
+// and the origin did not ask for it to be revalidated first
+int stale_servable(cache_element* stale, int window);
+
+// The copy of key that expired less than window seconds ago and may be
+// served, with a reference. NULL if there is none.
+cache_element* find_stale(const struct cache_key* key, int window);
+
+// Refreshes key from the origin on a thread of its own, using the raw
+// request that found it stale. Nothing happens if a fetch of key is in
+// flight already.
+void refresh_in_background(const char* raw, int len, const struct cache_key* key);
+
+// Writes the request line and headers sent to the origin into buf, asking
+// the origin to keep the connection open if keep_alive is set. Returns the
+// length written or -1 if it does not fit.
+int build_upstream_request(struct ParsedRequest* request, char* buf, int size,
+                           int keep_alive);
+
+#endif // PROXY_SERVER_WITH_CACHE_H
@@ -0,0 +1,209 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Header at the start of every page, its chunks follow
+struct slab_page {
+    struct slab_class* cls;
+    void* free;                 // freed chunks, linked through their first bytes
+    char* untouched;            // chunks from here on were never handed out,
+                                // so the kernel has not backed them yet
+    unsigned used;
+    struct slab_page* prev;     // partial list
+    struct slab_page* next;
+};
+
+#define SLAB_HEADER ((sizeof(struct slab_page) + 63) & ~(size_t)63)
+
+struct slab_allocator slabs;
+
+static void class_init(struct slab_class* c, unsigned chunk_size){
+    pthread_mutex_init(&c->lock, NULL);
+    c->chunk_size = chunk_size;
+    c->per_page = (SLAB_PAGE_SIZE - SLAB_HEADER) / chunk_size;
+}
+
+void slab_init(){
+    unsigned largest = SLAB_PAGE_SIZE - SLAB_HEADER;
+    unsigned size = SLAB_MIN_CHUNK;
+    int n = 0;
+    while (n < SLAB_MAX_CLASSES - 1 && size < largest / 2) {
+        class_init(&slabs.classes[n++], size);
+        size = ((unsigned)(size * SLAB_GROWTH) + 7) & ~7u;
+    }
+    // One chunk per page for whatever is bigger
+    class_init(&slabs.classes[n++], largest);
+    slabs.nclasses = n;
+}
+
+// Smallest class whose chunks fit size
+static struct slab_class* class_of(size_t size){
+    int lo = 0, hi = slabs.nclasses;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slabs.classes[mid].chunk_size < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < slabs.nclasses ? &slabs.classes[lo] : NULL;
+}
+
+size_t slab_chunk_size(size_t size){
+    struct slab_class* c = class_of(size);
+    return c != NULL ? c->chunk_size : 0;
+}
+
+static struct slab_page* page_of(void* chunk){
+    return (struct slab_page*)((uintptr_t)chunk & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+// Maps twice the page size and trims it down to one aligned page
+static struct slab_page* page_map(struct slab_class* c){
+    char* mem = (char*)mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)mem + SLAB_PAGE_SIZE - 1) &
+                            ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    if (aligned > mem) {
+        munmap(mem, aligned - mem);
+    }
+    munmap(aligned + SLAB_PAGE_SIZE, mem + SLAB_PAGE_SIZE - aligned);
+
+    struct slab_page* page = (struct slab_page*)aligned;
+    page->cls = c;
+    page->free = NULL;
+    page->untouched = aligned + SLAB_HEADER;
+    page->used = 0;
+    page->prev = page->next = NULL;
+    c->pages++;
+    __atomic_add_fetch(&slabs.mapped, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    return page;
+}
+
+static void partial_push(struct slab_class* c, struct slab_page* page){
+    page->prev = NULL;
+    page->next = c->partial;
+    if (c->partial != NULL) {
+        c->partial->prev = page;
+    }
+    c->partial = page;
+}
+
+static void partial_unlink(struct slab_class* c, struct slab_page* page){
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        c->partial = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+void* slab_alloc(size_t size){
+    struct slab_class* c = class_of(size);
+    if (c == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&c->lock);
+    struct slab_page* page = c->partial;
+    if (page == NULL && c->empty != NULL) {
+        page = c->empty;
+        c->empty = NULL;
+        partial_push(c, page);
+    } else if (page == NULL) {
+        page = page_map(c);
+        if (page == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        partial_push(c, page);
+    }
+    void* chunk;
+    if (page->free != NULL) {
+        chunk = page->free;
+        page->free = *(void**)chunk;
+    } else {
+        chunk = page->untouched;
+        page->untouched += c->chunk_size;
+    }
+    if (++page->used == c->per_page) {
+        partial_unlink(c, page);
+    }
+    c->used++;
+    c->requested += size;
+    pthread_mutex_unlock(&c->lock);
+    return chunk;
+}
+
+void slab_free(void* chunk, size_t size){
+    struct slab_page* page = page_of(chunk);
+    struct slab_class* c = page->cls;
+    pthread_mutex_lock(&c->lock);
+    if (page->used == c->per_page) {
+        partial_push(c, page);
+    }
+    *(void**)chunk = page->free;
+    page->free = chunk;
+    c->used--;
+    c->requested -= size;
+    if (--page->used > 0) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    partial_unlink(c, page);
+    if (c->empty == NULL) {
+        c->empty = page;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    c->pages--;
+    pthread_mutex_unlock(&c->lock);
+    munmap(page, SLAB_PAGE_SIZE);
+    __atomic_sub_fetch(&slabs.mapped, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+void slab_class_stats(int cls, struct slab_class_stats* stats){
+    struct slab_class* c = &slabs.classes[cls];
+    pthread_mutex_lock(&c->lock);
+    stats->chunk_size = c->chunk_size;
+    stats->pages = c->pages;
+    stats->used = c->used;
+    stats->free = c->pages * c->per_page - c->used;
+    stats->requested = c->requested;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void slab_print_stats(){
+    long long pages = 0, in_chunks = 0, requested = 0;
+    for (int i = 0; i < slabs.nclasses; i++) {
+        struct slab_class_stats stats;
+        slab_class_stats(i, &stats);
+        pages += stats.pages;
+        in_chunks += stats.used * stats.chunk_size;
+        requested += stats.requested;
+    }
+    printf("Slabs: %lld pages, %lld bytes mapped, %lld in chunks, %lld requested\n",
+           pages, __atomic_load_n(&slabs.mapped, __ATOMIC_RELAXED), in_chunks,
+           requested);
+    for (int i = 0; i < slabs.nclasses; i++) {
+        struct slab_class_stats stats;
+        slab_class_stats(i, &stats);
+        if (stats.pages == 0) {
+            continue;
+        }
+        printf("Slab class %2d: %7u byte chunks, %5lld pages, %8lld used, "
+               "%8lld free, %5.1f%% padding\n",
+               i, stats.chunk_size, stats.pages, stats.used, stats.free,
+               stats.used ? 100.0 - 100.0 * stats.requested /
+                                    ((double)stats.used * stats.chunk_size) : 0.0);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE (1 << 20)    // pages are mapped and aligned to this
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH 1.25            // chunk size of a class over the one before
+#define SLAB_MAX_CLASSES 64
+
+struct slab_page;
+
+// Chunks of one size, carved out of pages of SLAB_PAGE_SIZE bytes. Pages
+// with free chunks are on the partial list. A page whose last chunk is
+// freed is kept as the class's empty page if it has none, so a class going
+// back and forth over a page boundary does not map and unmap a page on
+// every insert and eviction. Any other empty page goes back to the kernel
+// at once, so the mapped pages are what the cache really uses plus at most
+// one page per class.
+struct slab_class {
+    pthread_mutex_t lock;
+    unsigned chunk_size;
+    unsigned per_page;
+    struct slab_page* partial;
+    struct slab_page* empty;    // page without chunks in use, NULL if none
+    long long pages;
+    long long used;             // chunks handed out
+    long long requested;        // bytes asked for in the used chunks
+};
+
+struct slab_allocator {
+    struct slab_class classes[SLAB_MAX_CLASSES];
+    int nclasses;
+    long long mapped;           // bytes of all pages, updated atomically
+};
+
+extern struct slab_allocator slabs;
+
+struct slab_class_stats {
+    unsigned chunk_size;
+    long long pages;
+    long long used;
+    long long free;             // chunks of its pages not handed out
+    long long requested;
+};
+
+// Sets the classes up, called once before any other slab function
+void slab_init();
+
+// Size of the chunk slab_alloc(size) hands out, 0 if size is too big
+size_t slab_chunk_size(size_t size);
+
+// A chunk of at least size bytes, NULL if size is too big for the largest
+// class or no page could be mapped. size has to be given back to slab_free.
+void* slab_alloc(size_t size);
+void slab_free(void* chunk, size_t size);
+
+void slab_class_stats(int cls, struct slab_class_stats* stats);
+
+// Prints the mapped total and, for every class in use, how much of its
+// chunks is wasted on padding and how many of them are free
+void slab_print_stats();
+
+#endif // SLAB_H
@@ -0,0 +1,393 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+struct snapshot snapshot = {NULL, 0, -1};
+
+// FNV-1a, continued from h
+static unsigned long long checksum(unsigned long long h, const void* data, size_t len){
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long record_checksum(unsigned long long hash, long long expires,
+                                          const char* url, int url_len,
+                                          const struct iovec* parts, int nparts){
+    unsigned long long h = checksum(14695981039346656037ULL, &hash, sizeof(hash));
+    h = checksum(h, &expires, sizeof(expires));
+    h = checksum(h, url, url_len);
+    for (int i = 0; i < nparts; i++) {
+        h = checksum(h, parts[i].iov_base, parts[i].iov_len);
+    }
+    return h;
+}
+
+static int pread_all(int fd, void* buf, int len, long long offset){
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Reads the record of e, checks it and hands it to the cache. Returns 1 if
+// it is cached under want now, or under any key if want is NULL.
+static int load_entry(struct snapshot_entry* e, const struct cache_key* want){
+    char* buf = (char*)malloc(e->bytes);
+    if (buf == NULL) {
+        perror("Memory allocation failed");
+        return 0;
+    }
+    struct snapshot_record record;
+    int valid = pread_all(snapshot.fd, buf, e->bytes, e->offset) == 0;
+    if (valid) {
+        memcpy(&record, buf, sizeof(record));
+        char* url = buf + sizeof(record);
+        struct iovec data;
+        data.iov_base = url + record.url_len;
+        data.iov_len = record.len;
+        valid = record.magic == SNAPSHOT_RECORD_MAGIC && record.hash == e->hash &&
+                record.url_len >= 0 && record.url_len < CACHE_KEY_MAX &&
+                (long long)sizeof(record) + record.url_len + record.len == e->bytes &&
+                record_checksum(record.hash, record.expires, url, record.url_len,
+                                &data, 1) ==
+                    record.checksum;
+    }
+    if (!valid) {
+        __atomic_add_fetch(&snapshot.corrupt, 1, __ATOMIC_RELAXED);
+        free(buf);
+        return 0;
+    }
+
+    struct cache_key key;
+    key.hash = record.hash;
+    key.len = record.url_len;
+    memcpy(key.url, buf + sizeof(record), key.len);
+    key.url[key.len] = '\0';
+    // A response fetched since we started is newer than ours
+    restore_cache_element(buf + sizeof(record) + key.len, record.len, &key,
+                          record.expires);
+    __atomic_add_fetch(&snapshot.restored, 1, __ATOMIC_RELAXED);
+    free(buf);
+    return want == NULL || (want->len == key.len && !memcmp(want->url, key.url, key.len));
+}
+
+struct snapshot_entry* snapshot_claim(const struct cache_key* key){
+    // Most of the time nothing is being loaded, misses do not need the lock
+    if (__atomic_load_n(&snapshot.fd, __ATOMIC_ACQUIRE) < 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&snapshot.lock);
+    if (snapshot.fd < 0) {
+        pthread_mutex_unlock(&snapshot.lock);
+        return NULL;
+    }
+    struct snapshot_entry* e = snapshot.buckets[key->hash & snapshot.mask];
+    while (e != NULL && e->hash != key->hash) {
+        e = e->next;
+    }
+    if (e == NULL || e->state != SNAPSHOT_WAITING) {
+        pthread_mutex_unlock(&snapshot.lock);
+        return NULL;
+    }
+    e->state = SNAPSHOT_TAKEN;
+    // Keeps the file open until the record is read
+    snapshot.reading++;
+    pthread_mutex_unlock(&snapshot.lock);
+    return e;
+}
+
+int snapshot_load(const struct cache_key* key){
+    struct snapshot_entry* e = snapshot_claim(key);
+    return e != NULL ? snapshot_load_claimed(e, key) : 0;
+}
+
+int snapshot_load_claimed(struct snapshot_entry* e, const struct cache_key* key){
+    int loaded = load_entry(e, key);
+    if (loaded) {
+        __atomic_add_fetch(&snapshot.on_demand, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&snapshot.lock);
+    if (--snapshot.reading == 0) {
+        pthread_cond_signal(&snapshot.idle);
+    }
+    pthread_mutex_unlock(&snapshot.lock);
+    return loaded;
+}
+
+static void* loader_fn(void* arg){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < snapshot.count; i++) {
+        struct snapshot_entry* e = &snapshot.entries[i];
+        pthread_mutex_lock(&snapshot.lock);
+        int mine = e->state == SNAPSHOT_WAITING;
+        e->state = SNAPSHOT_TAKEN;
+        pthread_mutex_unlock(&snapshot.lock);
+        if (mine) {
+            load_entry(e, NULL);
+        }
+    }
+
+    // Misses stop looking at the file, the last of them may still read it
+    pthread_mutex_lock(&snapshot.lock);
+    while (snapshot.reading > 0) {
+        pthread_cond_wait(&snapshot.idle, &snapshot.lock);
+    }
+    close(snapshot.fd);
+    __atomic_store_n(&snapshot.fd, -1, __ATOMIC_RELEASE);
+    free(snapshot.entries);
+    free(snapshot.buckets);
+    snapshot.entries = NULL;
+    snapshot.buckets = NULL;
+    snapshot.count = 0;
+    pthread_mutex_unlock(&snapshot.lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Restored %lld elements from snapshot in %lld ms, %lld on demand, "
+           "%lld corrupt\n", snapshot.restored,
+           (long long)(end.tv_sec - start.tv_sec) * 1000 +
+               (end.tv_nsec - start.tv_nsec) / 1000000,
+           snapshot.on_demand, snapshot.corrupt);
+    return NULL;
+}
+
+// Sets the lock up the first time the module is used
+static void snapshot_setup_once(){
+    pthread_mutex_init(&snapshot.lock, NULL);
+    pthread_cond_init(&snapshot.idle, NULL);
+}
+
+static void snapshot_setup(){
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, snapshot_setup_once);
+}
+
+int snapshot_restore(int fd, const char* path){
+    snapshot_setup();
+    struct snapshot_header header;
+    if (pread_all(fd, &header, sizeof(header), 0) < 0 ||
+        header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.count <= 0) {
+        printf("No usable snapshot in %s\n", path);
+        close(fd);
+        return 0;
+    }
+    pthread_mutex_lock(&snapshot.lock);
+    int busy = snapshot.fd >= 0;
+    pthread_mutex_unlock(&snapshot.lock);
+    if (busy) {
+        printf("Still loading a snapshot, not loading %s\n", path);
+        close(fd);
+        return 0;
+    }
+    snapshot.entries = (struct snapshot_entry*)calloc(header.count,
+                                                       sizeof(struct snapshot_entry));
+    unsigned nbuckets = 1024;
+    while (nbuckets < header.count) {
+        nbuckets *= 2;
+    }
+    snapshot.buckets = (struct snapshot_entry**)calloc(nbuckets,
+                                                        sizeof(struct snapshot_entry*));
+    if (snapshot.entries == NULL || snapshot.buckets == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    snapshot.mask = nbuckets - 1;
+
+    long long offset = sizeof(header);
+    int n = 0;
+    while (n < header.count) {
+        struct snapshot_record record;
+        if (pread_all(fd, &record, sizeof(record), offset) < 0 ||
+            record.magic != SNAPSHOT_RECORD_MAGIC || record.url_len < 0 ||
+            record.url_len >= CACHE_KEY_MAX || record.len < 0) {
+            // Cut short, what we indexed so far is still good
+            printf("Snapshot %s ends after %d of %lld records\n", path, n, header.count);
+            break;
+        }
+        struct snapshot_entry* e = &snapshot.entries[n++];
+        e->hash = record.hash;
+        e->offset = offset;
+        e->bytes = sizeof(record) + record.url_len + record.len;
+        e->state = SNAPSHOT_WAITING;
+        e->next = snapshot.buckets[e->hash & snapshot.mask];
+        snapshot.buckets[e->hash & snapshot.mask] = e;
+        offset += e->bytes;
+    }
+    snapshot.count = n;
+    printf("Loading %d elements from snapshot %s\n", n, path);
+    // Misses may look at the index from now on
+    __atomic_store_n(&snapshot.fd, fd, __ATOMIC_RELEASE);
+    if (pthread_create(&snapshot.loader, NULL, loader_fn, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    return 1;
+}
+
+// Writes the whole of data, or fails
+static int write_all(FILE* f, const void* data, size_t len){
+    return fwrite(data, 1, len, f) == len ? 0 : -1;
+}
+
+int snapshot_write(int fd){
+    snapshot_setup();
+    pthread_mutex_lock(&snapshot.lock);
+    int loading = snapshot.fd >= 0;
+    pthread_mutex_unlock(&snapshot.lock);
+    if (loading) {
+        printf("Snapshot still loading, not saving one\n");
+        return -1;
+    }
+    int own = dup(fd);
+    FILE* f = own >= 0 ? fdopen(own, "w") : NULL;
+    if (f == NULL) {
+        perror("Error writing snapshot");
+        if (own >= 0) {
+            close(own);
+        }
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count;
+    cache_element** elements = cache_elements(&count);
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    int failed = write_all(f, &header, sizeof(header));
+    long long bytes = 0;
+    for (int i = 0; i < count; i++) {
+        cache_element* e = elements[i];
+        if (!failed) {
+            struct snapshot_record record;
+            record.magic = SNAPSHOT_RECORD_MAGIC;
+            record.url_len = e->url_len;
+            record.len = e->len;
+            record.pad = 0;
+            record.hash = e->hash;
+            record.expires = e->expires;
+            record.checksum = record_checksum(e->hash, e->expires, e->url,
+                                              e->url_len, e->parts, e->nparts);
+            failed = write_all(f, &record, sizeof(record)) < 0 ||
+                     write_all(f, e->url, e->url_len) < 0;
+            for (int p = 0; p < e->nparts && !failed; p++) {
+                failed = write_all(f, e->parts[p].iov_base, e->parts[p].iov_len) < 0;
+            }
+            bytes += e->len;
+        }
+        cache_release(e);
+    }
+    free(elements);
+    if (fclose(f) != 0 || failed) {
+        perror("Error writing snapshot");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Wrote %d elements (%lld bytes) to a snapshot in %lld ms\n", count,
+           bytes, (long long)(end.tv_sec - start.tv_sec) * 1000 +
+                      (end.tv_nsec - start.tv_nsec) / 1000000);
+    return 0;
+}
+
+int snapshot_save(){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot.path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating snapshot");
+        return -1;
+    }
+    // Only a complete snapshot may replace the last one
+    if (snapshot_write(fd) < 0 || fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, snapshot.path) < 0) {
+        perror("Error replacing snapshot");
+        unlink(tmp);
+        return -1;
+    }
+    printf("Saved the snapshot to %s\n", snapshot.path);
+    return 0;
+}
+
+// Waits for the next interval or a signal to shut down
+static void* saver_fn(void* arg){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    while (1) {
+        int sig;
+        if (snapshot.interval > 0) {
+            struct timespec timeout = {snapshot.interval, 0};
+            sig = sigtimedwait(&set, NULL, &timeout);
+        } else {
+            sig = sigwaitinfo(&set, NULL);
+        }
+        if (sig > 0) {
+            printf("Shutting down, saving the cache\n");
+            snapshot_save();
+            exit(0);
+        }
+        if (errno == EAGAIN) {
+            snapshot_save();
+        }
+    }
+    return NULL;
+}
+
+int snapshot_init(const char* path, int interval, int load){
+    snapshot_setup();
+    snapshot.path = path;
+    snapshot.interval = interval;
+
+    // Threads started from now on inherit the mask, only the saver takes
+    // these signals
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (load) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 && errno != ENOENT) {
+            perror("Error opening snapshot");
+        }
+        if (fd >= 0 && snapshot_restore(fd, path) < 0) {
+            return -1;
+        }
+    }
+    if (pthread_create(&snapshot.saver, NULL, saver_fn, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cache.h"
+
+#include <pthread.h>
+
+#define SNAPSHOT_MAGIC 0x50414e53u         // "SNAP"
+#define SNAPSHOT_RECORD_MAGIC 0x44524352u  // "RCRD"
+#define SNAPSHOT_VERSION 2
+
+// A snapshot file is this header followed by one record per element
+struct snapshot_header {
+    unsigned magic;
+    unsigned version;
+    long long count;
+};
+
+// Followed by the url and the response
+struct snapshot_record {
+    unsigned magic;
+    int url_len;
+    int len;
+    unsigned pad;
+    unsigned long long hash;
+    long long expires;              // of the element, 0 if never
+    unsigned long long checksum;    // FNV-1a of the hash, expiry, url and
+                                    // response
+};
+
+#define SNAPSHOT_WAITING 0      // still only in the file
+#define SNAPSHOT_TAKEN   1      // loaded, or being loaded, by some thread
+
+// Where a record of the snapshot being loaded is
+struct snapshot_entry {
+    unsigned long long hash;
+    long long offset;
+    int bytes;                  // of the whole record
+    int state;
+    struct snapshot_entry* next;
+};
+
+// Writes the memory cache to a file on shutdown and every interval
+// seconds, and warms it up again from that file on startup.
+//
+// Loading is lazy: only the record headers are read at startup to index
+// the file, then a loader thread moves the records into the cache one by
+// one. A miss on a record the loader has not reached yet loads that one
+// right away, so the hot keys are back as soon as they are asked for.
+// Every record is checked against its checksum, bad ones are skipped, and
+// so are the ones that expired meanwhile.
+struct snapshot {
+    const char* path;
+    int interval;               // seconds between snapshots, 0 = on exit only
+    int fd;                     // file being loaded, -1 when there is none
+    struct snapshot_entry* entries;  // in file order
+    int count;
+    struct snapshot_entry** buckets;
+    unsigned mask;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // signaled when no on-demand load is running
+    int reading;                // on-demand loads running
+    pthread_t loader;
+    pthread_t saver;
+
+    long long restored;         // records back in the cache
+    long long on_demand;        // of them loaded for a miss
+    long long corrupt;          // records that failed their check
+};
+
+extern struct snapshot snapshot;
+
+// Starts loading path if it holds a snapshot and load is set, and a thread
+// that saves a new one there every interval seconds and on SIGINT or
+// SIGTERM, exiting after the latter. Has to be called before any other
+// thread is started, so all of them leave those signals to it. Returns -1
+// on errors.
+int snapshot_init(const char* path, int interval, int load);
+
+// Indexes the snapshot in fd and starts loading it, path only names it in
+// messages. fd is closed once it is loaded. Returns 0 if there was nothing
+// to load, -1 on errors.
+int snapshot_restore(int fd, const char* path);
+
+// Writes every cached element to fd as a snapshot. Returns -1 if it could
+// not, or if the last snapshot is still being loaded, since its records
+// would be lost.
+int snapshot_write(int fd);
+
+// Loads the record of key if the loader did not get to it yet. Returns 1
+// if key is in the cache now.
+int snapshot_load(const struct cache_key* key);
+
+// snapshot_load() in two steps for callers that must not block on the
+// read: snapshot_claim() only takes the lock and returns the record of key
+// if the loader did not get to it yet, NULL otherwise. The record is then
+// read with snapshot_load_claimed(), which has to follow for every record
+// claimed, or the snapshot is never closed.
+struct snapshot_entry* snapshot_claim(const struct cache_key* key);
+int snapshot_load_claimed(struct snapshot_entry* e, const struct cache_key* key);
+
+// snapshot_write() to a new file that replaces path once it is complete
+int snapshot_save();
+
+#endif // SNAPSHOT_H
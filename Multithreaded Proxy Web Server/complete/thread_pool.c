@@ -0,0 +1,144 @@
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static long long elapsed_us(const struct timespec* from, const struct timespec* to){
+    return (to->tv_sec - from->tv_sec) * 1000000LL +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int queue_init(struct work_queue* q, int capacity){
+    q->fds = (int*)malloc(capacity * sizeof(int));
+    q->enqueued_at = (struct timespec*)malloc(capacity * sizeof(struct timespec));
+    if (q->fds == NULL || q->enqueued_at == NULL) {
+        free(q->fds);
+        free(q->enqueued_at);
+        return -1;
+    }
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->max_depth = 0;
+    q->total_jobs = 0;
+    q->total_wait_us = 0;
+    q->max_wait_us = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+static void queue_push(struct work_queue* q, int fd){
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+    int tail = (q->head + q->count) % q->capacity;
+    q->fds[tail] = fd;
+    clock_gettime(CLOCK_MONOTONIC, &q->enqueued_at[tail]);
+    q->count++;
+    if (q->count > q->max_depth) {
+        q->max_depth = q->count;
+    }
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Pops the oldest fd. wait_us and depth report how long it sat in the queue
+// and how many fds are still queued behind it.
+static int queue_pop(struct work_queue* q, long long* wait_us, int* depth){
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    int fd = q->fds[q->head];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *wait_us = elapsed_us(&q->enqueued_at[q->head], &now);
+
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    *depth = q->count;
+    q->total_jobs++;
+    q->total_wait_us += *wait_us;
+    if (*wait_us > q->max_wait_us) {
+        q->max_wait_us = *wait_us;
+    }
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+    return fd;
+}
+
+static void* worker_fn(void* arg){
+    struct thread_pool* pool = (struct thread_pool*)arg;
+    while (1) {
+        long long wait_us;
+        int depth;
+        int socket = queue_pop(&pool->queue, &wait_us, &depth);
+        printf("Queue depth is %d, client waited %lld us\n", depth, wait_us);
+        pool->handler(socket);
+    }
+    return NULL;
+}
+
+struct thread_pool* thread_pool_create(int nworkers, int queue_depth,
+                                       void (*handler)(int socket)){
+    if (nworkers <= 0 || queue_depth <= 0) {
+        fprintf(stderr, "Thread pool needs at least one worker and queue slot\n");
+        return NULL;
+    }
+    struct thread_pool* pool = (struct thread_pool*)malloc(sizeof(struct thread_pool));
+    if (pool == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    if (queue_init(&pool->queue, queue_depth) < 0) {
+        perror("Memory allocation failed");
+        free(pool);
+        return NULL;
+    }
+    pool->handler = handler;
+    pool->nworkers = 0;
+    pool->workers = (pthread_t*)malloc(nworkers * sizeof(pthread_t));
+    if (pool->workers == NULL) {
+        perror("Memory allocation failed");
+        free(pool->queue.fds);
+        free(pool->queue.enqueued_at);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker_fn, pool) != 0) {
+            perror("pthread_create failed");
+            break;
+        }
+        pthread_detach(pool->workers[i]);
+        pool->nworkers++;
+    }
+    if (pool->nworkers == 0) {
+        // Nobody would ever drain the queue
+        free(pool->workers);
+        free(pool->queue.fds);
+        free(pool->queue.enqueued_at);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void thread_pool_submit(struct thread_pool* pool, int socket){
+    queue_push(&pool->queue, socket);
+}
+
+void thread_pool_stats(struct thread_pool* pool, struct queue_stats* stats){
+    struct work_queue* q = &pool->queue;
+    pthread_mutex_lock(&q->mutex);
+    stats->depth = q->count;
+    stats->max_depth = q->max_depth;
+    stats->total_jobs = q->total_jobs;
+    stats->avg_wait_us = q->total_jobs ? q->total_wait_us / q->total_jobs : 0;
+    stats->max_wait_us = q->max_wait_us;
+    pthread_mutex_unlock(&q->mutex);
+}
@@ -0,0 +1,53 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <time.h>
+
+// Bounded queue of accepted client sockets. Any number of acceptors push
+// into it and the pre-spawned workers pop from it, so no thread is created
+// on the request path. When the queue is full the acceptor blocks, which
+// leaves further clients waiting in the kernel listen backlog.
+struct work_queue {
+    int* fds;
+    struct timespec* enqueued_at;   // when each fd was pushed, for wait times
+    int capacity;
+    int head;                       // next slot to pop
+    int count;                      // current depth
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // Statistics, protected by mutex
+    int max_depth;
+    long long total_jobs;
+    long long total_wait_us;
+    long long max_wait_us;
+};
+
+struct queue_stats {
+    int depth;
+    int max_depth;
+    long long total_jobs;
+    long long avg_wait_us;
+    long long max_wait_us;
+};
+
+struct thread_pool {
+    struct work_queue queue;
+    pthread_t* workers;
+    int nworkers;
+    void (*handler)(int socket);    // called by a worker for every fd
+};
+
+// Spawns nworkers threads that run handler() on sockets taken from a queue
+// holding at most queue_depth of them. Returns NULL on failure.
+struct thread_pool* thread_pool_create(int nworkers, int queue_depth,
+                                       void (*handler)(int socket));
+
+// Hands a client socket to the pool, blocking while the queue is full
+void thread_pool_submit(struct thread_pool* pool, int socket);
+
+void thread_pool_stats(struct thread_pool* pool, struct queue_stats* stats);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,100 @@
+#include "timer_wheel.h"
+#include "cache.h"
+
+#include <string.h>
+
+void timer_wheel_init(struct timer_wheel* w, time_t now){
+    memset(w->slots, 0, sizeof(w->slots));
+    w->now = now;
+    w->count = 0;
+}
+
+static void slot_push(cache_element** slot, cache_element* e){
+    e->timer_prev = NULL;
+    e->timer_next = *slot;
+    if (*slot != NULL) {
+        (*slot)->timer_prev = e;
+    }
+    *slot = e;
+    e->timer_slot = slot;
+}
+
+void timer_wheel_add(struct timer_wheel* w, cache_element* e){
+    // Counted from the next tick, which is the next slot of level 0
+    time_t next = w->now + 1;
+    long long delta = (long long)(e->retire_at - next);
+    time_t at = delta > 0 ? e->retire_at : next;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS &&
+           delta >= 1LL << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS) {
+        // Further out than the wheel reaches, it is put back when the last
+        // level comes around to it
+        level--;
+        at = next + (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    int slot = (at >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    slot_push(&w->slots[level][slot], e);
+    w->count++;
+}
+
+void timer_wheel_remove(struct timer_wheel* w, cache_element* e){
+    if (e->timer_slot == NULL) {
+        return;
+    }
+    if (e->timer_prev != NULL) {
+        e->timer_prev->timer_next = e->timer_next;
+    } else {
+        *e->timer_slot = e->timer_next;
+    }
+    if (e->timer_next != NULL) {
+        e->timer_next->timer_prev = e->timer_prev;
+    }
+    e->timer_slot = NULL;
+    w->count--;
+}
+
+// Spreads a slot of an upper level over the levels below, w->now is the
+// tick before the one that reached it
+static void cascade(struct timer_wheel* w, int level, int slot){
+    cache_element* e = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    while (e != NULL) {
+        cache_element* following = e->timer_next;
+        w->count--;
+        timer_wheel_add(w, e);
+        e = following;
+    }
+}
+
+cache_element* timer_wheel_advance(struct timer_wheel* w, time_t now){
+    cache_element* expired = NULL;
+    while (w->now < now && w->count > 0) {
+        time_t tick = w->now + 1;
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) == 0) {
+                cascade(w, level, (tick >> (TIMER_WHEEL_BITS * level)) &
+                                  (TIMER_WHEEL_SLOTS - 1));
+            }
+        }
+        w->now = tick;
+        cache_element** slot = &w->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+        cache_element* e = *slot;
+        *slot = NULL;
+        while (e != NULL) {
+            cache_element* following = e->timer_next;
+            w->count--;
+            e->timer_slot = NULL;
+            e->timer_next = expired;
+            expired = e;
+            e = following;
+        }
+    }
+    if (w->now < now) {
+        // Nothing on the wheel, there is nothing to step through
+        w->now = now;
+    }
+    return expired;
+}
@@ -0,0 +1,40 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <time.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4        // 64^4 seconds, about 194 days, further
+                                    // expiries wait in the last level
+
+typedef struct cache_element cache_element;
+
+// Hierarchical timing wheel of the elements a shard retires at a set time,
+// with a tick of one second. Level 0 has one slot per second of the next 64,
+// level 1 one per 64 seconds of the next 64^2, and so on. Adding and
+// removing an element is O(1). Advancing the wheel by a tick empties one
+// slot of level 0, and every 64 ticks a slot of the level above is spread
+// over the ones below, so an element is moved at most once per level.
+//
+// Elements are linked through cache_element.timer_prev and timer_next,
+// timer_slot points to the head of the slot they are on. Every call is
+// made with the shard lock held.
+struct timer_wheel {
+    cache_element* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    time_t now;                 // last tick the wheel was advanced to
+    unsigned count;
+};
+
+void timer_wheel_init(struct timer_wheel* w, time_t now);
+
+// e->retire_at has to be set. An element whose time has passed already
+// comes out at the next tick.
+void timer_wheel_add(struct timer_wheel* w, cache_element* e);
+void timer_wheel_remove(struct timer_wheel* w, cache_element* e);
+
+// Advances the wheel to now and returns the elements whose time came on
+// the way, linked through timer_next. They are no longer on the wheel.
+cache_element* timer_wheel_advance(struct timer_wheel* w, time_t now);
+
+#endif // TIMER_WHEEL_H
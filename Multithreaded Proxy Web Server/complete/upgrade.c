@@ -0,0 +1,320 @@
+#include "upgrade.h"
+#include "proxy_server_with_cache.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct upgrade_state upgrade = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 1};
+
+int upgrade_register(int wake_fd){
+    pthread_mutex_lock(&upgrade.lock);
+    int slot = upgrade.nthreads < UPGRADE_MAX_THREADS ? upgrade.nthreads++ : -1;
+    if (slot >= 0) {
+        upgrade.threads[slot] = pthread_self();
+        upgrade.wake_fds[slot] = wake_fd;
+        upgrade.stopped[slot] = 0;
+    }
+    pthread_mutex_unlock(&upgrade.lock);
+    return slot;
+}
+
+int upgrade_accepting(){
+    return __atomic_load_n(&upgrade.accepting, __ATOMIC_ACQUIRE);
+}
+
+void upgrade_stopped(int slot){
+    if (slot < 0) {
+        return;
+    }
+    pthread_mutex_lock(&upgrade.lock);
+    upgrade.stopped[slot] = 1;
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+int upgrade_pause(int slot){
+    upgrade_stopped(slot);
+    pthread_mutex_lock(&upgrade.lock);
+    while (!upgrade.accepting && !upgrade.handed_over) {
+        pthread_cond_wait(&upgrade.resumed, &upgrade.lock);
+    }
+    int accepting = upgrade.accepting;
+    pthread_mutex_unlock(&upgrade.lock);
+    return accepting;
+}
+
+// Only there to interrupt accept() and friends with EINTR
+static void wake_up(int sig){
+}
+
+// Wakes the thread in slot up, called with the lock held
+static void wake_thread(int slot){
+    if (upgrade.wake_fds[slot] < 0) {
+        pthread_kill(upgrade.threads[slot], SIGUSR1);
+        return;
+    }
+    unsigned long long one = 1;
+    if (write(upgrade.wake_fds[slot], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write failed");
+    }
+}
+
+// Makes every accepting thread stop. They may be blocked in a system call
+// that started before they could see the flag, so they are interrupted
+// until all of them answered.
+static void stop_accepting(){
+    __atomic_store_n(&upgrade.accepting, 0, __ATOMIC_RELEASE);
+    while (1) {
+        int running = 0;
+        pthread_mutex_lock(&upgrade.lock);
+        for (int i = 0; i < upgrade.nthreads; i++) {
+            if (!upgrade.stopped[i]) {
+                running++;
+                wake_thread(i);
+            }
+        }
+        pthread_mutex_unlock(&upgrade.lock);
+        if (running == 0) {
+            return;
+        }
+        usleep(10000);
+    }
+}
+
+// The handoff failed, every thread takes up accepting again. Threads
+// paused in upgrade_pause() are woken by the broadcast, event loops by
+// their eventfd, which they cannot miss between a check and their wait.
+static void resume_accepting(){
+    pthread_mutex_lock(&upgrade.lock);
+    for (int i = 0; i < upgrade.nthreads; i++) {
+        upgrade.stopped[i] = 0;
+    }
+    __atomic_store_n(&upgrade.accepting, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&upgrade.resumed);
+    for (int i = 0; i < upgrade.nthreads; i++) {
+        if (upgrade.wake_fds[i] >= 0) {
+            wake_thread(i);
+        }
+    }
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+// Binds the Unix socket successors connect to
+static int listen_for_successor(){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, upgrade.path);
+    upgrade.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (upgrade.socket < 0) {
+        perror("Failed to create the upgrade socket");
+        return -1;
+    }
+    unlink(upgrade.path);
+    if (bind(upgrade.socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(upgrade.socket, 1) < 0) {
+        perror("Error binding the upgrade socket");
+        close(upgrade.socket);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_fds(int socket, const struct upgrade_message* message,
+                    const int* fds, int nfds){
+    struct iovec iov;
+    iov.iov_base = (void*)message;
+    iov.iov_len = sizeof(*message);
+    char control[CMSG_SPACE((UPGRADE_MAX_LISTENERS + 1) * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    return sendmsg(socket, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*message) ? 0 : -1;
+}
+
+// Waits for the clients still being served, then exits
+static void drain(){
+    for (int i = 0; i < UPGRADE_DRAIN_SECS * 10; i++) {
+        if (__atomic_load_n(&active_clients, __ATOMIC_RELAXED) == 0) {
+            break;
+        }
+        usleep(100000);
+    }
+    printf("Handed over, exiting with %lld clients open\n",
+           __atomic_load_n(&active_clients, __ATOMIC_RELAXED));
+    exit(0);
+}
+
+static void* handoff_fn(void* arg){
+    while (1) {
+        int successor;
+        while ((successor = accept(upgrade.socket, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                perror("Error accepting successor");
+                return NULL;
+            }
+        }
+        // The successor binds the path again for the upgrade after it
+        close(upgrade.socket);
+        printf("Handing over to a new process\n");
+
+        // Writing a large cache takes a while, clients are still accepted
+        // meanwhile. What is cached after that is not handed over.
+        struct upgrade_message message;
+        message.magic = UPGRADE_MAGIC;
+        message.nlisteners = upgrade.nlisteners;
+        message.has_image = 0;
+        int fds[UPGRADE_MAX_LISTENERS + 1];
+        memcpy(fds, upgrade.listen_fds, upgrade.nlisteners * sizeof(int));
+        int image = memfd_create("proxy-cache", 0);
+        if (image < 0) {
+            perror("memfd_create failed");
+        } else if (snapshot_write(image) == 0) {
+            fds[upgrade.nlisteners] = image;
+            message.has_image = 1;
+        }
+        stop_accepting();
+        int sent = send_fds(successor, &message, fds,
+                            upgrade.nlisteners + message.has_image);
+        if (sent < 0) {
+            perror("Error handing over");
+        }
+        close(successor);
+        if (image >= 0) {
+            close(image);
+        }
+        if (sent == 0) {
+            pthread_mutex_lock(&upgrade.lock);
+            upgrade.handed_over = 1;
+            pthread_cond_broadcast(&upgrade.resumed);
+            pthread_mutex_unlock(&upgrade.lock);
+            drain();
+            return NULL;
+        }
+
+        // The successor got nothing, so the listeners are still ours alone.
+        // Keep serving and wait for it to try again.
+        resume_accepting();
+        if (listen_for_successor() < 0) {
+            printf("No more upgrades, the upgrade socket is gone\n");
+            return NULL;
+        }
+        printf("Accepting again, waiting for upgrades on %s\n", upgrade.path);
+    }
+}
+
+int upgrade_init(const char* path, int* listen_fds, int nlisteners){
+    if (nlisteners > UPGRADE_MAX_LISTENERS) {
+        printf("Too many listeners to hand over\n");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Upgrade socket path %s is too long\n", path);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_up;
+    // No SA_RESTART, blocked calls have to return
+    sigaction(SIGUSR1, &sa, NULL);
+
+    upgrade.path = path;
+    if (listen_for_successor() < 0) {
+        return -1;
+    }
+    upgrade.listen_fds = listen_fds;
+    upgrade.nlisteners = nlisteners;
+    if (pthread_create(&upgrade.handoff, NULL, handoff_fn, NULL) != 0) {
+        perror("pthread_create failed");
+        close(upgrade.socket);
+        return -1;
+    }
+    printf("Waiting for upgrades on %s\n", path);
+    return 0;
+}
+
+int upgrade_takeover(const char* path, int* listen_fds, int max){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0 || connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to the running proxy");
+        if (s >= 0) {
+            close(s);
+        }
+        return -1;
+    }
+
+    // The old process sends once it has written its cache, which may take a
+    // moment, and stopped accepting
+    struct upgrade_message message;
+    struct iovec iov;
+    iov.iov_base = &message;
+    iov.iov_len = sizeof(message);
+    char control[CMSG_SPACE((UPGRADE_MAX_LISTENERS + 1) * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    close(s);
+    struct cmsghdr* cmsg = n == (ssize_t)sizeof(message) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        message.magic != UPGRADE_MAGIC) {
+        printf("Got no sockets from the running proxy\n");
+        return -1;
+    }
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    if (nfds != message.nlisteners + message.has_image || message.nlisteners > max) {
+        printf("Got %d sockets from the running proxy, expected %d\n", nfds,
+               message.nlisteners + message.has_image);
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    for (int i = 0; i < message.nlisteners; i++) {
+        // The old process may have run event loops on them, the mode we
+        // run in sets them up again
+        int flags = fcntl(fds[i], F_GETFL, 0);
+        fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
+        listen_fds[i] = fds[i];
+    }
+    printf("Took over %d listener(s)\n", message.nlisteners);
+    if (message.has_image &&
+        snapshot_restore(fds[message.nlisteners], "upgrade image") < 0) {
+        return -1;
+    }
+    return message.nlisteners;
+}
+
+void upgrade_wait(){
+    pthread_join(upgrade.handoff, NULL);
+}
@@ -0,0 +1,79 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <pthread.h>
+
+#define UPGRADE_MAX_LISTENERS 64
+#define UPGRADE_MAX_THREADS 256     // threads that accept clients
+#define UPGRADE_DRAIN_SECS 30       // the old process waits this long for
+                                    // its clients before it exits anyway
+#define UPGRADE_MAGIC 0x55504752u   // "UPGR"
+
+// What goes along with the file descriptors. They are the listeners, then
+// the cache image if has_image is set.
+struct upgrade_message {
+    unsigned magic;
+    int nlisteners;
+    int has_image;
+};
+
+// Zero-downtime binary upgrades. A proxy started with --upgrade-socket
+// waits on that Unix socket for its successor. When one connects, the
+// cache is written into a memfd as a snapshot image while clients are
+// still accepted, every thread of the old process stops accepting, and
+// the listening sockets and the image are passed over with SCM_RIGHTS. The successor accepts on the same
+// sockets, so clients that connect meanwhile wait in their backlog instead
+// of being refused, and loads the image lazily like a snapshot. The old
+// process serves the clients it has until they are done and exits. If the
+// sockets cannot be passed over, it accepts again and waits for the next
+// successor.
+struct upgrade_state {
+    pthread_mutex_t lock;
+    pthread_cond_t resumed;     // accepting is set again, or handed_over
+    int accepting;              // cleared while a successor takes over
+    int handed_over;            // the successor got the listeners
+    const char* path;
+    int socket;                 // Unix socket the successor connects to
+    int* listen_fds;
+    int nlisteners;
+    pthread_t handoff;
+    // Threads accepting clients. Event loops are woken through an eventfd
+    // they watch, the others with SIGUSR1 to stop.
+    pthread_t threads[UPGRADE_MAX_THREADS];
+    int wake_fds[UPGRADE_MAX_THREADS];  // -1 for threads blocked in accept()
+    int stopped[UPGRADE_MAX_THREADS];
+    int nthreads;
+};
+
+extern struct upgrade_state upgrade;
+
+// Waits on path for a successor, which will get the nlisteners listening
+// sockets in listen_fds. Returns -1 if the socket cannot be set up.
+int upgrade_init(const char* path, int* listen_fds, int nlisteners);
+
+// Takes over from the proxy waiting on path: stores its listening sockets
+// in listen_fds (room for max) and starts loading its cache. Returns the
+// number of listeners, -1 on errors.
+int upgrade_takeover(const char* path, int* listen_fds, int max);
+
+// A thread that accepts clients registers itself. Once
+// upgrade_accepting() turns 0 it has to stop, at the latest after the
+// accept it is blocked in is interrupted, and report it with
+// upgrade_stopped(). If the handoff fails, upgrade_accepting() turns 1
+// again and the thread is woken once more to start over. An event loop
+// passes an eventfd it watches as wake_fd and is woken by writes to it,
+// which stay pending until it reads them, so it has to read the eventfd
+// before it checks upgrade_accepting(). Other threads pass -1 and are
+// interrupted with SIGUSR1.
+int upgrade_register(int wake_fd);
+int upgrade_accepting();
+void upgrade_stopped(int slot);
+
+// For threads that do nothing but accept: reports the stop and blocks
+// until the handoff is over. Returns 1 if they have to accept again.
+int upgrade_pause(int slot);
+
+// Blocks until the handoff is done and the process exits
+void upgrade_wait();
+
+#endif // UPGRADE_H
@@ -0,0 +1,189 @@
+#include "upstream_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct upstream_pool upstream_pool;
+
+static unsigned hash_key(const char* key){
+    // FNV-1a
+    unsigned h = 2166136261u;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+static struct pooled_host* find_host(const char* key, int create){
+    unsigned b = hash_key(key) % POOL_BUCKETS;
+    struct pooled_host* h = upstream_pool.buckets[b];
+    while (h != NULL && strcmp(h->key, key)) {
+        h = h->next;
+    }
+    if (h == NULL && create) {
+        h = (struct pooled_host*)calloc(1, sizeof(struct pooled_host));
+        if (h == NULL) {
+            return NULL;
+        }
+        strncpy(h->key, key, POOL_KEY_LEN - 1);
+        h->next = upstream_pool.buckets[b];
+        upstream_pool.buckets[b] = h;
+    }
+    return h;
+}
+
+// A host without idle connections is removed, so hosts that were visited
+// once do not stay in the table forever
+static void free_host(struct pooled_host* h){
+    struct pooled_host** link = &upstream_pool.buckets[hash_key(h->key) % POOL_BUCKETS];
+    while (*link != h) {
+        link = &(*link)->next;
+    }
+    *link = h->next;
+    free(h);
+}
+
+// Unlinks c from both lists, and frees its host if c was the last of it.
+// Caller closes and frees c.
+static void unlink_conn(struct pooled_conn* c){
+    struct pooled_host* h = c->host;
+    if (c->host_prev) c->host_prev->host_next = c->host_next;
+    else h->conns = c->host_next;
+    if (c->host_next) c->host_next->host_prev = c->host_prev;
+    if (--h->idle == 0) {
+        free_host(h);
+    }
+
+    if (c->lru_prev) c->lru_prev->lru_next = c->lru_next;
+    else upstream_pool.lru_head = c->lru_next;
+    if (c->lru_next) c->lru_next->lru_prev = c->lru_prev;
+    else upstream_pool.lru_tail = c->lru_prev;
+    upstream_pool.idle--;
+}
+
+static void drop_conn(struct pooled_conn* c){
+    unlink_conn(c);
+    close(c->fd);
+    free(c);
+    upstream_pool.dropped++;
+}
+
+// An idle connection must have nothing to read. Readable means the origin
+// closed it (recv returns 0) or sent something we did not ask for.
+static int is_healthy(int fd){
+    char byte;
+    int n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void make_key(char* key, const char* host, int port){
+    snprintf(key, POOL_KEY_LEN, "%s:%d", host, port);
+}
+
+void upstream_pool_init(int max_idle, int max_idle_per_host, int idle_timeout){
+    memset(&upstream_pool, 0, sizeof(upstream_pool));
+    pthread_mutex_init(&upstream_pool.lock, NULL);
+    upstream_pool.max_idle = max_idle;
+    upstream_pool.max_idle_per_host = max_idle_per_host;
+    upstream_pool.idle_timeout = idle_timeout;
+}
+
+int upstream_pool_get(const char* host, int port){
+    char key[POOL_KEY_LEN];
+    make_key(key, host, port);
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&upstream_pool.lock);
+    // Expired connections are closed pool-wide, oldest first. Without a
+    // timeout they stay until the origin closes them.
+    while (upstream_pool.idle_timeout > 0 && upstream_pool.lru_tail != NULL &&
+           now - upstream_pool.lru_tail->idle_since >= upstream_pool.idle_timeout) {
+        drop_conn(upstream_pool.lru_tail);
+    }
+
+    // Looked up again after every drop, the last one frees the host
+    struct pooled_host* h;
+    while (fd < 0 && (h = find_host(key, 0)) != NULL) {
+        // Most recently used first, it is the least likely to be closed
+        struct pooled_conn* c = h->conns;
+        if (!is_healthy(c->fd)) {
+            drop_conn(c);
+            continue;
+        }
+        unlink_conn(c);
+        fd = c->fd;
+        free(c);
+    }
+    if (fd >= 0) {
+        upstream_pool.reused++;
+    } else {
+        upstream_pool.missed++;
+    }
+    pthread_mutex_unlock(&upstream_pool.lock);
+    return fd;
+}
+
+void upstream_pool_put(const char* host, int port, int fd){
+    char key[POOL_KEY_LEN];
+    make_key(key, host, port);
+
+    if (upstream_pool.max_idle <= 0 || upstream_pool.max_idle_per_host <= 0) {
+        close(fd);
+        return;
+    }
+    struct pooled_conn* c = (struct pooled_conn*)calloc(1, sizeof(struct pooled_conn));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&upstream_pool.lock);
+    // Make room: the oldest connection of this host, then the oldest overall.
+    // Either may free the host, it is looked up (or created) afterwards.
+    struct pooled_host* h = find_host(key, 0);
+    if (h != NULL && h->idle >= upstream_pool.max_idle_per_host) {
+        struct pooled_conn* oldest = h->conns;
+        while (oldest->host_next != NULL) {
+            oldest = oldest->host_next;
+        }
+        drop_conn(oldest);
+    }
+    if (upstream_pool.idle >= upstream_pool.max_idle) {
+        drop_conn(upstream_pool.lru_tail);
+    }
+    h = find_host(key, 1);
+    if (h == NULL) {
+        pthread_mutex_unlock(&upstream_pool.lock);
+        free(c);
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->idle_since = time(NULL);
+    c->host = h;
+    c->host_next = h->conns;
+    if (h->conns) h->conns->host_prev = c;
+    h->conns = c;
+    h->idle++;
+    c->lru_next = upstream_pool.lru_head;
+    if (upstream_pool.lru_head) upstream_pool.lru_head->lru_prev = c;
+    else upstream_pool.lru_tail = c;
+    upstream_pool.lru_head = c;
+    upstream_pool.idle++;
+    pthread_mutex_unlock(&upstream_pool.lock);
+}
+
+void upstream_pool_print_stats(){
+    pthread_mutex_lock(&upstream_pool.lock);
+    printf("Upstream pool: %d idle, %lld reused, %lld connected, "
+           "%lld dropped\n",
+           upstream_pool.idle, upstream_pool.reused, upstream_pool.missed,
+           upstream_pool.dropped);
+    pthread_mutex_unlock(&upstream_pool.lock);
+}
@@ -0,0 +1,59 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <pthread.h>
+#include <time.h>
+
+#define POOL_BUCKETS 256
+#define POOL_KEY_LEN 300    // "host:port"
+
+// An idle keep-alive connection to an origin
+struct pooled_conn {
+    int fd;
+    time_t idle_since;
+    struct pooled_host* host;
+    struct pooled_conn* host_prev;   // per-host list, most recent first
+    struct pooled_conn* host_next;
+    struct pooled_conn* lru_prev;    // pool-wide list, most recent first
+    struct pooled_conn* lru_next;
+};
+
+// All idle connections to one host:port
+struct pooled_host {
+    char key[POOL_KEY_LEN];
+    int idle;
+    struct pooled_conn* conns;
+    struct pooled_host* next;        // hash bucket chain
+};
+
+struct upstream_pool {
+    pthread_mutex_t lock;
+    struct pooled_host* buckets[POOL_BUCKETS];
+    struct pooled_conn* lru_head;
+    struct pooled_conn* lru_tail;    // oldest idle connection
+    int idle;
+
+    int max_idle;                    // idle connections kept in total
+    int max_idle_per_host;
+    int idle_timeout;                // seconds before an idle one is closed,
+                                     // 0 for no limit
+
+    long long reused;                // checkouts served from the pool
+    long long missed;                // checkouts that had to connect
+    long long dropped;               // idle connections found dead or expired
+};
+
+extern struct upstream_pool upstream_pool;
+
+void upstream_pool_init(int max_idle, int max_idle_per_host, int idle_timeout);
+
+// Returns a healthy idle connection to host:port, or -1 if there is none
+int upstream_pool_get(const char* host, int port);
+
+// Gives a connection back after a complete response. It is closed instead
+// when the pool or the host is full.
+void upstream_pool_put(const char* host, int port, int fd);
+
+void upstream_pool_print_stats();
+
+#endif // UPSTREAM_POOL_H
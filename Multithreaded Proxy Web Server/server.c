@@ -49,11 +49,14 @@ int cache_size;             // size of the cache
 // function prototypes
 void* handle_client(void* client_socket);
 void sendErrorMessage(int client_socket, int error_code);
-void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int port);
+void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int port,
+                       int backlog, int reuseport);
 void setup_signal_handlers(void);
 
-// initialize the server
-void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int port) {
+// initialize the server. backlog is the listen() queue length, reuseport lets
+// several listeners share the port so the kernel balances clients over them
+void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int port,
+                       int backlog, int reuseport) {
     *server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (*server_socket < 0) {
         perror("socket creation failed");
@@ -67,6 +70,12 @@ void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int
         exit(EXIT_FAILURE);
     }
 
+    if (reuseport && setsockopt(*server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(*server_socket);
+        exit(EXIT_FAILURE);
+    }
+
     memset(server_addr, 0, sizeof(*server_addr));
     server_addr->sin_family = AF_INET;
     server_addr->sin_port = htons(port);
@@ -78,7 +87,7 @@ void initialize_server(int* server_socket, struct sockaddr_in* server_addr, int
         exit(EXIT_FAILURE);
     }
 
-    if (listen(*server_socket, MAX_CLIENTS) < 0) {
+    if (listen(*server_socket, backlog) < 0) {
         perror("listen failed");
         close(*server_socket);
         exit(EXIT_FAILURE);
@@ -104,7 +113,7 @@ int main(int argc, char *argv[]) {
 
     printf("Starting Proxy server at port: %d\n", port_no);
 
-    initialize_server(&socket_id, &server_addr, port_no);
+    initialize_server(&socket_id, &server_addr, port_no, SOMAXCONN, 0);
 
     int i = 0;
     while (1) {